@@ -0,0 +1,183 @@
+// Times the LEB128 readers over the values found in a binary's .debug_abbrev and .debug_line sections.
+//
+//     leb128_bench [ELF]    (defaults to the benchmark itself)
+//
+// The checked readers compact the groups with PEXT when built with BMI2 enabled (e.g. -march=native).
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <span>
+#include <vector>
+
+#include "dwarf.hpp"
+#include "dwarf2.h"
+#include "elf.hpp"
+
+namespace {
+using DWARF::read;
+using DWARF::read_length;
+
+// The values found in the sections, copied back to back into one stream per signedness, so timing them measures
+// decoding rather than walking the DWARF.
+struct Streams {
+    std::vector<uint8_t> unsigned_values;
+    std::vector<uint8_t> signed_values;
+    size_t lengths[11] = {};
+
+    // Reads one value at `p` and records its bytes.
+    uint64_t add(const uint8_t*& p, const uint8_t* end, bool is_signed = false) {
+        const auto* start = p;
+        uint64_t value = is_signed ? DWARF::read_leb128(p, end) : DWARF::read_uleb128(p, end);
+        auto& stream = is_signed ? signed_values : unsigned_values;
+        stream.insert(stream.end(), start, p);
+        ++lengths[std::min<size_t>(p - start, 10)];
+        return value;
+    }
+};
+
+// The decoders the readers replaced, kept as the baseline.
+uint64_t read_uleb128_bytewise(const uint8_t*& p) {
+    uint64_t result = 0;
+    size_t shift = 0;
+    uint8_t byte;
+    do {
+        byte = *p++;
+        result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return result;
+}
+
+int64_t read_leb128_bytewise(const uint8_t*& p) {
+    uint64_t result = 0;
+    size_t shift = 0;
+    uint8_t byte;
+    do {
+        byte = *p++;
+        result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    if ((shift < sizeof(result) * 8) && (byte & 0x40)) result |= -(1UL << shift);
+    return result;
+}
+
+void collect_abbrevs(std::span<const uint8_t> section, Streams& streams) {
+    const auto* p = section.data();
+    const auto* end = p + section.size();
+    while (p < end) {
+        if (streams.add(p, end) == 0) continue;  // end of one unit's table
+        streams.add(p, end);
+        ++p;
+        while (p < end) {
+            auto name = streams.add(p, end);
+            auto form = streams.add(p, end);
+            if (form == DW_FORM_implicit_const) streams.add(p, end, true);
+            if (name == 0 && form == 0) break;
+        }
+    }
+}
+
+// Records the operands of each line program's opcodes; the headers are skipped over.
+void collect_lines(std::span<const uint8_t> section, Streams& streams) {
+    const auto* p = section.data();
+    const auto* end = p + section.size();
+    while (p < end) {
+        bool is_dwarf64;
+        auto len = read_length(p, is_dwarf64);
+        const auto* unit_end = p + len;
+        auto version = read<uint16_t>(p);
+        if (version >= 5) p += 2;
+        uint64_t header_length = is_dwarf64 ? read<uint64_t>(p) : read<uint32_t>(p);
+        const auto* program = p + header_length;
+        p += version >= 4 ? 5 : 4;  // minimum_instruction_length through line_range
+        uint8_t opcode_base = *p++;
+        const auto* opcode_lengths = p;
+        for (p = program; p < unit_end;) {
+            uint8_t op = *p++;
+            if (op >= opcode_base) continue;
+            if (op == DW_LNS_extended_op) {
+                p += streams.add(p, unit_end);
+            } else if (op == DW_LNS_fixed_advance_pc) {
+                p += 2;
+            } else {
+                for (uint8_t i = 0; i < opcode_lengths[op - 1]; ++i) {
+                    streams.add(p, unit_end, op == DW_LNS_advance_line);
+                }
+            }
+        }
+        p = unit_end;
+    }
+}
+
+// Decodes both streams until a quarter of a second has passed. Returns nanoseconds per value and leaves the sum of
+// the values in `checksum`.
+template <typename DecodeUnsigned, typename DecodeSigned>
+double time_per_value(const Streams& streams, size_t count, DecodeUnsigned&& decode_unsigned,
+                      DecodeSigned&& decode_signed, uint64_t& checksum) {
+    using Clock = std::chrono::steady_clock;
+    size_t rounds = 0;
+    auto start = Clock::now();
+    std::chrono::duration<double, std::nano> elapsed{};
+    do {
+        // Summed locally: a reference could alias the streams, forcing a store per value.
+        uint64_t sum = 0;
+        const auto* p = streams.unsigned_values.data();
+        const auto* end = p + streams.unsigned_values.size();
+        while (p < end) {
+            sum += decode_unsigned(p, end);
+        }
+        p = streams.signed_values.data();
+        end = p + streams.signed_values.size();
+        while (p < end) {
+            sum += decode_signed(p, end);
+        }
+        checksum = sum;
+        ++rounds;
+        elapsed = Clock::now() - start;
+    } while (elapsed.count() < 2.5e8);
+    return elapsed.count() / (rounds * count);
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+    ELF elf(argc > 1 ? argv[1] : "/proc/self/exe", 0, true);
+    Streams streams;
+    collect_abbrevs(elf.debug_section(".debug_abbrev"), streams);
+    collect_lines(elf.debug_section(".debug_line"), streams);
+    size_t count = 0;
+    for (auto n : streams.lengths) count += n;
+    if (count == 0) {
+        fprintf(stderr, "%s has no .debug_abbrev or .debug_line\n", elf.path().c_str());
+        return 1;
+    }
+    printf("%zu values from %s:", count, elf.path().c_str());
+    for (size_t i = 1; i <= 10; ++i) {
+        if (streams.lengths[i]) printf(" %zu-byte %.1f%%", i, 100.0 * streams.lengths[i] / count);
+    }
+    printf("\n");
+
+    uint64_t baseline_sum, sum;
+    auto baseline = time_per_value(
+        streams, count, [](const uint8_t*& p, const uint8_t*) { return read_uleb128_bytewise(p); },
+        [](const uint8_t*& p, const uint8_t*) { return read_leb128_bytewise(p); }, baseline_sum);
+    printf("%-24s %6.2f ns/value\n", "byte at a time", baseline);
+    auto report = [&](const char* name, double ns) {
+        printf("%-24s %6.2f ns/value  %.2fx%s\n", name, ns, baseline / ns, sum == baseline_sum ? "" : "  MISMATCH");
+    };
+
+    auto unchecked_unsigned = [](const uint8_t*& p, const uint8_t*) { return DWARF::read_uleb128(p); };
+    auto unchecked_signed = [](const uint8_t*& p, const uint8_t*) { return DWARF::read_leb128(p); };
+    report("unchecked", time_per_value(streams, count, unchecked_unsigned, unchecked_signed, sum));
+
+    auto checked_unsigned = [](const uint8_t*& p, const uint8_t* end) { return DWARF::read_uleb128(p, end); };
+    auto checked_signed = [](const uint8_t*& p, const uint8_t* end) { return DWARF::read_leb128(p, end); };
+#ifdef __BMI2__
+    report("checked, PEXT", time_per_value(streams, count, checked_unsigned, checked_signed, sum));
+#else
+    report("checked", time_per_value(streams, count, checked_unsigned, checked_signed, sum));
+#endif
+    return 0;
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <utility>
+#include <vector>
+
+// Software breakpoints by address, in a flat open-addressing table. The hash slots hold an index into dense arrays,
+// so the addresses, the original bytes under the 0xcc and the injected flags each sit contiguously, with everything
+// else about a breakpoint kept apart in `T`. Indices are stable until a breakpoint is erased.
+template <typename T>
+class BreakpointTable {
+   public:
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    size_t size() const { return m_addrs.size(); }
+    // Returns the index of the breakpoint at `addr`, or NONE.
+    uint32_t find(uint64_t addr) const {
+        if (m_slots.empty()) {
+            return NONE;
+        }
+        size_t mask = m_slots.size() - 1;
+        for (size_t slot = hash(addr) & mask; m_slots[slot] != NONE; slot = (slot + 1) & mask) {
+            if (m_addrs[m_slots[slot]] == addr) {
+                return m_slots[slot];
+            }
+        }
+        return NONE;
+    }
+    bool contains(uint64_t addr) const { return find(addr) != NONE; }
+    // Makes room for `n` breakpoints in all, so that inserting them does not rehash.
+    void reserve(size_t n) {
+        m_addrs.reserve(n);
+        m_orig_bytes.reserve(n);
+        m_injected.reserve(n);
+        m_details.reserve(n);
+        if (2 * n > m_slots.size()) {
+            rehash(n);
+        }
+    }
+    // Adds an uninjected breakpoint at `addr` unless there is one already. Returns its index and whether it is new.
+    std::pair<uint32_t, bool> insert(uint64_t addr) {
+        if (auto i = find(addr); i != NONE) {
+            return {i, false};
+        }
+        if (2 * (size() + 1) > m_slots.size()) {
+            rehash(size() + 1);
+        }
+        auto i = static_cast<uint32_t>(size());
+        m_addrs.push_back(addr);
+        m_orig_bytes.push_back(0);
+        m_injected.push_back(false);
+        m_details.emplace_back();
+        place(i);
+        return {i, true};
+    }
+    // Removes the breakpoint at `addr`, if any. The last breakpoint takes over its index.
+    void erase(uint64_t addr) {
+        auto i = find(addr);
+        if (i == NONE) {
+            return;
+        }
+        auto last = static_cast<uint32_t>(size() - 1);
+        if (i != last) {
+            m_addrs[i] = m_addrs[last];
+            m_orig_bytes[i] = m_orig_bytes[last];
+            m_injected[i] = m_injected[last];
+            m_details[i] = std::move(m_details[last]);
+        }
+        m_addrs.pop_back();
+        m_orig_bytes.pop_back();
+        m_injected.pop_back();
+        m_details.pop_back();
+        // Rehashing is cheap next to the patching that goes with erasing, and leaves no tombstones behind.
+        rehash(size());
+    }
+    // Moves every breakpoint by `delta`, as when a position-independent executable is loaded.
+    void rebase(uint64_t delta) {
+        for (auto& addr : m_addrs) {
+            addr += delta;
+        }
+        rehash(size());
+    }
+
+    uint64_t addr(uint32_t i) const { return m_addrs[i]; }
+    // The byte the 0xcc replaced; only meaningful while injected.
+    uint8_t orig_byte(uint32_t i) const { return m_orig_bytes[i]; }
+    bool injected(uint32_t i) const { return m_injected[i]; }
+    void set_injected(uint32_t i, uint8_t orig_byte) {
+        m_orig_bytes[i] = orig_byte;
+        m_injected[i] = true;
+    }
+    void set_uninjected(uint32_t i) { m_injected[i] = false; }
+    T& details(uint32_t i) { return m_details[i]; }
+    const T& details(uint32_t i) const { return m_details[i]; }
+
+   private:
+    static uint64_t hash(uint64_t addr) {
+        // Fibonacci hashing spreads the nearby and aligned addresses of function entries over the high bits.
+        return (addr * 0x9e3779b97f4a7c15ull) >> 32;
+    }
+    // Resizes the slots for `n` breakpoints at a load factor of at most one half, and places every breakpoint again.
+    void rehash(size_t n) {
+        size_t n_slots = 16;
+        while (n_slots < 2 * n) {
+            n_slots *= 2;
+        }
+        m_slots.assign(n_slots, NONE);
+        for (uint32_t i = 0; i < size(); ++i) {
+            place(i);
+        }
+    }
+    void place(uint32_t i) {
+        size_t mask = m_slots.size() - 1;
+        size_t slot = hash(m_addrs[i]) & mask;
+        while (m_slots[slot] != NONE) {
+            slot = (slot + 1) & mask;
+        }
+        m_slots[slot] = i;
+    }
+
+    std::vector<uint32_t> m_slots;
+    std::vector<uint64_t> m_addrs;
+    std::vector<uint8_t> m_orig_bytes;
+    std::vector<uint8_t> m_injected;
+    std::vector<T> m_details;
+};
@@ -0,0 +1,444 @@
+#include "condition.hpp"
+
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/user.h>
+
+#include <algorithm>
+#include <charconv>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Recursive descent over the C precedence levels. Each subexpression is either a constant, folded on the spot, or a
+// value in a virtual register. Registers are handed out like a stack, so a binary operator's operands are always the
+// two topmost and its result replaces them.
+class Condition::Parser {
+   public:
+    Parser(std::string_view text, const Resolver& resolve, Condition& out)
+        : m_text(text), m_resolve(resolve), m_out(out) {}
+
+    // Parses the whole text, throwing a std::string describing the first error.
+    void run() {
+        Value value = logical_or();
+        skip_space();
+        if (m_pos != m_text.size()) {
+            throw "unexpected `" + std::string(m_text.substr(m_pos)) + "`";
+        }
+        m_next = 0;
+        materialize(value);
+    }
+
+   private:
+    struct Value {
+        std::optional<int64_t> constant = {};
+        uint8_t reg = 0;
+    };
+
+    // Binary operators below && and ||, from the loosest binding level to the tightest.
+    static constexpr int NUM_LEVELS = 8;
+    static std::optional<Op> binary_op(int level, std::string_view token) {
+        static constexpr struct {
+            int level;
+            std::string_view token;
+            Op op;
+        } OPERATORS[] = {
+            {0, "|", OR},  {1, "^", XOR},  {2, "&", AND},  {3, "==", EQ},  {3, "!=", NE},  {4, "<", LT},
+            {4, "<=", LE}, {4, ">", GT},   {4, ">=", GE},  {5, "<<", SHL}, {5, ">>", SHR}, {6, "+", ADD},
+            {6, "-", SUB}, {7, "*", MUL},  {7, "/", DIV},  {7, "%", MOD},
+        };
+        for (const auto& op : OPERATORS) {
+            if (op.level == level && op.token == token) {
+                return op.op;
+            }
+        }
+        return {};
+    }
+
+    void skip_space() {
+        while (m_pos < m_text.size() && isspace(static_cast<unsigned char>(m_text[m_pos]))) {
+            ++m_pos;
+        }
+    }
+    // Returns the operator at the current position, longest match first, or an empty string.
+    std::string_view peek_operator() {
+        static constexpr std::string_view OPERATORS[] = {"||", "&&", "==", "!=", "<=", ">=", "<<", ">>", "|", "^", "&",
+                                                         "<",  ">",  "+",  "-",  "*",  "/",  "%",  "!",  "~", "(", ")"};
+        skip_space();
+        for (auto op : OPERATORS) {
+            if (m_text.substr(m_pos).starts_with(op)) {
+                return op;
+            }
+        }
+        return {};
+    }
+    bool accept(std::string_view op) {
+        if (peek_operator() != op) {
+            return false;
+        }
+        m_pos += op.size();
+        return true;
+    }
+
+    static bool is_name_char(char c) {
+        return isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '.' || c == '@' || c == '$';
+    }
+    // Reads a name: a register, variable or symbol, which may be qualified as in `ns::name` or `libc.so.6!name`.
+    std::string_view name() {
+        skip_space();
+        size_t start = m_pos;
+        while (m_pos < m_text.size()) {
+            if (is_name_char(m_text[m_pos])) {
+                ++m_pos;
+            } else if (m_text.substr(m_pos).starts_with("::")) {
+                m_pos += 2;
+            } else if (m_text[m_pos] == '!' && m_pos + 1 < m_text.size() && m_pos > start &&
+                       is_name_char(m_text[m_pos + 1])) {
+                ++m_pos;
+            } else {
+                break;
+            }
+        }
+        return m_text.substr(start, m_pos - start);
+    }
+
+    uint8_t allocate() {
+        if (m_next == NUM_REGS) {
+            throw std::string("condition is nested too deeply");
+        }
+        return m_next++;
+    }
+    void emit(Insn insn) { m_out.m_code.push_back(insn); }
+    // Puts a value in a register, loading it there if it is a constant.
+    uint8_t materialize(const Value& value) {
+        if (!value.constant) {
+            return value.reg;
+        }
+        uint8_t reg = allocate();
+        emit({.op = CONST, .dst = reg, .imm = static_cast<uint64_t>(*value.constant)});
+        return reg;
+    }
+    Value fixed_load(uint64_t addr, uint8_t size, bool is_signed) {
+        auto& loads = m_out.m_loads;
+        size_t index = 0;
+        while (index < loads.size() &&
+               (loads[index].addr != addr || loads[index].size != size || loads[index].is_signed != is_signed)) {
+            ++index;
+        }
+        if (index == loads.size()) {
+            loads.push_back({addr, size, is_signed});
+        }
+        uint8_t reg = allocate();
+        emit({.op = FIXED, .dst = reg, .size = size, .is_signed = is_signed, .target = static_cast<uint32_t>(index)});
+        return {.reg = reg};
+    }
+    // Applies a unary operation in place.
+    Value unary_op(Op op, Value value, uint8_t size = 8, bool is_signed = false) {
+        if (value.constant) {
+            int64_t c = *value.constant;
+            switch (op) {
+                case NEG:
+                    return {.constant = static_cast<int64_t>(-static_cast<uint64_t>(c))};
+                case NOT:
+                    return {.constant = ~c};
+                case LNOT:
+                    return {.constant = !c};
+                case EXTEND:
+                    return {.constant = extend(c, size, is_signed)};
+                default:
+                    break;
+            }
+        }
+        emit({.op = op, .dst = value.reg, .a = value.reg, .size = size, .is_signed = is_signed});
+        return value;
+    }
+    Value binary(Op op, Value lhs, Value rhs) {
+        if (lhs.constant && rhs.constant) {
+            auto value = apply(op, *lhs.constant, *rhs.constant);
+            if (!value) {
+                throw std::string("division by zero");
+            }
+            return {.constant = *value};
+        }
+        uint8_t a = materialize(lhs);
+        uint8_t b = materialize(rhs);
+        uint8_t dst = std::min(a, b);
+        emit({.op = op, .dst = dst, .a = a, .b = b});
+        m_next = dst + 1;
+        return {.reg = dst};
+    }
+
+    // `lhs || rhs` or `lhs && rhs`, with the operator already consumed.
+    Value short_circuit(Value lhs, bool is_or) {
+        if (lhs.constant) {
+            if ((*lhs.constant != 0) == is_or) {
+                // Decided already: parse the right-hand side for errors, then drop its code.
+                size_t code = m_out.m_code.size();
+                size_t loads = m_out.m_loads.size();
+                uint8_t next = m_next;
+                is_or ? logical_and() : binary_level(0);
+                m_out.m_code.resize(code);
+                m_out.m_loads.resize(loads);
+                m_next = next;
+                return {.constant = is_or};
+            }
+            Value rhs = is_or ? logical_and() : binary_level(0);
+            return rhs.constant ? Value{.constant = *rhs.constant != 0} : unary_op(BOOL, rhs);
+        }
+        uint8_t reg = lhs.reg;
+        emit({.op = BOOL, .dst = reg, .a = reg});
+        size_t jump = m_out.m_code.size();
+        emit({.op = is_or ? JNZ : JZ, .a = reg});
+        Value rhs = is_or ? logical_and() : binary_level(0);
+        emit({.op = BOOL, .dst = reg, .a = materialize(rhs)});
+        m_next = reg + 1;
+        m_out.m_code[jump].target = m_out.m_code.size();
+        return {.reg = reg};
+    }
+
+    Value logical_or() {
+        Value value = logical_and();
+        while (accept("||")) {
+            value = short_circuit(value, true);
+        }
+        return value;
+    }
+    Value logical_and() {
+        Value value = binary_level(0);
+        while (accept("&&")) {
+            value = short_circuit(value, false);
+        }
+        return value;
+    }
+    Value binary_level(int level) {
+        if (level == NUM_LEVELS) {
+            return unary();
+        }
+        Value value = binary_level(level + 1);
+        for (;;) {
+            auto token = peek_operator();
+            auto op = binary_op(level, token);
+            if (!op) {
+                return value;
+            }
+            m_pos += token.size();
+            value = binary(*op, value, binary_level(level + 1));
+        }
+    }
+
+    Value unary() {
+        if (accept("-")) {
+            return unary_op(NEG, unary());
+        }
+        if (accept("~")) {
+            return unary_op(NOT, unary());
+        }
+        if (accept("!")) {
+            return unary_op(LNOT, unary());
+        }
+        if (accept("*")) {
+            Value addr = unary();
+            if (addr.constant) {
+                return fixed_load(*addr.constant, 8, false);
+            }
+            emit({.op = LOAD, .dst = addr.reg, .a = addr.reg, .size = 8});
+            return addr;
+        }
+        if (accept("(")) {
+            size_t start = m_pos;
+            auto type = name();
+            if (type.size() >= 2 && (type[0] == 'i' || type[0] == 'u') && accept(")")) {
+                unsigned bits = 0;
+                auto [end, ec] = std::from_chars(type.data() + 1, type.data() + type.size(), bits);
+                if (ec == std::errc() && end == type.data() + type.size() &&
+                    (bits == 8 || bits == 16 || bits == 32 || bits == 64)) {
+                    return unary_op(EXTEND, unary(), bits / 8, type[0] == 'i');
+                }
+            }
+            m_pos = start;
+            Value value = logical_or();
+            if (!accept(")")) {
+                throw std::string("expected `)`");
+            }
+            return value;
+        }
+        return primary();
+    }
+
+    Value primary() {
+        skip_space();
+        if (m_pos < m_text.size() && isdigit(static_cast<unsigned char>(m_text[m_pos]))) {
+            int base = 10;
+            if (m_text.substr(m_pos).starts_with("0x") || m_text.substr(m_pos).starts_with("0X")) {
+                base = 16;
+                m_pos += 2;
+            }
+            uint64_t value = 0;
+            auto [end, ec] = std::from_chars(m_text.data() + m_pos, m_text.data() + m_text.size(), value, base);
+            m_pos = end - m_text.data();
+            if (ec != std::errc() || (m_pos < m_text.size() && is_name_char(m_text[m_pos]))) {
+                throw std::string("bad number");
+            }
+            return {.constant = static_cast<int64_t>(value)};
+        }
+        auto ident = name();
+        if (ident.empty()) {
+            if (m_pos == m_text.size()) {
+                throw std::string("unexpected end of condition");
+            }
+            throw "unexpected `" + std::string(m_text.substr(m_pos)) + "`";
+        }
+        auto operand = m_resolve(ident);
+        if (!operand) {
+            throw "unknown name `" + std::string(ident) + "`";
+        }
+        switch (operand->kind) {
+            case ConditionOperand::REGISTER: {
+                uint8_t reg = allocate();
+                emit({.op = REG, .dst = reg, .target = static_cast<uint32_t>(operand->value)});
+                return {.reg = reg};
+            }
+            case ConditionOperand::MEMORY:
+                return fixed_load(operand->value, operand->size, operand->is_signed);
+            case ConditionOperand::CONSTANT:
+                break;
+        }
+        return {.constant = static_cast<int64_t>(operand->value)};
+    }
+
+    std::string_view m_text;
+    size_t m_pos = 0;
+    const Resolver& m_resolve;
+    Condition& m_out;
+    uint8_t m_next = 0;
+};
+
+std::optional<Condition> Condition::compile(std::string_view text, const Resolver& resolve, std::string& error) {
+    Condition ret;
+    ret.m_text = text;
+    try {
+        Parser(text, resolve, ret).run();
+    } catch (const std::string& message) {
+        error = message;
+        return {};
+    }
+    return ret;
+}
+
+int64_t Condition::extend(uint64_t value, uint8_t size, bool is_signed) {
+    if (size >= sizeof(value)) {
+        return value;
+    }
+    unsigned shift = 64 - size * 8;
+    return is_signed ? static_cast<int64_t>(value << shift) >> shift : static_cast<int64_t>(value << shift >> shift);
+}
+
+std::optional<int64_t> Condition::apply(Op op, int64_t a, int64_t b) {
+    // Wrap around like the hardware instead of overflowing.
+    auto ua = static_cast<uint64_t>(a);
+    auto ub = static_cast<uint64_t>(b);
+    switch (op) {
+        case ADD:
+            return ua + ub;
+        case SUB:
+            return ua - ub;
+        case MUL:
+            return ua * ub;
+        case DIV:
+            if (b == 0) return {};
+            return b == -1 ? -ua : a / b;
+        case MOD:
+            if (b == 0) return {};
+            return b == -1 ? 0 : a % b;
+        case AND:
+            return a & b;
+        case OR:
+            return a | b;
+        case XOR:
+            return a ^ b;
+        case SHL:
+            return ua << (b & 63);
+        case SHR:
+            return a >> (b & 63);
+        case EQ:
+            return a == b;
+        case NE:
+            return a != b;
+        case LT:
+            return a < b;
+        case LE:
+            return a <= b;
+        case GT:
+            return a > b;
+        case GE:
+            return a >= b;
+        default:
+            return {};
+    }
+}
+
+std::optional<bool> Condition::evaluate(const user_regs_struct& regs, std::span<const uint64_t> fixed,
+                                        const MemoryReader& read) const {
+    int64_t r[NUM_REGS];
+    size_t pc = 0;
+    while (pc < m_code.size()) {
+        const Insn& insn = m_code[pc++];
+        int64_t& dst = r[insn.dst];
+        switch (insn.op) {
+            case CONST:
+                dst = insn.imm;
+                break;
+            case REG: {
+                uint64_t value;
+                memcpy(&value, reinterpret_cast<const uint8_t*>(&regs) + insn.target, sizeof(value));
+                dst = value;
+                break;
+            }
+            case FIXED:
+                dst = extend(fixed[insn.target], insn.size, insn.is_signed);
+                break;
+            case LOAD: {
+                uint64_t value = 0;
+                if (!read(r[insn.a], &value, insn.size)) {
+                    return {};
+                }
+                dst = extend(value, insn.size, insn.is_signed);
+                break;
+            }
+            case EXTEND:
+                dst = extend(r[insn.a], insn.size, insn.is_signed);
+                break;
+            case NEG:
+                dst = -static_cast<uint64_t>(r[insn.a]);
+                break;
+            case NOT:
+                dst = ~r[insn.a];
+                break;
+            case LNOT:
+                dst = !r[insn.a];
+                break;
+            case BOOL:
+                dst = r[insn.a] != 0;
+                break;
+            case JZ:
+                if (!r[insn.a]) pc = insn.target;
+                break;
+            case JNZ:
+                if (r[insn.a]) pc = insn.target;
+                break;
+            default: {
+                auto value = apply(insn.op, r[insn.a], r[insn.b]);
+                if (!value) {
+                    return {};
+                }
+                dst = *value;
+                break;
+            }
+        }
+    }
+    return r[0] != 0;
+}
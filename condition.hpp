@@ -0,0 +1,111 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/user.h>
+
+#include <functional>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// What a name in a condition stands for, as resolved when the condition is compiled.
+struct ConditionOperand {
+    enum Kind { REGISTER, MEMORY, CONSTANT };
+    Kind kind;
+    // Byte offset into user_regs_struct, address, or value.
+    uint64_t value;
+    // Size in bytes and signedness of a MEMORY operand.
+    uint8_t size = 8;
+    bool is_signed = false;
+};
+
+// A breakpoint condition, compiled once into bytecode for a small register machine. The syntax is C's integer
+// expressions over 64-bit signed values: literals, names (registers, then global variables, then symbols, which stand
+// for their address), unary `*` (an 8-byte load), casts to i8-i64/u8-u64, and the arithmetic, bitwise, comparison and
+// short-circuit logical operators. Constant subexpressions are folded, and loads from fixed addresses are hoisted so
+// the caller can fetch them all in one batch per hit.
+class Condition {
+   public:
+    // Resolves a name, or returns nothing if it is unknown.
+    using Resolver = std::function<std::optional<ConditionOperand>(std::string_view name)>;
+    // Reads `size` bytes at `addr`, returning false if they are not readable.
+    using MemoryReader = std::function<bool(uint64_t addr, void* out, size_t size)>;
+
+    // A load whose address is known at compile time.
+    struct Load {
+        uint64_t addr;
+        uint8_t size;
+        bool is_signed;
+    };
+
+    // Compiles `text`, or returns nothing and explains why in `error`.
+    static std::optional<Condition> compile(std::string_view text, const Resolver& resolve, std::string& error);
+
+    const std::string& text() const { return m_text; }
+    // The hoisted loads, which evaluate() expects to have been read already.
+    const std::vector<Load>& fixed_loads() const { return m_loads; }
+    // Evaluates the condition. `fixed` holds the raw little-endian bytes read for each of fixed_loads(), zero-extended
+    // to 64 bits. Other loads go through `read`. Returns nothing if memory was unreadable or a division by zero
+    // happened.
+    std::optional<bool> evaluate(const user_regs_struct& regs, std::span<const uint64_t> fixed,
+                                 const MemoryReader& read) const;
+
+   private:
+    class Parser;
+
+    enum Op : uint8_t {
+        CONST,
+        REG,
+        FIXED,
+        LOAD,
+        EXTEND,
+        NEG,
+        NOT,
+        LNOT,
+        BOOL,
+        ADD,
+        SUB,
+        MUL,
+        DIV,
+        MOD,
+        AND,
+        OR,
+        XOR,
+        SHL,
+        SHR,
+        EQ,
+        NE,
+        LT,
+        LE,
+        GT,
+        GE,
+        // Short-circuit jumps for && and ||, on a value already normalised by BOOL.
+        JZ,
+        JNZ,
+    };
+    struct Insn {
+        Op op = CONST;
+        // Virtual registers: the destination and the operands.
+        uint8_t dst = 0;
+        uint8_t a = 0;
+        uint8_t b = 0;
+        // LOAD and EXTEND width in bytes, and whether to sign-extend.
+        uint8_t size = 8;
+        bool is_signed = false;
+        // Jump target (an instruction index), FIXED load index or REG offset.
+        uint32_t target = 0;
+        uint64_t imm = 0;
+    };
+    static constexpr size_t NUM_REGS = 32;
+
+    // Computes a binary operation at compile or run time. Returns nothing on division by zero.
+    static std::optional<int64_t> apply(Op op, int64_t a, int64_t b);
+    static int64_t extend(uint64_t value, uint8_t size, bool is_signed);
+
+    std::string m_text;
+    std::vector<Insn> m_code;
+    std::vector<Load> m_loads;
+};
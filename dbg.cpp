@@ -1,28 +1,40 @@
 #include "dbg.hpp"
 
+#include <asm/processor-flags.h>
 #include <capstone/capstone.h>
 #include <elf.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <link.h>
 #include <signal.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/personality.h>
 #include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <sys/user.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <array>
+#include <future>
 #include <iostream>
+#include <numeric>
+#include <span>
 #include <string>
 #include <string_view>
 #include <unordered_map>
 #include <vector>
 
 #include "elf.hpp"
+#include "memcache.hpp"
+#include "threadpool.hpp"
 #include "util.hpp"
+#include "xstate.hpp"
 
 using word = unsigned long;
 
@@ -31,24 +43,18 @@ Tracee::~Tracee() {
         kill_process();
     } catch (const std::system_error&) {
     }
-}
-
-void Tracee::inject_breakpoint(Breakpoint& bp) {
-    if (bp.injected) {
-        return;
+    if (m_mem_fd >= 0) {
+        close(m_mem_fd);
     }
-    read_memory(bp.addr, &bp.orig_byte, 1);
-    uint8_t new_byte = 0xcc;
-    write_memory(bp.addr, &new_byte, 1);
-    bp.injected = true;
 }
 
-void Tracee::uninject_breakpoint(Breakpoint& bp) {
-    if (!bp.injected) {
+void Tracee::uninject_breakpoint(uint32_t bp) {
+    if (!m_breakpoints.injected(bp)) {
         return;
     }
-    write_memory(bp.addr, &bp.orig_byte, 1);
-    bp.injected = false;
+    uint8_t orig_byte = m_breakpoints.orig_byte(bp);
+    write_code(m_breakpoints.addr(bp), &orig_byte, 1);
+    m_breakpoints.set_uninjected(bp);
 }
 
 void Tracee::kill_process(int sgn) {
@@ -65,29 +71,339 @@ void Tracee::step_into() {
         std::cerr << "Cannot single step in stopped process\n";
         return;
     }
+    auto bp = m_breakpoint_hit ? m_breakpoints.find(regs().rip) : m_breakpoints.NONE;
+    m_breakpoint_hit = false;
+    unsigned hits = bp != m_breakpoints.NONE && m_breakpoints.injected(bp) ? step_over_breakpoint(bp) : single_step();
+    if (hits) {
+        report_watchpoints(hits);
+    }
+}
+
+unsigned Tracee::single_step() {
+    before_resume();
     util::throw_errno(ptrace(PTRACE_SINGLESTEP, m_child_pid, nullptr, nullptr));
     int status;
     util::throw_errno(waitpid(m_child_pid, &status, 0));
     util::throw_assert(WIFSTOPPED(status) && WSTOPSIG(status) == SIGTRAP);
+    // An int3 stop leaves DR6 alone, so a hit left behind here would be taken for the next one.
+    return m_debug_regs.empty() ? 0 : m_debug_regs.triggered(m_child_pid);
 }
 
-void Tracee::read_memory(size_t addr, void* out, size_t sz) {
+namespace {
+constexpr size_t PAGE_BYTES = PageCache::PAGE_BYTES;
+// Larger reads (memory dumps) bypass the page cache and go straight to the transfer engine.
+constexpr size_t MAX_CACHED_READ = 16 * PAGE_BYTES;
+
+// Builds matching local/remote iovecs for [addr, addr + sz), split at page boundaries so that a partial
+// process_vm_readv/process_vm_writev stops exactly at the first inaccessible page.
+void split_pages(size_t addr, const void* buf, size_t sz, std::vector<iovec>& local, std::vector<iovec>& remote) {
+    auto* p = static_cast<uint8_t*>(const_cast<void*>(buf));
+    while (sz > 0) {
+        size_t n = std::min(sz, PAGE_BYTES - (addr & (PAGE_BYTES - 1)));
+        local.push_back({p, n});
+        remote.push_back({reinterpret_cast<void*>(addr), n});
+        addr += n;
+        p += n;
+        sz -= n;
+    }
+}
+}  // namespace
+
+int Tracee::mem_fd() {
+    if (m_mem_fd < 0) {
+        char mem_path[256];
+        snprintf(mem_path, sizeof(mem_path), "/proc/%d/mem", m_child_pid);
+        m_mem_fd = open(mem_path, O_RDWR | O_CLOEXEC);
+    }
+    return m_mem_fd;
+}
+
+user_regs_struct& Tracee::regs() {
+    if (!m_regs) {
+        m_regs.emplace();
+        util::throw_errno(ptrace(PTRACE_GETREGS, m_child_pid, nullptr, &*m_regs));
+    }
+    return *m_regs;
+}
+
+void Tracee::before_resume() {
+    if (m_regs && m_regs_dirty) {
+        util::throw_errno(ptrace(PTRACE_SETREGS, m_child_pid, nullptr, &*m_regs));
+    }
+    m_regs.reset();
+    m_regs_dirty = false;
+    m_xstate.flush(m_child_pid);
+    m_page_cache.clear();
+}
+
+void Tracee::mark_exited() {
+    m_child_pid = NOCHILD;
+    m_regs.reset();
+    m_regs_dirty = false;
+    m_xstate.reset();
+    m_page_cache.clear();
+    m_scratch = 0;
+    m_scratch_failed = false;
+    m_scratch_owner = 0;
+    m_trace_remote = 0;
+    m_trampoline_areas.clear();
+    for (auto& tp : m_tracepoints) {
+        tp.active = false;
+    }
+    // The next process starts with clean code; post_spawn injects the breakpoints into it.
+    for (uint32_t i = 0; i < m_breakpoints.size(); ++i) {
+        m_breakpoints.set_uninjected(i);
+    }
+    if (m_mem_fd >= 0) {
+        close(m_mem_fd);
+        m_mem_fd = -1;
+    }
+}
+
+size_t Tracee::transfer_vm(size_t addr, void* buf, size_t sz, bool write) {
+    std::vector<iovec> local, remote;
+    split_pages(addr, buf, sz, local, remote);
+    size_t done = 0;
+    for (size_t i = 0; i < local.size(); i += IOV_MAX) {
+        size_t cnt = std::min<size_t>(local.size() - i, IOV_MAX);
+        size_t want = 0;
+        for (size_t j = i; j < i + cnt; ++j) {
+            want += local[j].iov_len;
+        }
+        ssize_t n = write ? process_vm_writev(m_child_pid, &local[i], cnt, &remote[i], cnt, 0)
+                          : process_vm_readv(m_child_pid, &local[i], cnt, &remote[i], cnt, 0);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+        if (static_cast<size_t>(n) != want) {
+            break;
+        }
+    }
+    return done;
+}
+
+size_t Tracee::transfer_proc_mem(size_t addr, void* buf, size_t sz, bool write) {
+    int fd = mem_fd();
+    if (fd < 0) {
+        return 0;
+    }
+    size_t done = 0;
+    while (done < sz) {
+        ssize_t n = write ? pwrite(fd, static_cast<uint8_t*>(buf) + done, sz - done, addr + done)
+                          : pread(fd, static_cast<uint8_t*>(buf) + done, sz - done, addr + done);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+size_t Tracee::transfer_ptrace(size_t addr, void* buf, size_t sz, bool write) {
+    auto* p = static_cast<uint8_t*>(buf);
+    size_t done = 0;
+    while (done < sz) {
+        size_t n = std::min(sz - done, sizeof(word));
+        auto* in_addr = reinterpret_cast<void*>(addr + done);
+        word val = 0;
+        if (!write || n < sizeof(word)) {
+            errno = 0;
+            val = ptrace(PTRACE_PEEKDATA, m_child_pid, in_addr, nullptr);
+            if (errno != 0) {
+                break;
+            }
+        }
+        if (write) {
+            memcpy(&val, p + done, n);
+            if (ptrace(PTRACE_POKEDATA, m_child_pid, in_addr, val) < 0) {
+                break;
+            }
+        } else {
+            memcpy(p + done, &val, n);
+        }
+        done += n;
+    }
+    return done;
+}
+
+size_t Tracee::transfer_memory(size_t addr, void* buf, size_t sz, bool write) {
+    auto* p = static_cast<uint8_t*>(buf);
+    // process_vm_readv/writev move everything in one syscall but respect page protections, so text pages (for
+    // breakpoints) need /proc/<pid>/mem, which writes through them like ptrace does.
+    size_t done = transfer_vm(addr, p, sz, write);
+    if (done < sz) {
+        done += transfer_proc_mem(addr + done, p + done, sz - done, write);
+    }
+    if (done < sz) {
+        done += transfer_ptrace(addr + done, p + done, sz - done, write);
+    }
+    return done;
+}
+
+size_t Tracee::read_cached(size_t addr, void* out, size_t sz) {
+    if (sz > MAX_CACHED_READ) {
+        return transfer_memory(addr, out, sz, false);
+    }
+    auto* p = static_cast<uint8_t*>(out);
+    size_t done = 0;
+    while (done < sz) {
+        uint64_t page = PageCache::page_of(addr + done);
+        size_t off = addr + done - page;
+        size_t n = std::min(sz - done, PAGE_BYTES - off);
+        if (const auto* cached = m_page_cache.find(page)) {
+            memcpy(p + done, cached->data() + off, n);
+            done += n;
+            continue;
+        }
+        // Fill the whole run of missing pages covering the rest of the request with one bulk transfer.
+        uint64_t run_end = PageCache::page_of(addr + sz - 1) + PAGE_BYTES;
+        for (uint64_t next = page + PAGE_BYTES; next < run_end; next += PAGE_BYTES) {
+            if (m_page_cache.find(next)) {
+                run_end = next;
+                break;
+            }
+        }
+        std::vector<uint8_t> buf(run_end - page);
+        size_t got = transfer_memory(page, buf.data(), buf.size(), false);
+        for (size_t i = 0; i + PAGE_BYTES <= got; i += PAGE_BYTES) {
+            m_page_cache.insert(page + i, buf.data() + i);
+        }
+        size_t want = std::min<size_t>(sz - done, run_end - (addr + done));
+        size_t avail = got > off ? std::min(got - off, want) : 0;
+        memcpy(p + done, buf.data() + off, avail);
+        done += avail;
+        if (avail < want) {
+            break;
+        }
+    }
+    return done;
+}
+
+void Tracee::fetch_pages(std::span<const uint64_t> pages, uint8_t* buf, std::vector<bool>& ok) {
+    ok.assign(pages.size(), false);
+    std::vector<iovec> local, remote;
+    for (size_t i = 0; i < pages.size(); ++i) {
+        local.push_back({buf + i * PAGE_BYTES, PAGE_BYTES});
+        remote.push_back({reinterpret_cast<void*>(pages[i]), PAGE_BYTES});
+    }
+    // process_vm_readv stops at the first bad iovec, so retry the page it stopped on through the slower tiers and
+    // resume the vectored read after it.
+    size_t i = 0;
+    while (i < pages.size()) {
+        size_t cnt = std::min<size_t>(pages.size() - i, IOV_MAX);
+        ssize_t n = process_vm_readv(m_child_pid, &local[i], cnt, &remote[i], cnt, 0);
+        size_t full = n > 0 ? n / PAGE_BYTES : 0;
+        for (size_t j = i; j < i + full; ++j) {
+            ok[j] = true;
+        }
+        i += full;
+        if (full == cnt) {
+            continue;
+        }
+        uint8_t* page_buf = buf + i * PAGE_BYTES;
+        size_t got = transfer_proc_mem(pages[i], page_buf, PAGE_BYTES, false);
+        got += transfer_ptrace(pages[i] + got, page_buf + got, PAGE_BYTES - got, false);
+        ok[i] = got == PAGE_BYTES;
+        ++i;
+    }
+}
+
+size_t Tracee::read_batch(std::span<MemoryRange> ranges) {
     if (m_child_pid == NOCHILD) {
         std::cerr << "Cannot read memory in stopped process\n";
-        return;
+        return 0;
     }
-    const word* in_addr = reinterpret_cast<const word*>(addr);
-    word* out_addr = static_cast<word*>(out);
-    for (size_t i = 0; i * sizeof(word) < sz; i++) {
-        errno = 0;
-        if (sz - i * sizeof(word) >= sizeof(word)) {
-            *out_addr = util::throw_errno(ptrace(PTRACE_PEEKDATA, m_child_pid, in_addr, nullptr));
+    std::vector<uint64_t> pages;
+    for (auto& range : ranges) {
+        range.ok = false;
+        if (range.size == 0 || range.size > MAX_CACHED_READ) {
+            continue;
+        }
+        for (uint64_t page = PageCache::page_of(range.addr); page < range.addr + range.size; page += PAGE_BYTES) {
+            pages.push_back(page);
+        }
+    }
+    std::sort(pages.begin(), pages.end());
+    pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+
+    // Gather every needed page into one buffer: cached pages are copied, the rest are fetched together.
+    std::vector<uint8_t> buf(pages.size() * PAGE_BYTES);
+    std::vector<bool> page_ok(pages.size());
+    std::vector<uint64_t> missing;
+    std::vector<size_t> missing_idx;
+    for (size_t i = 0; i < pages.size(); ++i) {
+        if (const auto* cached = m_page_cache.find(pages[i])) {
+            memcpy(buf.data() + i * PAGE_BYTES, cached->data(), PAGE_BYTES);
+            page_ok[i] = true;
         } else {
-            word out = util::throw_errno(ptrace(PTRACE_PEEKDATA, m_child_pid, in_addr, nullptr));
-            memcpy(out_addr, static_cast<void*>(&out), sz - i * sizeof(word));
+            missing.push_back(pages[i]);
+            missing_idx.push_back(i);
         }
-        out_addr++;
-        in_addr++;
+    }
+    if (!missing.empty()) {
+        std::vector<uint8_t> fetched(missing.size() * PAGE_BYTES);
+        std::vector<bool> fetched_ok;
+        fetch_pages(missing, fetched.data(), fetched_ok);
+        for (size_t j = 0; j < missing.size(); ++j) {
+            if (fetched_ok[j]) {
+                memcpy(buf.data() + missing_idx[j] * PAGE_BYTES, fetched.data() + j * PAGE_BYTES, PAGE_BYTES);
+                m_page_cache.insert(missing[j], fetched.data() + j * PAGE_BYTES);
+                page_ok[missing_idx[j]] = true;
+            }
+        }
+    }
+
+    size_t n_ok = 0;
+    for (auto& range : ranges) {
+        if (range.size == 0) {
+            range.ok = true;
+        } else if (range.size > MAX_CACHED_READ) {
+            range.ok = transfer_memory(range.addr, range.out, range.size, false) == range.size;
+        } else {
+            auto it = std::lower_bound(pages.begin(), pages.end(), PageCache::page_of(range.addr));
+            size_t first = it - pages.begin();
+            size_t last = first + (PageCache::page_of(range.addr + range.size - 1) - *it) / PAGE_BYTES;
+            range.ok = true;
+            for (size_t i = first; i <= last; ++i) {
+                range.ok = range.ok && page_ok[i];
+            }
+            if (range.ok) {
+                memcpy(range.out, buf.data() + first * PAGE_BYTES + (range.addr - *it), range.size);
+            }
+        }
+        n_ok += range.ok;
+    }
+    return n_ok;
+}
+
+size_t Tracee::read_memory_partial(size_t addr, void* out, size_t sz) {
+    if (m_child_pid == NOCHILD) {
+        std::cerr << "Cannot read memory in stopped process\n";
+        return 0;
+    }
+    return read_cached(addr, out, sz);
+}
+
+size_t Tracee::write_memory_partial(size_t addr, const void* data, size_t sz) {
+    if (m_child_pid == NOCHILD) {
+        std::cerr << "Cannot write memory in stopped process\n";
+        return 0;
+    }
+    size_t n = transfer_memory(addr, const_cast<void*>(data), sz, true);
+    m_page_cache.update(addr, data, n);
+    return n;
+}
+
+void Tracee::read_memory(size_t addr, void* out, size_t sz) {
+    if (m_child_pid == NOCHILD) {
+        std::cerr << "Cannot read memory in stopped process\n";
+        return;
+    }
+    if (read_cached(addr, out, sz) != sz) {
+        // The tiers leave errno from whichever attempt ran last, so a short transfer is reported as EFAULT.
+        errno = EFAULT;
+        util::throw_errno();
     }
 }
 
@@ -96,32 +412,70 @@ void Tracee::write_memory(size_t addr, const void* data, size_t sz) {
         std::cerr << "Cannot write memory in stopped process\n";
         return;
     }
-    const word* in_addr = static_cast<const word*>(data);
-    const word* out_addr = reinterpret_cast<const word*>(addr);
-    for (size_t i = 0; i * sizeof(word) < sz; i++) {
-        if (sz - i * sizeof(word) >= sizeof(word)) {
-            util::throw_errno(ptrace(PTRACE_POKEDATA, m_child_pid, out_addr, *in_addr));
-        } else {
-            word val;
-            read_memory(reinterpret_cast<size_t>(out_addr), &val, sizeof(val));
-            memcpy(&val, in_addr, sz - i * sizeof(word));
-            util::throw_errno(ptrace(PTRACE_POKEDATA, m_child_pid, out_addr, val));
-        }
-        out_addr++;
-        in_addr++;
+    size_t n = transfer_memory(addr, const_cast<void*>(data), sz, true);
+    m_page_cache.update(addr, data, n);
+    if (n != sz) {
+        errno = EFAULT;
+        util::throw_errno();
     }
 }
 
-std::string Tracee::read_string(uint64_t addr) {
+std::string Tracee::read_string(uint64_t addr, size_t max_len) {
     std::string ret;
-    char buf[8];
-    for (;; addr += sizeof(buf)) {
-        read_memory(addr, buf, sizeof(buf));
-        auto* end = static_cast<char*>(memchr(buf, 0, sizeof(buf)));
-        ret.append(buf, end ? end : (buf + sizeof(buf)));
-        if (end) {
+    char buf[PAGE_BYTES];
+    while (ret.size() < max_len) {
+        // Read up to the end of the page so the whole page lands in the cache with one transfer and an unmapped
+        // next page is never touched speculatively.
+        size_t want = std::min(PAGE_BYTES - (addr & (PAGE_BYTES - 1)), max_len - ret.size());
+        size_t got = read_memory_partial(addr, buf, want);
+        if (got == 0 && ret.empty()) {
+            errno = EFAULT;
+            util::throw_errno();
+        }
+        size_t len = util::find_nul(buf, got);
+        ret.append(buf, len);
+        if (len < got || got < want) {
             break;
         }
+        addr += got;
+    }
+    return ret;
+}
+
+std::vector<std::string> Tracee::read_strings(std::span<const uint64_t> addrs, size_t max_len) {
+    std::vector<std::string> ret(addrs.size());
+    std::vector<uint64_t> cur(addrs.begin(), addrs.end());
+    std::vector<size_t> pending(addrs.size());
+    for (size_t i = 0; i < pending.size(); ++i) {
+        pending[i] = i;
+    }
+    std::vector<uint8_t> bufs;
+    std::vector<MemoryRange> ranges;
+    // Each round reads the next page-bounded chunk of every unfinished string in one batch.
+    while (!pending.empty()) {
+        bufs.resize(pending.size() * PAGE_BYTES);
+        ranges.clear();
+        for (size_t j = 0; j < pending.size(); ++j) {
+            size_t i = pending[j];
+            size_t want = std::min(PAGE_BYTES - (cur[i] & (PAGE_BYTES - 1)), max_len - ret[i].size());
+            ranges.push_back({.addr = cur[i], .out = bufs.data() + j * PAGE_BYTES, .size = want});
+        }
+        read_batch(ranges);
+        std::vector<size_t> next;
+        for (size_t j = 0; j < pending.size(); ++j) {
+            size_t i = pending[j];
+            if (!ranges[j].ok) {
+                continue;
+            }
+            const auto* buf = static_cast<const char*>(ranges[j].out);
+            size_t len = util::find_nul(buf, ranges[j].size);
+            ret[i].append(buf, len);
+            cur[i] += len;
+            if (len == ranges[j].size && ret[i].size() < max_len) {
+                next.push_back(i);
+            }
+        }
+        pending = std::move(next);
     }
     return ret;
 }
@@ -154,52 +508,513 @@ int Tracee::continue_process() {
         return 0;
     }
 
-    int status;
+    int status = W_STOPCODE(SIGTRAP);
+    bool resume = true;
     if (m_breakpoint_hit) {
-        struct user_regs_struct regs;
-        util::throw_errno(ptrace(PTRACE_GETREGS, m_child_pid, nullptr, &regs));
-        size_t pc = regs.rip;
-        auto it = m_breakpoints.find(pc);
+        auto bp = m_breakpoints.find(regs().rip);
         m_breakpoint_hit = false;
-        if (it != m_breakpoints.end()) {
-            step_into();
-            inject_breakpoint(it->second);
+        if (bp != m_breakpoints.NONE && m_breakpoints.injected(bp)) {
+            // A watchpoint firing on the breakpoint's own instruction stops there.
+            if (unsigned hits = step_over_breakpoint(bp)) {
+                report_watchpoints(hits);
+                resume = false;
+            }
         }
     }
 
-    util::throw_errno(ptrace(PTRACE_CONT, m_child_pid, nullptr, nullptr));
-    util::throw_errno(waitpid(m_child_pid, &status, 0));
-    if (WIFSTOPPED(status) && WSTOPSIG(status) == SIGTRAP) {
-        struct user_regs_struct regs;
-        util::throw_errno(ptrace(PTRACE_GETREGS, m_child_pid, nullptr, &regs));
-        regs.rip--;
-        size_t pc = regs.rip;
-        if (m_breakpoints.contains(pc)) {
-            // we hit a breakpoint
-            printf("Hit breakpoint at %#zx\n", pc);
-            m_breakpoint_hit = true;
-            uninject_breakpoint(m_breakpoints.at(pc));
-            util::throw_errno(ptrace(PTRACE_SETREGS, m_child_pid, nullptr, &regs));
-        }
-    } else if (WIFEXITED(status)) {
-        printf("Process exited with code %d\n", WEXITSTATUS(status));
-        m_child_pid = NOCHILD;
-    } else if (WIFSIGNALED(status)) {
-        int sig = WTERMSIG(status);
-        printf("Process received signal %d (%s)\n", sig, strsignal(sig));
-        m_child_pid = NOCHILD;
+    while (resume) {
+        resume = false;
+        before_resume();
+        util::throw_errno(ptrace(PTRACE_CONT, m_child_pid, nullptr, nullptr));
+        util::throw_errno(waitpid(m_child_pid, &status, 0));
+        if (WIFSTOPPED(status) && WSTOPSIG(status) == SIGTRAP) {
+            size_t pc = regs().rip - 1;
+            // Only a debug exception says anything about DR6; an int3 comes in as SI_KERNEL.
+            siginfo_t info{};
+            bool hardware = !m_debug_regs.empty() &&
+                            ptrace(PTRACE_GETSIGINFO, m_child_pid, nullptr, &info) == 0 && info.si_code == TRAP_HWBKPT;
+            if (unsigned hits = hardware ? m_debug_regs.triggered(m_child_pid) : 0) {
+                report_watchpoints(hits);
+            } else if (auto bp = m_breakpoints.find(pc); bp != m_breakpoints.NONE) {
+                // we hit a breakpoint
+                regs().rip = pc;
+                mark_regs_dirty();
+                if (should_stop(bp)) {
+                    printf("Hit breakpoint at %#zx\n", pc);
+                    m_breakpoint_hit = true;
+                } else {
+                    // Pass over the hit without going back to the prompt, reusing the registers cached for the
+                    // condition. A watchpoint firing on the way stops there instead.
+                    unsigned hits = step_over_breakpoint(bp);
+                    if (hits) {
+                        report_watchpoints(hits);
+                    }
+                    resume = !hits;
+                }
+            }
+        } else if (WIFEXITED(status)) {
+            printf("Process exited with code %d\n", WEXITSTATUS(status));
+            mark_exited();
+        } else if (WIFSIGNALED(status)) {
+            int sig = WTERMSIG(status);
+            printf("Process received signal %d (%s)\n", sig, strsignal(sig));
+            mark_exited();
+        }
     }
     return status;
 }
 
+bool Tracee::should_stop(uint32_t index) {
+    Breakpoint& bp = m_breakpoints.details(index);
+    if (bp.condition) {
+        auto holds = evaluate_condition(*bp.condition);
+        if (!holds) {
+            printf("Cannot evaluate `%s` at %#lx: unreadable memory or division by zero\n",
+                   bp.condition->text().c_str(), m_breakpoints.addr(index));
+            ++bp.hits;
+            return true;
+        }
+        if (!*holds) {
+            return false;
+        }
+    }
+    ++bp.hits;
+    if (bp.ignore > 0) {
+        --bp.ignore;
+        return false;
+    }
+    return true;
+}
+
+std::optional<bool> Tracee::evaluate_condition(const Condition& condition) {
+    const auto& loads = condition.fixed_loads();
+    std::vector<uint64_t> fixed(loads.size());
+    if (!loads.empty()) {
+        std::vector<MemoryRange> ranges(loads.size());
+        for (size_t i = 0; i < loads.size(); ++i) {
+            ranges[i] = {.addr = loads[i].addr, .out = &fixed[i], .size = loads[i].size};
+        }
+        if (read_batch(ranges) != ranges.size()) {
+            return {};
+        }
+    }
+    return condition.evaluate(regs(), fixed, [this](uint64_t addr, void* out, size_t size) {
+        return read_cached(addr, out, size) == size;
+    });
+}
+
+std::optional<Condition> Tracee::compile_condition(std::string_view text, std::string& error) const {
+    auto resolve = [this](std::string_view name) -> std::optional<ConditionOperand> {
+        for (size_t i = 0; i < REGISTER_NAMES.size(); ++i) {
+            if (name == REGISTER_NAMES[i]) {
+                return ConditionOperand{.kind = ConditionOperand::REGISTER, .value = REGISTER_OFFSETS[i]};
+            }
+        }
+        if (auto var = find_global(name); var && var->second.size >= 1 && var->second.size <= 8) {
+            return ConditionOperand{.kind = ConditionOperand::MEMORY,
+                                    .value = var->first->base() + var->second.addr,
+                                    .size = static_cast<uint8_t>(var->second.size),
+                                    .is_signed = var->first->debug_info().is_signed(var->second.type)};
+        }
+        if (auto addr = lookup_sym(name)) {
+            return ConditionOperand{.kind = ConditionOperand::CONSTANT, .value = *addr};
+        }
+        return {};
+    };
+    return Condition::compile(text, resolve, error);
+}
+
+bool Tracee::set_breakpoint_condition(size_t addr, std::optional<Condition> condition) {
+    auto bp = m_breakpoints.find(addr);
+    if (bp == m_breakpoints.NONE) {
+        return false;
+    }
+    m_breakpoints.details(bp).condition = std::move(condition);
+    return true;
+}
+
+bool Tracee::set_breakpoint_ignore(size_t addr, uint64_t count) {
+    auto bp = m_breakpoints.find(addr);
+    if (bp == m_breakpoints.NONE) {
+        return false;
+    }
+    m_breakpoints.details(bp).ignore = count;
+    return true;
+}
+
+std::vector<Tracee::BreakpointStatus> Tracee::breakpoint_status() const {
+    std::vector<BreakpointStatus> ret;
+    for (uint32_t i = 0; i < m_breakpoints.size(); ++i) {
+        const Breakpoint& bp = m_breakpoints.details(i);
+        ret.push_back({.addr = m_breakpoints.addr(i),
+                       .hits = bp.hits,
+                       .ignore = bp.ignore,
+                       .condition = bp.condition ? bp.condition->text() : std::string()});
+    }
+    std::sort(ret.begin(), ret.end(), [](const auto& a, const auto& b) { return a.addr < b.addr; });
+    return ret;
+}
+
+void Tracee::recompile_conditions() {
+    for (uint32_t i = 0; i < m_breakpoints.size(); ++i) {
+        Breakpoint& bp = m_breakpoints.details(i);
+        if (!bp.condition) {
+            continue;
+        }
+        std::string error;
+        auto condition = compile_condition(bp.condition->text(), error);
+        if (!condition) {
+            printf("Dropping the condition of the breakpoint at %#lx: %s\n", m_breakpoints.addr(i), error.c_str());
+        }
+        bp.condition = std::move(condition);
+    }
+}
+
 void Tracee::insert_breakpoint(size_t addr) {
-    if (m_breakpoints.contains(addr)) {
+    uint64_t addrs[] = {addr};
+    insert_breakpoints(addrs);
+}
+
+size_t Tracee::insert_breakpoints(std::span<const uint64_t> addrs) {
+    m_breakpoints.reserve(m_breakpoints.size() + addrs.size());
+    std::vector<uint32_t> added;
+    for (auto addr : addrs) {
+        auto inside = std::find_if(m_tracepoints.begin(), m_tracepoints.end(), [addr](const Tracepoint& tp) {
+            return tp.active && addr >= tp.addr && addr < tp.addr + tp.window;
+        });
+        if (inside != m_tracepoints.end()) {
+            std::cerr << "Cannot set a breakpoint inside the jump of tracepoint at " << std::hex << inside->addr
+                      << std::dec << "\n";
+            continue;
+        }
+        if (auto [bp, is_new] = m_breakpoints.insert(addr); is_new) {
+            added.push_back(bp);
+        }
+    }
+    if (m_child_pid != NOCHILD) {
+        if (size_t missed = added.size() - inject_breakpoints(added)) {
+            std::cerr << missed << " breakpoint(s) on unreadable memory could not be injected\n";
+        }
+    }
+    return added.size();
+}
+
+size_t Tracee::inject_breakpoints(std::span<const uint32_t> bps) {
+    std::vector<uint32_t> todo;
+    for (auto bp : bps) {
+        if (!m_breakpoints.injected(bp)) {
+            todo.push_back(bp);
+        }
+    }
+    std::sort(todo.begin(), todo.end(), [this](uint32_t a, uint32_t b) {
+        return m_breakpoints.addr(a) < m_breakpoints.addr(b);
+    });
+
+    // One range from the first to the last breakpoint of each run of adjacent pages, short enough that read_batch
+    // serves it from the pages it fetches together. `runs` holds the first breakpoint of each range, then the end.
+    std::vector<MemoryRange> ranges;
+    std::vector<size_t> runs;
+    for (size_t i = 0; i < todo.size(); ++i) {
+        uint64_t addr = m_breakpoints.addr(todo[i]);
+        if (!ranges.empty()) {
+            auto& range = ranges.back();
+            uint64_t last_page = PageCache::page_of(range.addr + range.size - 1);
+            if (PageCache::page_of(addr) <= last_page + PAGE_BYTES && addr + 1 - range.addr <= MAX_CACHED_READ) {
+                range.size = addr + 1 - range.addr;
+                continue;
+            }
+        }
+        ranges.push_back({.addr = addr, .size = 1});
+        runs.push_back(i);
+    }
+    runs.push_back(todo.size());
+    size_t total = 0;
+    for (const auto& range : ranges) {
+        total += range.size;
+    }
+    std::vector<uint8_t> buf(total);
+    for (size_t r = 0, offset = 0; r < ranges.size(); offset += ranges[r++].size) {
+        ranges[r].out = buf.data() + offset;
+    }
+    read_batch(ranges);
+
+    size_t injected = 0;
+    std::vector<uint8_t> orig_bytes;
+    for (size_t r = 0; r < ranges.size(); ++r) {
+        if (!ranges[r].ok) {
+            continue;
+        }
+        auto* bytes = static_cast<uint8_t*>(ranges[r].out);
+        orig_bytes.clear();
+        for (size_t i = runs[r]; i < runs[r + 1]; ++i) {
+            uint8_t& byte = bytes[m_breakpoints.addr(todo[i]) - ranges[r].addr];
+            orig_bytes.push_back(byte);
+            byte = 0xcc;
+        }
+        write_code(ranges[r].addr, bytes, ranges[r].size);
+        for (size_t i = runs[r]; i < runs[r + 1]; ++i) {
+            m_breakpoints.set_injected(todo[i], orig_bytes[i - runs[r]]);
+        }
+        injected += runs[r + 1] - runs[r];
+    }
+    return injected;
+}
+
+void Tracee::write_code(size_t addr, const void* data, size_t sz) {
+    if (m_child_pid == NOCHILD) {
+        std::cerr << "Cannot write memory in stopped process\n";
         return;
     }
-    auto [it, _] = m_breakpoints.emplace(addr, Breakpoint{.addr = addr});
-    Breakpoint& bp = it->second;
+    size_t n = transfer_proc_mem(addr, const_cast<void*>(data), sz, true);
+    m_page_cache.update(addr, data, n);
+    if (n < sz) {
+        write_memory(addr + n, static_cast<const uint8_t*>(data) + n, sz - n);
+    }
+}
+
+void Tracee::unshadow_breakpoints(size_t addr, uint8_t* buf, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        if (auto bp = m_breakpoints.find(addr + i); bp != m_breakpoints.NONE && m_breakpoints.injected(bp)) {
+            buf[i] = m_breakpoints.orig_byte(bp);
+        }
+    }
+}
+
+uint64_t Tracee::scratch_page() {
+    if (!m_scratch && !m_scratch_failed) {
+        // Executable but not writable by the child; the debugger writes it through /proc/<pid>/mem.
+        uint64_t addr = syscall(SYS_mmap, {0, PAGE_BYTES, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS,
+                                           static_cast<unsigned long>(-1), 0});
+        // The raw syscall returns -errno on failure.
+        if (addr > -4096ul) {
+            m_scratch_failed = true;
+        } else {
+            m_scratch = addr;
+        }
+    }
+    return m_scratch;
+}
+
+unsigned Tracee::step_over_breakpoint(uint32_t index) {
+    Breakpoint& bp = m_breakpoints.details(index);
+    uint64_t addr = m_breakpoints.addr(index);
+    if (!bp.displace_tried) {
+        bp.displace_tried = true;
+        uint8_t code[DisplacedInsn::MAX_SIZE];
+        size_t n = read_memory_partial(addr, code, sizeof(code));
+        unshadow_breakpoints(addr, code, n);
+        bp.displaced = displace_instruction({code, n}, addr);
+    }
+    uint64_t scratch = bp.displaced ? scratch_page() : 0;
+    if (!scratch) {
+        uninject_breakpoint(index);
+        unsigned hits = single_step();
+        inject_breakpoint(index);
+        return hits;
+    }
+
+    // Registers by ModRM number, for the base register of a rewritten RIP-relative operand.
+    static constexpr Register MODRM_REGISTERS[] = {Register::RAX, Register::RCX, Register::RDX, Register::RBX,
+                                                   Register::RSP, Register::RBP, Register::RSI, Register::RDI};
+    const auto& d = *bp.displaced;
+    if (m_scratch_owner != addr) {
+        write_memory(scratch, d.bytes.data(), d.size);
+        m_scratch_owner = addr;
+    }
+    uint64_t next = addr + d.size;
+    uint64_t saved_base = 0;
+    if (d.base_reg) {
+        saved_base = read_register(MODRM_REGISTERS[*d.base_reg], 8);
+        write_register(MODRM_REGISTERS[*d.base_reg], 8, next);
+    }
+    write_register(Register::RIP, 8, scratch);
+    unsigned hits = single_step();
+
+    if (d.base_reg) {
+        write_register(MODRM_REGISTERS[*d.base_reg], 8, saved_base);
+    }
+    if (d.call) {
+        write_memory(regs().rsp, &next, sizeof(next));
+    }
+    if (d.syscall) {
+        regs().rcx = next;
+    }
+    // Falling through leaves the pc after the copy; relative branches land relative to it. Anything else (returns,
+    // indirect jumps and calls) went to an absolute target.
+    if (regs().rip == scratch + d.size) {
+        regs().rip = next;
+    } else if (d.relative_branch) {
+        regs().rip += addr - scratch;
+    }
+    mark_regs_dirty();
+    return hits;
+}
+
+uint64_t Tracee::map_trace_buffer() {
+    if (!m_trace) {
+        m_trace = std::make_unique<TraceBuffer>();
+        m_trace->start();
+    }
+    if (!m_trace_remote) {
+        // The child opens the debugger's memfd through /proc, with the path staged in the scratch page.
+        uint64_t scratch = scratch_page();
+        if (!scratch) {
+            return 0;
+        }
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/fd/%d", getpid(), m_trace->fd());
+        write_memory(scratch, path, strlen(path) + 1);
+        m_scratch_owner = 0;
+        auto fd = static_cast<long>(
+            syscall(SYS_openat, {static_cast<unsigned long>(AT_FDCWD), scratch, O_RDWR, 0, 0, 0}));
+        if (fd < 0) {
+            return 0;
+        }
+        uint64_t addr = syscall(SYS_mmap, {0, TraceBuffer::SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                           static_cast<unsigned long>(fd), 0});
+        syscall(SYS_close, {static_cast<unsigned long>(fd), 0, 0, 0, 0, 0});
+        if (addr > -4096ul) {
+            return 0;
+        }
+        m_trace_remote = addr;
+    }
+    return m_trace_remote;
+}
+
+Tracee::TrampolineArea* Tracee::trampoline_area(uint64_t near) {
+    // Leave room for the area itself so every byte in it is within reach.
+    auto in_reach = [near](uint64_t addr) {
+        uint64_t distance = addr > near ? addr - near : near - addr;
+        return distance < (1ull << 31) - TRAMPOLINE_AREA_BYTES;
+    };
+    for (auto& area : m_trampoline_areas) {
+        if (area.used + MAX_TRAMPOLINE <= TRAMPOLINE_AREA_BYTES && in_reach(area.addr)) {
+            return &area;
+        }
+    }
+    // Look for a free spot below the code, one megabyte further down at a time. MAP_FIXED_NOREPLACE fails rather
+    // than move the mapping; kernels before 4.17 treat it as a hint, so the result is checked as well.
+    uint64_t base = near & ~(TRAMPOLINE_AREA_BYTES - 1);
+    for (uint64_t distance = 1 << 20; distance < 1ull << 30 && distance < base; distance += 1 << 20) {
+        uint64_t hint = base - distance;
+        uint64_t addr = syscall(SYS_mmap, {hint, TRAMPOLINE_AREA_BYTES, PROT_READ | PROT_EXEC,
+                                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE,
+                                           static_cast<unsigned long>(-1), 0});
+        if (addr > -4096ul) {
+            continue;
+        }
+        if (in_reach(addr)) {
+            m_trampoline_areas.push_back({.addr = addr, .used = 0});
+            return &m_trampoline_areas.back();
+        }
+        syscall(SYS_munmap, {addr, TRAMPOLINE_AREA_BYTES, 0, 0, 0, 0});
+    }
+    return nullptr;
+}
+
+std::optional<size_t> Tracee::insert_tracepoint(uint64_t addr, std::span<const uint64_t> memory) {
+    if (m_child_pid == NOCHILD) {
+        std::cerr << "Cannot trace in stopped process\n";
+        return {};
+    }
+    if (memory.size() > TraceRecord::MAX_MEMORY) {
+        std::cerr << "A tracepoint records at most " << TraceRecord::MAX_MEMORY << " memory locations\n";
+        return {};
+    }
+    uint64_t ring = map_trace_buffer();
+    if (!ring) {
+        std::cerr << "Cannot map the trace buffer into the process\n";
+        return {};
+    }
+    auto* area = trampoline_area(addr);
+    if (!area) {
+        std::cerr << "No room for a trampoline near " << std::hex << addr << std::dec << "\n";
+        return {};
+    }
+    uint8_t code[2 * DisplacedInsn::MAX_SIZE];
+    size_t n = read_memory_partial(addr, code, sizeof(code));
+    unshadow_breakpoints(addr, code, n);
+    size_t id = m_tracepoints.size();
+    uint64_t at = area->addr + area->used;
+    auto trampoline = build_trampoline(at, ring, id, addr, {code, n}, memory);
+    if (!trampoline) {
+        std::cerr << "Cannot relocate the instructions at " << std::hex << addr << std::dec << "\n";
+        return {};
+    }
+    // The jump replaces whole instructions; nothing else may be patched into them, and the process must not be
+    // stopped in the middle of them.
+    uint64_t end = addr + trampoline->window;
+    uint64_t pc = regs().rip;
+    bool overlaps = pc > addr && pc < end;
+    for (uint64_t a = addr; a < end; ++a) {
+        overlaps |= m_breakpoints.contains(a);
+    }
+    for (const auto& tp : m_tracepoints) {
+        overlaps |= tp.active && tp.addr < end && addr < tp.addr + tp.window;
+    }
+    if (overlaps) {
+        std::cerr << "The instructions at " << std::hex << addr << std::dec
+                  << " overlap a breakpoint, a tracepoint or the pc\n";
+        return {};
+    }
+    write_memory(at, trampoline->bytes.data(), trampoline->bytes.size());
+    area->used += trampoline->bytes.size();
+    // jmp rel32, then int3 over the rest of the window so a jump into it stops instead of running half instructions.
+    std::vector<uint8_t> patch(trampoline->window, 0xcc);
+    patch[0] = 0xe9;
+    int32_t rel = static_cast<int32_t>(at - (addr + 5));
+    memcpy(&patch[1], &rel, sizeof(rel));
+    write_memory(addr, patch.data(), patch.size());
+    m_tracepoints.push_back({.addr = addr, .window = trampoline->window, .memory = {memory.begin(), memory.end()}});
+    return id;
+}
+
+std::optional<size_t> Tracee::insert_watchpoint(const Watchpoint& wp) {
+    if (!DebugRegisters::valid(wp)) {
+        std::cerr << "Watchpoints cover 1, 2, 4 or 8 bytes aligned to their length\n";
+        return {};
+    }
+    auto slot = m_debug_regs.add(wp);
+    if (!slot) {
+        std::cerr << "All " << DebugRegisters::NUM_SLOTS << " debug registers are in use\n";
+        return {};
+    }
+    if (m_child_pid != NOCHILD) {
+        m_debug_regs.write(m_child_pid, *slot);
+    }
+    return slot;
+}
+
+bool Tracee::remove_watchpoint(size_t slot) {
+    if (!m_debug_regs.remove(slot)) {
+        return false;
+    }
     if (m_child_pid != NOCHILD) {
-        inject_breakpoint(bp);
+        m_debug_regs.write(m_child_pid, slot);
+    }
+    return true;
+}
+
+void Tracee::report_watchpoints(unsigned hits) {
+    for (size_t i = 0; i < DebugRegisters::NUM_SLOTS; ++i) {
+        if (!(hits & (1u << i))) {
+            continue;
+        }
+        const auto& wp = *m_debug_regs.slot(i);
+        if (wp.kind == WatchKind::EXECUTE) {
+            printf("Hit hardware breakpoint %zu at %#lx\n", i, wp.addr);
+            // The breakpoint faults before the instruction runs. The resume flag lets it run once without faulting
+            // again; the kernel normally sets it already.
+            if (!(regs().eflags & X86_EFLAGS_RF)) {
+                regs().eflags |= X86_EFLAGS_RF;
+                mark_regs_dirty();
+            }
+        } else {
+            uint64_t value = 0;
+            read_memory(wp.addr, &value, wp.len);
+            printf("Hit watchpoint %zu (%#lx, %zu bytes) at %#llx: value = %#lx\n", i, wp.addr, wp.len, regs().rip,
+                   value);
+        }
     }
 }
 
@@ -211,10 +1026,10 @@ int Tracee::wait_process_exit() {
         int status;
         util::throw_errno(waitpid(m_child_pid, &status, 0));
         if (WIFEXITED(status)) {
-            m_child_pid = NOCHILD;
+            mark_exited();
             return WEXITSTATUS(status);
         } else if (WIFSIGNALED(status)) {
-            m_child_pid = NOCHILD;
+            mark_exited();
             return WTERMSIG(status);
         }
     }
@@ -232,6 +1047,7 @@ int Tracee::disassemble(int lineNumber, size_t address) {
     int i = 0;
     while (i < lineNumber) {
         read_memory(reinterpret_cast<size_t>(address), &code, 16);
+        unshadow_breakpoints(address, code, sizeof(code));
 
         size_t count = cs_disasm(handle, code, 16, address, 1, &insn);
         if (count > 0) {
@@ -258,7 +1074,13 @@ int Tracee::disassemble(int lineNumber, size_t address) {
         return -1;
     }
     ulong base_address = disassembledInstructions[0]->address;
+    std::optional<SourceLocation> last_loc;
     for (auto instr : disassembledInstructions) {
+        auto loc = lookup_line(instr->address);
+        if (loc && (!last_loc || loc->line != last_loc->line || loc->file != last_loc->file)) {
+            std::cout << std::dec << loc->file << ":" << loc->line << std::endl;
+        }
+        last_loc = loc;
         std::cout << std::hex << instr->address << " <+" << instr->address - base_address << ">:\t" << instr->mnemonic
                   << "\t" << instr->op_str << std::endl;
     }
@@ -271,19 +1093,18 @@ int Tracee::disassemble(int lineNumber, size_t address) {
 
 unsigned long Tracee::syscall(const unsigned long syscall, const std::array<unsigned long, 6>& args) {
     // read registers
-    struct user_regs_struct regs;
-    ptrace(PTRACE_GETREGS, m_child_pid, nullptr, &regs);
+    struct user_regs_struct saved_regs = regs();
 
     // inject syscall & store prev instr at addr
-    unsigned long instruction_ptr_addr = regs.rip & ~0xfff;  // idk why im page aligning tbh
+    unsigned long instruction_ptr_addr = saved_regs.rip & ~0xfff;  // idk why im page aligning tbh
     int syscall_code = 0x050f;
 
     int instruction = 0;  // old value at memory
     read_memory(instruction_ptr_addr, &instruction, 2);
     write_memory(instruction_ptr_addr, &syscall_code, 2);  // overwrite to be syscall
 
-    // set regs (INTERFACE UNAVAILABLE)
-    struct user_regs_struct syscall_regs = regs;
+    // set regs, written back when the child resumes
+    auto& syscall_regs = regs();
     syscall_regs.rax = syscall;
     syscall_regs.rdi = args[0];
     syscall_regs.rsi = args[1];
@@ -292,88 +1113,25 @@ unsigned long Tracee::syscall(const unsigned long syscall, const std::array<unsi
     syscall_regs.r8 = args[4];
     syscall_regs.r9 = args[5];
     syscall_regs.rip = instruction_ptr_addr;
-    util::throw_errno(ptrace(PTRACE_SETREGS, m_child_pid, nullptr, &syscall_regs));
+    mark_regs_dirty();
 
-    step_into();  // actually run the syscall
+    single_step();  // actually run the syscall
 
     // retrieve return value
-    struct user_regs_struct after;
-    ptrace(PTRACE_GETREGS, m_child_pid, nullptr, &after);
-    unsigned long rv = after.rax;  // retvals at %rax
+    unsigned long rv = regs().rax;  // retvals at %rax
 
     write_memory(instruction_ptr_addr, &instruction, 2);  // restore instruction
 
     // set regs back
-    util::throw_errno(ptrace(PTRACE_SETREGS, m_child_pid, nullptr, &regs));
+    regs() = saved_regs;
+    mark_regs_dirty();
 
     return rv;
 }
 
-unsigned long long& get_register_ref(user_regs_struct& regs, Register reg) {
-    switch (reg) {
-        case R15:
-            return regs.r15;
-        case R14:
-            return regs.r14;
-        case R13:
-            return regs.r13;
-        case R12:
-            return regs.r12;
-        case RBP:
-            return regs.rbp;
-        case RBX:
-            return regs.rbx;
-        case R11:
-            return regs.r11;
-        case R10:
-            return regs.r10;
-        case R9:
-            return regs.r9;
-        case R8:
-            return regs.r8;
-        case RAX:
-            return regs.rax;
-        case RCX:
-            return regs.rcx;
-        case RDX:
-            return regs.rdx;
-        case RSI:
-            return regs.rsi;
-        case RDI:
-            return regs.rdi;
-        case ORIG_RAX:
-            return regs.orig_rax;
-        case RIP:
-            return regs.rip;
-        case CS:
-            return regs.cs;
-        case EFLAGS:
-            return regs.eflags;
-        case RSP:
-            return regs.rsp;
-        case SS:
-            return regs.ss;
-        case FS_BASE:
-            return regs.fs_base;
-        case GS_BASE:
-            return regs.gs_base;
-        case DS:
-            return regs.ds;
-        case ES:
-            return regs.es;
-        case FS:
-            return regs.fs;
-        case GS:
-            return regs.gs;
-        default:
-            throw std::runtime_error("Failed to get register ref");
-    }
-}
-
 uint64_t Tracee::read_register(Register reg, int size) {
-    struct user_regs_struct regs;
-    util::throw_errno(ptrace(PTRACE_GETREGS, m_child_pid, nullptr, &regs));
-    unsigned long long& value = get_register_ref(regs, reg);
+    uint64_t value;
+    memcpy(&value, reinterpret_cast<uint8_t*>(&regs()) + REGISTER_OFFSETS.at(reg), sizeof(value));
 
     switch (size) {  // size is in bytes
         case 1:      // 1 byte
@@ -390,10 +1148,9 @@ uint64_t Tracee::read_register(Register reg, int size) {
 }
 
 void Tracee::write_register(Register reg, int size, uint64_t value) {
-    struct user_regs_struct regs;
-    util::throw_errno(ptrace(PTRACE_GETREGS, m_child_pid, nullptr, &regs));
-
-    unsigned long long& full_register = get_register_ref(regs, reg);
+    auto* reg_ptr = reinterpret_cast<uint8_t*>(&regs()) + REGISTER_OFFSETS.at(reg);
+    uint64_t full_register;
+    memcpy(&full_register, reg_ptr, sizeof(full_register));
 
     switch (size) {  // size is in bytes
         case 1:      // 1 byte
@@ -412,59 +1169,57 @@ void Tracee::write_register(Register reg, int size, uint64_t value) {
             throw std::runtime_error("Unsupported register size");
     }
 
-    util::throw_errno(ptrace(PTRACE_SETREGS, m_child_pid, nullptr, &regs));
+    memcpy(reg_ptr, &full_register, sizeof(full_register));
+    mark_regs_dirty();
 }
 
-std::pair<uint64_t, uint64_t> Tracee::get_stackframe(uint64_t bp) {  // will only go up one layer
-    uint64_t next_bp = 0;
-    uint64_t return_address = 0;
-    read_memory(bp, &next_bp, 8);
-    read_memory(bp + 8, &return_address, 8);
+void Tracee::read_vector_register(VectorRegister reg, void* out) { m_xstate.read(m_child_pid, reg, out); }
 
-    return {return_address, next_bp};
-}
+void Tracee::write_vector_register(VectorRegister reg, const void* data) { m_xstate.write(m_child_pid, reg, data); }
 
 std::vector<int64_t> Tracee::backtrace() {
-    std::vector<int64_t> addresses{read_register(Register::RIP, 8)};
-    uint64_t bp = read_register(Register::RBP, 8);
+    // DWARF numbers the general purpose registers in this order, followed by the return address column.
+    static constexpr std::array<Register, DWARF::NUM_CFI_REGISTERS> DWARF_REGISTERS = {
+        Register::RAX, Register::RDX, Register::RCX, Register::RBX, Register::RSI, Register::RDI,
+        Register::RBP, Register::RSP, Register::R8,  Register::R9,  Register::R10, Register::R11,
+        Register::R12, Register::R13, Register::R14, Register::R15, Register::RIP,
+    };
+    Frame frame;
+    for (size_t i = 0; i < DWARF_REGISTERS.size(); ++i) {
+        frame.regs[i] = read_register(DWARF_REGISTERS[i], 8);
+    }
+    frame.known = (1u << DWARF::NUM_CFI_REGISTERS) - 1;
 
-    while (true) {
-        auto [return_address, next_bp] = get_stackframe(bp);
-        unsigned long long addr = ptrace(PTRACE_PEEKDATA, m_child_pid, next_bp, nullptr);
-        if (addr == (unsigned long long)-1) {
+    // The transfer stops short at the first unmapped page, which is normally the top of the stack mapping.
+    StackSnapshot stack;
+    stack.base = frame.regs[DWARF::REG_RSP];
+    stack.bytes.resize(m_stack_snapshot_bytes);
+    stack.bytes.resize(transfer_memory(stack.base, stack.bytes.data(), stack.bytes.size(), false));
+    Unwinder unwinder(m_modules, m_unwind_plans, [this, &stack](uint64_t addr, void* out, size_t size) {
+        return stack.read(addr, out, size) || read_memory_partial(addr, out, size) == size;
+    });
+    std::vector<int64_t> addresses{static_cast<int64_t>(frame.pc())};
+    while (addresses.size() < MAX_BACKTRACE) {
+        auto sp = frame.regs[DWARF::REG_RSP];
+        // Every caller's frame lies above its callee's; anything else means the unwind went astray.
+        if (!unwinder.step(frame) || frame.regs[DWARF::REG_RSP] <= sp) {
             break;
-        } else {
-            addresses.push_back(return_address);
-            bp = next_bp;
         }
+        addresses.push_back(frame.pc());
     }
     return addresses;
 }
 
-std::optional<uint64_t> Tracee::lookup_sym(std::string_view name) const {
-    std::optional<uint64_t> addr;
-    if ((addr = m_elf.lookup_sym(name))) {
-        return addr;
-    }
-    if (m_dl && (addr = m_dl->lookup_sym(name))) {
-        return addr;
-    }
-    for (const auto& shlib : m_shlibs) {
-        if ((addr = shlib.lookup_sym(name))) {
-            return addr;
-        }
-    }
-    return {};
-}
+std::optional<uint64_t> Tracee::lookup_sym(std::string_view name) const { return m_modules.lookup_sym(name); }
 
 std::optional<std::pair<uint64_t, uint64_t>> Tracee::find_segment(uint32_t type) {
     auto phdr_addr = m_auxv.at(AT_PHDR);
     auto phnum = m_auxv.at(AT_PHNUM);
     auto phent = m_auxv.at(AT_PHENT);
     util::throw_assert(phent == sizeof(Elf64_Phdr));
-    Elf64_Phdr phdr;
-    for (size_t i = 0; i < phnum; ++i) {
-        read_memory(phdr_addr + i * phent, &phdr, phent);
+    std::vector<Elf64_Phdr> phdrs(phnum);
+    read_memory(phdr_addr, phdrs.data(), phnum * phent);
+    for (const auto& phdr : phdrs) {
         if (phdr.p_type == type) {
             return {{m_elf.base() + phdr.p_vaddr, phdr.p_memsz}};
         }
@@ -474,9 +1229,9 @@ std::optional<std::pair<uint64_t, uint64_t>> Tracee::find_segment(uint32_t type)
 
 std::optional<uint64_t> Tracee::find_dynamic_entry(int64_t tag) {
     auto [dyn_addr, dyn_size] = m_dyn;
-    Elf64_Dyn dyn;
-    for (size_t i = 0; i < dyn_size / sizeof(dyn); ++i) {
-        read_memory(dyn_addr + i * sizeof(dyn), &dyn, sizeof(dyn));
+    std::vector<Elf64_Dyn> dyns(dyn_size / sizeof(Elf64_Dyn));
+    read_memory(dyn_addr, dyns.data(), dyns.size() * sizeof(Elf64_Dyn));
+    for (const auto& dyn : dyns) {
         if (dyn.d_tag == tag) {
             return dyn.d_un.d_val;
         }
@@ -485,6 +1240,9 @@ std::optional<uint64_t> Tracee::find_dynamic_entry(int64_t tag) {
 }
 
 void Tracee::post_spawn() {
+    m_auxv.clear();
+    m_shlibs.clear();
+    m_dl.reset();
     char auxv_path[256];
     snprintf(auxv_path, sizeof(auxv_path), "/proc/%d/auxv", m_child_pid);
     int auxv_fd = util::throw_errno(open(auxv_path, O_RDONLY));
@@ -503,39 +1261,72 @@ void Tracee::post_spawn() {
     if (m_elf.base() != 0) {
         printf("PIE executable (base %#lx)\n", m_elf.base());
 
-        std::unordered_map<size_t, Breakpoint> new_breakpoints;
-        for (auto& [addr, bp] : m_breakpoints) {
-            bp.addr += m_elf.base();
-            inject_breakpoint(bp);
-            new_breakpoints.emplace(m_elf.base() + addr, bp);
-        }
-        m_breakpoints = std::move(new_breakpoints);
+        m_breakpoints.rebase(m_elf.base());
+        m_debug_regs.rebase(m_elf.base());
+        recompile_conditions();
     }
+    m_debug_regs.write_all(m_child_pid);
+    std::vector<uint32_t> bps(m_breakpoints.size());
+    std::iota(bps.begin(), bps.end(), 0);
+    inject_breakpoints(bps);
 
     if (auto interp = m_elf.interp()) {
-        m_dl.emplace(interp->data(), m_auxv.at(AT_BASE));
+        m_dl.emplace(interp->data(), m_auxv.at(AT_BASE), true);
         printf("Setting temporary breakpoint at entry point (%#lx)\n", entry);
         insert_breakpoint(entry);
         continue_process();
+        uninject_breakpoint(m_breakpoints.find(entry));
         m_breakpoints.erase(entry);
 
         m_dyn = *find_segment(PT_DYNAMIC);
         auto debug_addr = *find_dynamic_entry(DT_DEBUG);
         r_debug debug;
         read_memory(debug_addr, &debug, sizeof(debug));
+        // The link_map chain has to be followed one node at a time, but nodes share pages with each other so the
+        // page cache absorbs most of it. The names are then fetched together.
+        std::vector<link_map> lms;
         link_map lm;
         for (auto lm_addr = reinterpret_cast<uint64_t>(debug.r_map); lm_addr != 0;
              lm_addr = reinterpret_cast<uint64_t>(lm.l_next)) {
             read_memory(lm_addr, &lm, sizeof(lm));
-            if (!lm.l_prev) {
-                continue;
+            if (lm.l_prev) {
+                lms.push_back(lm);
             }
-            auto name = read_string(reinterpret_cast<uint64_t>(lm.l_name));
+        }
+        std::vector<uint64_t> name_addrs;
+        for (const auto& lm : lms) {
+            name_addrs.push_back(reinterpret_cast<uint64_t>(lm.l_name));
+        }
+        auto names = read_strings(name_addrs);
+        // Map the libraries concurrently, then let their symbol indexes load in the background. Lookups only wait
+        // for the module they touch.
+        auto& pool = ThreadPool::global();
+        std::vector<std::future<ELF>> loads;
+        for (size_t i = 0; i < lms.size(); ++i) {
+            const auto& name = names[i];
             if (name == *interp || name == "linux-vdso.so.1") {
                 continue;
             }
-            printf("Adding shared library %s (%#lx)\n", name.c_str(), lm.l_addr);
-            m_shlibs.emplace_back(name.c_str(), lm.l_addr);
+            printf("Adding shared library %s (%#lx)\n", name.c_str(), lms[i].l_addr);
+            loads.push_back(pool.submit([name, base = lms[i].l_addr] { return ELF(name.c_str(), base, true); }));
+        }
+        for (auto& load : loads) {
+            m_shlibs.push_back(load.get());
+        }
+        m_dl->start_symbol_load(pool);
+        for (const auto& shlib : m_shlibs) {
+            shlib.start_symbol_load(pool);
         }
     }
+
+    std::vector<const ELF*> modules{&m_elf};
+    if (m_dl) {
+        modules.push_back(&*m_dl);
+    }
+    for (const auto& shlib : m_shlibs) {
+        modules.push_back(&shlib);
+    }
+    m_modules.rebuild(std::move(modules));
+    m_unwind_plans.clear();
+    recompile_conditions();
 }
@@ -1,51 +1,98 @@
 #pragma once
 
 #include <signal.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/user.h>
 
 #include <array>
+#include <memory>
 #include <optional>
+#include <span>
 #include <string>
 #include <string_view>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include "breakpoints.hpp"
+#include "condition.hpp"
+#include "debugregs.hpp"
 #include "elf.hpp"
+#include "memcache.hpp"
+#include "modules.hpp"
+#include "relocate.hpp"
+#include "symtab.hpp"
+#include "tracepoint.hpp"
+#include "unwind.hpp"
+#include "xstate.hpp"
+
+// X-macro over the general purpose registers, in user_regs_struct order: X(enum name, user_regs_struct field).
+#define CYDBG_REGISTERS(X) \
+    X(R15, r15)            \
+    X(R14, r14)            \
+    X(R13, r13)            \
+    X(R12, r12)            \
+    X(RBP, rbp)            \
+    X(RBX, rbx)            \
+    X(R11, r11)            \
+    X(R10, r10)            \
+    X(R9, r9)              \
+    X(R8, r8)              \
+    X(RAX, rax)            \
+    X(RCX, rcx)            \
+    X(RDX, rdx)            \
+    X(RSI, rsi)            \
+    X(RDI, rdi)            \
+    X(ORIG_RAX, orig_rax)  \
+    X(RIP, rip)            \
+    X(CS, cs)              \
+    X(EFLAGS, eflags)      \
+    X(RSP, rsp)            \
+    X(SS, ss)              \
+    X(FS_BASE, fs_base)    \
+    X(GS_BASE, gs_base)    \
+    X(DS, ds)              \
+    X(ES, es)              \
+    X(FS, fs)              \
+    X(GS, gs)
 
 enum Register {
-    R15,
-    R14,
-    R13,
-    R12,
-    RBP,
-    RBX,
-    R11,
-    R10,
-    R9,
-    R8,
-    RAX,
-    RCX,
-    RDX,
-    RSI,
-    RDI,
-    ORIG_RAX,
-    RIP,
-    CS,
-    EFLAGS,
-    RSP,
-    SS,
-    FS_BASE,
-    GS_BASE,
-    DS,
-    ES,
-    FS,
-    GS,
+#define X(reg, field) reg,
+    CYDBG_REGISTERS(X)
+#undef X
+    NUM_REGISTERS,
+};
+
+// Byte offset of each register within user_regs_struct, indexed by Register.
+inline constexpr std::array<size_t, NUM_REGISTERS> REGISTER_OFFSETS = {
+#define X(reg, field) offsetof(user_regs_struct, field),
+    CYDBG_REGISTERS(X)
+#undef X
+};
+
+// Lowercase name of each register, indexed by Register.
+inline constexpr std::array<std::string_view, NUM_REGISTERS> REGISTER_NAMES = {
+#define X(reg, field) #field,
+    CYDBG_REGISTERS(X)
+#undef X
+};
+
+// One destination of a Tracee::read_batch call. `ok` is set once the batch completes.
+struct MemoryRange {
+    size_t addr = 0;
+    void* out = nullptr;
+    size_t size = 0;
+    bool ok = false;
 };
 
 class Tracee {
    public:
-    explicit Tracee(const char* pathname) : m_elf(pathname), m_pathname(pathname) {}
+    static constexpr size_t MAX_STRING_LEN = 1 << 16;
+    static constexpr size_t MAX_BACKTRACE = 1024;
+    static constexpr size_t DEFAULT_STACK_SNAPSHOT = 1 << 18;
+
+    explicit Tracee(const char* pathname) : m_elf(pathname), m_pathname(pathname) { m_modules.rebuild({&m_elf}); }
     Tracee(const Tracee& other) = delete;
     Tracee& operator=(const Tracee& other) = delete;
     ~Tracee();
@@ -58,52 +105,191 @@ class Tracee {
     void kill_process(int sgn = SIGKILL);
     // Spawns a new child process given the same arguments as execve().
     void spawn_process(char* const argv[], char* const envp[]);
-    // Single steps the child process.
+    // Single steps the child process. An instruction under a breakpoint is stepped over out of line.
     void step_into();
     // Reads `sz` bytes at address `addr` in the child process to address `out` in the current process.
     void read_memory(size_t addr, void* out, size_t sz);
     // Writes `sz` bytes from address `data` in the current process to address `addr` in the child process.
     void write_memory(size_t addr, const void* data, size_t sz);
-    std::string read_string(uint64_t addr);
+    // Like read_memory/write_memory, but stop at the first inaccessible page instead of throwing. Returns the
+    // number of bytes transferred.
+    size_t read_memory_partial(size_t addr, void* out, size_t sz);
+    size_t write_memory_partial(size_t addr, const void* data, size_t sz);
+    // Reads many unrelated ranges, fetching all of their uncached pages with one vectored transfer. Sets `ok` on each
+    // range and returns the number of ranges read completely.
+    size_t read_batch(std::span<MemoryRange> ranges);
+    // Reads a NUL-terminated string of at most `max_len` bytes, one page-bounded transfer at a time.
+    std::string read_string(uint64_t addr, size_t max_len = MAX_STRING_LEN);
+    // Reads many strings at once, batching the reads for all unfinished strings in each round. A string whose memory
+    // becomes unreadable is returned truncated.
+    std::vector<std::string> read_strings(std::span<const uint64_t> addrs, size_t max_len = MAX_STRING_LEN);
     // Inserts a breakpoint at address `addr` in the child process.
     void insert_breakpoint(size_t addr);
+    // Inserts breakpoints at many addresses at once. In a running process, each page holding new breakpoints is read
+    // once, patched locally and written back once. Returns the number of breakpoints added.
+    size_t insert_breakpoints(std::span<const uint64_t> addrs);
+    // Compiles a breakpoint condition. Names resolve to registers, then global variables, then symbols.
+    std::optional<Condition> compile_condition(std::string_view text, std::string& error) const;
+    // Sets (or with nothing, clears) the condition of the breakpoint at `addr`. A breakpoint whose condition is false
+    // is passed over inside continue_process without being reported. Returns false if there is no breakpoint there.
+    bool set_breakpoint_condition(size_t addr, std::optional<Condition> condition);
+    // Passes over the next `count` hits of the breakpoint at `addr` whose condition holds. Returns false if there is no
+    // breakpoint there.
+    bool set_breakpoint_ignore(size_t addr, uint64_t count);
+    struct BreakpointStatus {
+        size_t addr;
+        // Hits whose condition held, including ignored ones.
+        uint64_t hits;
+        uint64_t ignore;
+        // The condition's text, or empty.
+        std::string condition;
+    };
+    // The breakpoints, ordered by address.
+    std::vector<BreakpointStatus> breakpoint_status() const;
+    // Sets a hardware breakpoint or watchpoint in a free debug register. These need no code patching, and execution
+    // resumes past them without a single step. Returns the slot, or nothing if `wp` is unsupported or all slots are
+    // taken.
+    std::optional<size_t> insert_watchpoint(const Watchpoint& wp);
+    // Frees a debug register slot. Returns false if it was not in use.
+    bool remove_watchpoint(size_t slot);
+    // Traces `addr` without stopping the process: the instructions there are moved into a trampoline, reached by a
+    // jump written over them, which records the registers and eight bytes from each of `memory` into a ring buffer
+    // shared with the debugger. Returns the tracepoint's id, or nothing if the code there cannot be moved.
+    std::optional<size_t> insert_tracepoint(uint64_t addr, std::span<const uint64_t> memory);
+    const std::vector<Tracepoint>& tracepoints() const { return m_tracepoints; }
+    // The ring the tracepoints write to, or nullptr before the first one.
+    TraceBuffer* trace_buffer() { return m_trace.get(); }
     // Prints out a number of disassembled instructions starting from address
     int disassemble(int lineNumber, size_t address);
 
     uint64_t read_register(Register reg, int size);
     void write_register(Register reg, int size, uint64_t value);
+    // Reads or writes an XSAVE-backed register. The buffer holds XState::size(reg) bytes.
+    void read_vector_register(VectorRegister reg, void* out);
+    void write_vector_register(VectorRegister reg, const void* data);
 
-    // Gets the current stack frame, returning a (return address, parent frame pointer) base.
-    std::pair<uint64_t, uint64_t> get_stackframe(uint64_t bp);
+    // Unwinds the stack through .eh_frame CFI, returning at most MAX_BACKTRACE pcs from the innermost frame out. The
+    // stack is copied from RSP up to the end of its mapping or the snapshot limit in one transfer; only frames outside
+    // that window are read individually.
     std::vector<int64_t> backtrace();
+    void set_stack_snapshot_limit(size_t bytes) { m_stack_snapshot_bytes = bytes; }
     unsigned long syscall(const unsigned long syscall, const std::array<unsigned long, 6>& args);
 
     std::optional<uint64_t> lookup_sym(std::string_view name) const;
-    std::optional<std::string_view> lookup_addr(uint64_t addr) const { return m_elf.lookup_addr(addr); }
+    std::optional<SymbolMatch> lookup_addr(uint64_t addr) const { return m_modules.lookup_addr(addr); }
+    std::optional<SourceLocation> lookup_line(uint64_t addr) const { return m_modules.lookup_line(addr); }
+    std::vector<uint64_t> find_line(std::string_view file, uint32_t line) const {
+        return m_modules.find_line(file, line);
+    }
+    std::vector<uint64_t> find_functions(std::string_view pattern) const { return m_modules.find_functions(pattern); }
+    std::optional<std::pair<const ELF*, GlobalVariable>> find_global(std::string_view name) const {
+        return m_modules.find_global(name);
+    }
 
    private:
+    // What the breakpoint table keeps about a breakpoint besides its address and original byte.
     struct Breakpoint {
-        size_t addr = 0;
-        bool injected = false;
-        uint8_t orig_byte = 0;
+        // The original instruction, prepared on the first step over it. Empty if it cannot be displaced.
+        std::optional<DisplacedInsn> displaced;
+        bool displace_tried = false;
+        uint64_t hits = 0;
+        uint64_t ignore = 0;
+        std::optional<Condition> condition;
+    };
+
+    // Executable memory in the child that trampolines are carved from.
+    struct TrampolineArea {
+        uint64_t addr;
+        size_t used;
     };
 
     // Injects a breakpoint into a running child process.
-    void inject_breakpoint(Breakpoint& bp);
+    void inject_breakpoint(uint32_t bp) { inject_breakpoints({&bp, 1}); }
+    // Injects breakpoints with one read and one write per run of adjacent pages. Returns the number injected; those on
+    // unreadable memory are left out.
+    size_t inject_breakpoints(std::span<const uint32_t> bps);
     // Uninjects a breakpoint from a running child process.
-    void uninject_breakpoint(Breakpoint& bp);
+    void uninject_breakpoint(uint32_t bp);
+    // Writes code, going straight to /proc/<pid>/mem since text pages are read-only to process_vm_writev.
+    void write_code(size_t addr, const void* data, size_t sz);
+    // Replaces the 0xcc bytes of injected breakpoints in a copy of [addr, addr + size) with the original bytes.
+    void unshadow_breakpoints(size_t addr, uint8_t* buf, size_t size);
+    // Executes the instruction under `bp`, which the child is stopped at, without lifting the breakpoint: the
+    // instruction is copied to the scratch page, single stepped there, and the registers it left pointing into the
+    // copy are fixed up. Instructions that cannot be displaced fall back to lifting the breakpoint for one step.
+    // Returns the mask of watchpoints that fired during the step.
+    unsigned step_over_breakpoint(uint32_t bp);
+    // Maps the scratch page for displaced instructions on first use. Returns 0 if that failed.
+    uint64_t scratch_page();
+    // Single steps the child, whatever is at its pc. Returns the mask of watchpoints that fired on the way, consuming
+    // DR6 so that they are not taken for the cause of a later int3 stop.
+    unsigned single_step();
+    // Maps the trace ring into the process on first use, returning its address there, or 0 if that failed.
+    uint64_t map_trace_buffer();
+    // Returns an area with room for a trampoline within rel32 reach of `near`, mapping another if needed, or nullptr.
+    TrampolineArea* trampoline_area(uint64_t near);
+    // Counts a hit of `bp`, which the child is stopped at, and decides whether to report it: its condition must hold
+    // and its ignore count must have run out. A condition that cannot be evaluated stops the child.
+    bool should_stop(uint32_t bp);
+    // Evaluates `condition` against the cached registers, fetching its fixed loads in one batch.
+    std::optional<bool> evaluate_condition(const Condition& condition);
+    // Compiles the breakpoint conditions again after the modules moved, dropping those that no longer compile.
+    void recompile_conditions();
+    // Reports the debug register slots in `hits` after the SIGTRAP they raised.
+    void report_watchpoints(unsigned hits);
     std::optional<std::pair<uint64_t, uint64_t>> find_segment(uint32_t type);
     std::optional<uint64_t> find_dynamic_entry(int64_t tag);
     void post_spawn();
+    // Returns the child's general purpose registers, fetching them at most once per stop.
+    user_regs_struct& regs();
+    // Marks the cached registers as modified so they are written back before the child resumes.
+    void mark_regs_dirty() { m_regs_dirty = true; }
+    // Writes back dirty registers and drops per-stop state before the child runs again.
+    void before_resume();
+    // Forgets the child process after it has exited.
+    void mark_exited();
+    // Returns a lazily opened fd for /proc/<pid>/mem, or -1 if it cannot be opened.
+    int mem_fd();
+    // Reads through the page cache, returning the number of bytes read before the first inaccessible page.
+    size_t read_cached(size_t addr, void* out, size_t sz);
+    // Reads whole pages into consecutive PageCache::PAGE_BYTES slots of `buf`, recording which pages succeeded.
+    void fetch_pages(std::span<const uint64_t> pages, uint8_t* buf, std::vector<bool>& ok);
+    // Bulk memory transfer engine. Each tier returns the number of bytes moved before the first failure;
+    // transfer_memory tries process_vm_readv/writev, then /proc/<pid>/mem, then word-at-a-time ptrace.
+    size_t transfer_memory(size_t addr, void* buf, size_t sz, bool write);
+    size_t transfer_vm(size_t addr, void* buf, size_t sz, bool write);
+    size_t transfer_proc_mem(size_t addr, void* buf, size_t sz, bool write);
+    size_t transfer_ptrace(size_t addr, void* buf, size_t sz, bool write);
 
     static constexpr pid_t NOCHILD = -1;
+    static constexpr size_t TRAMPOLINE_AREA_BYTES = 1 << 16;
+    // Generous upper bound on the size of one trampoline.
+    static constexpr size_t MAX_TRAMPOLINE = 1024;
     bool m_breakpoint_hit = false;
     pid_t m_child_pid = NOCHILD;
-    std::unordered_map<size_t, Breakpoint> m_breakpoints;
+    int m_mem_fd = -1;
+    PageCache m_page_cache;
+    std::optional<user_regs_struct> m_regs;
+    bool m_regs_dirty = false;
+    XState m_xstate;
+    BreakpointTable<Breakpoint> m_breakpoints;
+    DebugRegisters m_debug_regs;
+    // The scratch page (0 until mapped), whether mapping it failed, and which breakpoint's instruction it holds.
+    uint64_t m_scratch = 0;
+    bool m_scratch_failed = false;
+    size_t m_scratch_owner = 0;
+    std::unique_ptr<TraceBuffer> m_trace;
+    // Where the ring is mapped in the process, or 0.
+    uint64_t m_trace_remote = 0;
+    std::vector<Tracepoint> m_tracepoints;
+    std::vector<TrampolineArea> m_trampoline_areas;
     std::unordered_map<uint64_t, uint64_t> m_auxv;
     ELF m_elf;
     std::optional<ELF> m_dl;
     std::vector<ELF> m_shlibs;
     std::pair<uint64_t, uint64_t> m_dyn;
+    ModuleMap m_modules;
+    UnwindPlanCache m_unwind_plans;
+    size_t m_stack_snapshot_bytes = DEFAULT_STACK_SNAPSHOT;
     const char* m_pathname;
 };
@@ -0,0 +1,966 @@
+#include "debuginfo.hpp"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <future>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "dwarf.hpp"
+#include "dwarf2.h"
+#include "threadpool.hpp"
+#include "util.hpp"
+
+namespace {
+using DWARF::read;
+using DWARF::read_leb128;
+using DWARF::read_length;
+using DWARF::read_uleb128;
+
+// Arrays and structures are cut off after this many elements when printed.
+constexpr size_t MAX_PRINTED_ELEMENTS = 64;
+// Nesting depth at which printing stops following types, in case of malformed cycles.
+constexpr int MAX_PRINT_DEPTH = 16;
+
+uint64_t read_offset(const uint8_t*& p, bool is_dwarf64) { return is_dwarf64 ? read<uint64_t>(p) : read<uint32_t>(p); }
+
+uint64_t read_uint(const uint8_t* p, size_t size) {
+    uint64_t value = 0;
+    memcpy(&value, p, std::min(size, sizeof(value)));
+    return value;
+}
+
+int64_t sign_extend(uint64_t value, size_t size) {
+    if (size >= 8) return static_cast<int64_t>(value);
+    auto shift = 64 - 8 * size;
+    return static_cast<int64_t>(value << shift) >> shift;
+}
+
+// The .debug_names hash: DJB, optionally over ASCII-case-folded input as producers that fold names use.
+uint32_t djb_hash(std::string_view name, bool fold) {
+    uint32_t h = 5381;
+    for (unsigned char c : name) {
+        h = h * 33 + (fold ? tolower(c) : c);
+    }
+    return h;
+}
+
+// The .gdb_index symbol table hash.
+uint32_t gdb_index_hash(std::string_view name, uint32_t version) {
+    uint32_t r = 0;
+    for (unsigned char c : name) {
+        if (version >= 5) c = tolower(c);
+        r = r * 67 + c - 113;
+    }
+    return r;
+}
+
+bool is_unit_child_tag(uint16_t tag) { return tag == DW_TAG_namespace; }
+}  // namespace
+
+DebugInfo::DebugInfo(const DebugSections& sections, ThreadPool& pool) : m_sections(sections), m_pool(pool) {}
+
+DebugInfo::AbbrevTable DebugInfo::parse_abbrevs(std::span<const uint8_t> section, uint64_t offset) {
+    util::throw_assert(offset < section.size(), "abbreviation table offset out of range");
+    AbbrevTable table;
+    const auto* p = section.data() + offset;
+    const auto* end = section.data() + section.size();
+    while (p < end) {
+        auto code = read_uleb128(p, end);
+        if (code == 0) break;
+        util::throw_assert(code < (1 << 24), "abbreviation code too large");
+        if (table.size() <= code) table.resize(code + 1);
+        auto& abbrev = table[code];
+        abbrev.tag = read_uleb128(p, end);
+        abbrev.has_children = *p++ == DW_children_yes;
+        while (true) {
+            auto name = read_uleb128(p, end);
+            auto form = read_uleb128(p, end);
+            if (name == 0 && form == 0) break;
+            int64_t implicit_const = form == DW_FORM_implicit_const ? read_leb128(p, end) : 0;
+            abbrev.specs.push_back({static_cast<uint16_t>(name), static_cast<uint16_t>(form), implicit_const});
+        }
+    }
+    return table;
+}
+
+void DebugInfo::read_attribute(const uint8_t*& p, const uint8_t* end, const Unit& unit, uint16_t form,
+                               int64_t implicit_const, Attribute& attr) {
+    attr.form = form;
+    attr.value = 0;
+    attr.data = nullptr;
+    switch (form) {
+        case DW_FORM_addr:
+            attr.value = unit.address_size == 4 ? read<uint32_t>(p) : read<uint64_t>(p);
+            break;
+        case DW_FORM_data1:
+        case DW_FORM_flag:
+        case DW_FORM_strx1:
+        case DW_FORM_addrx1:
+            attr.value = read<uint8_t>(p);
+            break;
+        case DW_FORM_data2:
+        case DW_FORM_strx2:
+        case DW_FORM_addrx2:
+            attr.value = read<uint16_t>(p);
+            break;
+        case DW_FORM_strx3:
+        case DW_FORM_addrx3:
+            attr.value = read_uint(p, 3);
+            p += 3;
+            break;
+        case DW_FORM_data4:
+        case DW_FORM_strx4:
+        case DW_FORM_addrx4:
+            attr.value = read<uint32_t>(p);
+            break;
+        case DW_FORM_data8:
+        case DW_FORM_ref_sig8:
+            attr.value = read<uint64_t>(p);
+            break;
+        case DW_FORM_data16:
+            attr.data = p;
+            attr.value = 16;
+            p += 16;
+            break;
+        case DW_FORM_sdata:
+            attr.value = read_leb128(p, end);
+            break;
+        case DW_FORM_udata:
+        case DW_FORM_strx:
+        case DW_FORM_addrx:
+        case DW_FORM_loclistx:
+        case DW_FORM_rnglistx:
+            attr.value = read_uleb128(p, end);
+            break;
+        case DW_FORM_string:
+            attr.data = p;
+            attr.value = strnlen(reinterpret_cast<const char*>(p), end - p);
+            p += attr.value + 1;
+            break;
+        case DW_FORM_strp:
+        case DW_FORM_line_strp:
+        case DW_FORM_sec_offset:
+        case DW_FORM_strp_sup:
+        case DW_FORM_GNU_strp_alt:
+        case DW_FORM_GNU_ref_alt:
+            attr.value = read_offset(p, unit.is_dwarf64);
+            break;
+        case DW_FORM_ref1:
+            attr.value = unit.offset + read<uint8_t>(p);
+            break;
+        case DW_FORM_ref2:
+            attr.value = unit.offset + read<uint16_t>(p);
+            break;
+        case DW_FORM_ref4:
+            attr.value = unit.offset + read<uint32_t>(p);
+            break;
+        case DW_FORM_ref8:
+            attr.value = unit.offset + read<uint64_t>(p);
+            break;
+        case DW_FORM_ref_udata:
+            attr.value = unit.offset + read_uleb128(p, end);
+            break;
+        case DW_FORM_ref_addr:
+            // DWARF 2 sized these like addresses; later versions like offsets.
+            attr.value = unit.version <= 2 ? read<uint64_t>(p) : read_offset(p, unit.is_dwarf64);
+            break;
+        case DW_FORM_exprloc:
+        case DW_FORM_block:
+            attr.value = read_uleb128(p, end);
+            attr.data = p;
+            p += attr.value;
+            break;
+        case DW_FORM_block1:
+            attr.value = read<uint8_t>(p);
+            attr.data = p;
+            p += attr.value;
+            break;
+        case DW_FORM_block2:
+            attr.value = read<uint16_t>(p);
+            attr.data = p;
+            p += attr.value;
+            break;
+        case DW_FORM_block4:
+            attr.value = read<uint32_t>(p);
+            attr.data = p;
+            p += attr.value;
+            break;
+        case DW_FORM_flag_present:
+            attr.value = 1;
+            break;
+        case DW_FORM_implicit_const:
+            attr.value = implicit_const;
+            break;
+        case DW_FORM_indirect:
+            read_attribute(p, end, unit, read_uleb128(p, end), implicit_const, attr);
+            break;
+        default:
+            util::throw_assert(false, "unsupported DWARF attribute form");
+    }
+    util::throw_assert(p <= end, "DWARF attribute extends past its unit");
+}
+
+void DebugInfo::skip_children(const uint8_t*& p, const uint8_t* begin, const Unit& unit, const Attribute* sibling) {
+    if (sibling && sibling->value > static_cast<uint64_t>(p - begin) && sibling->value <= unit.end) {
+        p = begin + sibling->value;
+        return;
+    }
+    const auto* end = begin + unit.end;
+    Attribute scratch;
+    size_t depth = 1;
+    while (depth > 0 && p < end) {
+        auto code = read_uleb128(p, end);
+        if (code == 0) {
+            --depth;
+            continue;
+        }
+        util::throw_assert(code < unit.abbrevs->size(), "bad abbreviation code");
+        const auto& abbrev = (*unit.abbrevs)[code];
+        for (const auto& spec : abbrev.specs) {
+            read_attribute(p, end, unit, spec.form, spec.implicit_const, scratch);
+        }
+        depth += abbrev.has_children;
+    }
+}
+
+std::string_view DebugInfo::string_at(std::span<const uint8_t> section, uint64_t offset) {
+    util::throw_assert(offset < section.size(), "string offset out of range");
+    const auto* s = reinterpret_cast<const char*>(section.data() + offset);
+    return {s, strnlen(s, section.size() - offset)};
+}
+
+std::optional<std::string_view> DebugInfo::string_value(const DebugSections& sections, const Unit& unit,
+                                                        const Attribute& attr) {
+    switch (attr.form) {
+        case DW_FORM_string:
+            return std::string_view(reinterpret_cast<const char*>(attr.data), attr.value);
+        case DW_FORM_strp:
+            return string_at(sections.debug_str, attr.value);
+        case DW_FORM_line_strp:
+            return string_at(sections.debug_line_str, attr.value);
+        case DW_FORM_strx:
+        case DW_FORM_strx1:
+        case DW_FORM_strx2:
+        case DW_FORM_strx3:
+        case DW_FORM_strx4: {
+            size_t size = unit.is_dwarf64 ? 8 : 4;
+            uint64_t pos = unit.str_offsets_base + attr.value * size;
+            util::throw_assert(pos + size <= sections.debug_str_offsets.size(), "string index out of range");
+            return string_at(sections.debug_str, read_uint(sections.debug_str_offsets.data() + pos, size));
+        }
+        default:
+            return {};
+    }
+}
+
+void DebugInfo::load_units() {
+    if (m_units_loaded) {
+        return;
+    }
+    m_units_loaded = true;
+    const auto* begin = m_sections.debug_info.data();
+    const auto* end = begin + m_sections.debug_info.size();
+    const auto* p = begin;
+    while (p < end) {
+        Unit unit{};
+        unit.offset = p - begin;
+        auto len = read_length(p, unit.is_dwarf64);
+        util::throw_assert(len <= static_cast<uint64_t>(end - p), "unit extends past .debug_info");
+        unit.end = p - begin + len;
+        unit.version = read<uint16_t>(p);
+        util::throw_assert(unit.version >= 2 && unit.version <= 5, "unsupported .debug_info version");
+        if (unit.version >= 5) {
+            auto unit_type = *p++;
+            unit.address_size = *p++;
+            unit.abbrev_offset = read_offset(p, unit.is_dwarf64);
+            if (unit_type == DW_UT_skeleton || unit_type == DW_UT_split_compile) {
+                p += sizeof(uint64_t);
+            } else if (unit_type == DW_UT_type || unit_type == DW_UT_split_type) {
+                p += sizeof(uint64_t);
+                read_offset(p, unit.is_dwarf64);
+            }
+        } else {
+            unit.abbrev_offset = read_offset(p, unit.is_dwarf64);
+            unit.address_size = *p++;
+        }
+        unit.first_die = p - begin;
+        m_units.push_back(unit);
+        p = begin + unit.end;
+    }
+}
+
+uint32_t DebugInfo::unit_containing(uint64_t offset) {
+    load_units();
+    auto it = std::upper_bound(m_units.begin(), m_units.end(), offset,
+                               [](uint64_t off, const Unit& unit) { return off < unit.offset; });
+    util::throw_assert(it != m_units.begin() && offset < (it - 1)->end, "DIE offset outside any unit");
+    return it - m_units.begin() - 1;
+}
+
+const DebugInfo::Unit& DebugInfo::prepare_unit(uint32_t index) {
+    auto& unit = m_units[index];
+    if (!unit.abbrevs) {
+        auto& table = m_abbrevs[unit.abbrev_offset];
+        if (!table) {
+            table = std::make_unique<const AbbrevTable>(parse_abbrevs(m_sections.debug_abbrev, unit.abbrev_offset));
+        }
+        unit.abbrevs = table.get();
+    }
+    return unit;
+}
+
+void DebugInfo::load_unit_bases(uint32_t index) {
+    if (m_units[index].bases_loaded) {
+        return;
+    }
+    m_units[index].bases_loaded = true;
+    // Without DW_AT_str_offsets_base, the unit uses the first contribution, right after its header.
+    if (m_units[index].version >= 5) {
+        m_units[index].str_offsets_base = m_units[index].is_dwarf64 ? 16 : 8;
+    }
+    auto root = die_at(m_units[index].first_die);
+    if (const auto* base = attribute(root, DW_AT_str_offsets_base)) m_units[index].str_offsets_base = base->value;
+    if (const auto* base = attribute(root, DW_AT_addr_base)) m_units[index].addr_base = base->value;
+    if (const auto* base = attribute(root, DW_AT_GNU_addr_base)) m_units[index].addr_base = base->value;
+}
+
+uint32_t DebugInfo::parse_die(const uint8_t*& p, uint32_t unit_index, uint32_t parent) {
+    const auto* begin = m_sections.debug_info.data();
+    uint64_t offset = p - begin;
+    const auto& unit = prepare_unit(unit_index);
+    const auto* end = begin + unit.end;
+    auto code = read_uleb128(p, end);
+    if (code == 0) {
+        return NONE;
+    }
+    if (auto it = m_die_index.find(offset); it != m_die_index.end()) {
+        auto& known = m_dies[it->second];
+        if (known.parent == NONE) known.parent = parent;
+        p = begin + known.children;
+        return it->second;
+    }
+    util::throw_assert(code < unit.abbrevs->size(), "bad abbreviation code");
+    const auto& abbrev = (*unit.abbrevs)[code];
+    Die die{};
+    die.offset = offset;
+    die.unit = unit_index;
+    die.parent = parent;
+    die.first_child = NONE;
+    die.next_sibling = NONE;
+    die.attrs = m_attrs.size();
+    die.attr_count = abbrev.specs.size();
+    die.tag = abbrev.tag;
+    die.has_children = abbrev.has_children;
+    for (const auto& spec : abbrev.specs) {
+        Attribute attr;
+        attr.name = spec.name;
+        read_attribute(p, end, unit, spec.form, spec.implicit_const, attr);
+        m_attrs.push_back(attr);
+    }
+    die.children = p - begin;
+    uint32_t index = m_dies.size();
+    m_dies.push_back(die);
+    m_die_index.emplace(offset, index);
+    return index;
+}
+
+uint32_t DebugInfo::die_at(uint64_t offset) {
+    if (auto it = m_die_index.find(offset); it != m_die_index.end()) {
+        return it->second;
+    }
+    auto unit = unit_containing(offset);
+    const auto* p = m_sections.debug_info.data() + offset;
+    auto index = parse_die(p, unit, NONE);
+    util::throw_assert(index != NONE, "reference to a null DIE");
+    return index;
+}
+
+uint32_t DebugInfo::first_child(uint32_t index) {
+    if (!m_dies[index].has_children) {
+        return NONE;
+    }
+    if (!m_dies[index].children_loaded) {
+        const auto* begin = m_sections.debug_info.data();
+        const auto* p = begin + m_dies[index].children;
+        auto unit = m_dies[index].unit;
+        const auto* end = begin + m_units[unit].end;
+        uint32_t prev = NONE;
+        while (p < end) {
+            auto child = parse_die(p, unit, index);
+            if (child == NONE) break;
+            if (prev == NONE) {
+                m_dies[index].first_child = child;
+            } else {
+                m_dies[prev].next_sibling = child;
+            }
+            prev = child;
+            if (m_dies[child].has_children) {
+                skip_children(p, begin, m_units[unit], attribute(child, DW_AT_sibling));
+            }
+        }
+        m_dies[index].children_loaded = true;
+    }
+    return m_dies[index].first_child;
+}
+
+const DebugInfo::Attribute* DebugInfo::attribute(uint32_t index, uint16_t name) const {
+    const auto& die = m_dies[index];
+    for (uint32_t i = die.attrs; i < die.attrs + die.attr_count; ++i) {
+        if (m_attrs[i].name == name) {
+            return &m_attrs[i];
+        }
+    }
+    return nullptr;
+}
+
+std::optional<std::string_view> DebugInfo::name(uint32_t index) {
+    const auto* attr = attribute(index, DW_AT_name);
+    if (!attr) {
+        return {};
+    }
+    auto unit = m_dies[index].unit;
+    load_unit_bases(unit);
+    return string_value(m_sections, m_units[unit], *attr);
+}
+
+uint64_t DebugInfo::resolve_addrx(uint32_t unit, uint64_t index) {
+    load_unit_bases(unit);
+    uint64_t pos = m_units[unit].addr_base + index * m_units[unit].address_size;
+    util::throw_assert(pos + m_units[unit].address_size <= m_sections.debug_addr.size(), "address index out of range");
+    return read_uint(m_sections.debug_addr.data() + pos, m_units[unit].address_size);
+}
+
+uint32_t DebugInfo::type_of(uint32_t index) {
+    const auto* attr = attribute(index, DW_AT_type);
+    if (!attr || attr->form == DW_FORM_ref_sig8 || attr->form == DW_FORM_GNU_ref_alt) {
+        return NONE;
+    }
+    return die_at(attr->value);
+}
+
+uint32_t DebugInfo::strip_qualifiers(uint32_t type) {
+    for (int depth = 0; type != NONE && depth < MAX_PRINT_DEPTH; ++depth) {
+        auto tag = m_dies[type].tag;
+        if (tag != DW_TAG_typedef && tag != DW_TAG_const_type && tag != DW_TAG_volatile_type &&
+            tag != DW_TAG_restrict_type && tag != DW_TAG_atomic_type) {
+            return type;
+        }
+        type = type_of(type);
+    }
+    return type;
+}
+
+bool DebugInfo::is_signed(uint32_t type) {
+    type = strip_qualifiers(type);
+    if (type == NONE || m_dies[type].tag != DW_TAG_base_type) {
+        return false;
+    }
+    const auto* encoding = attribute(type, DW_AT_encoding);
+    return encoding && (encoding->value == DW_ATE_signed || encoding->value == DW_ATE_signed_char);
+}
+
+std::optional<uint64_t> DebugInfo::type_size(uint32_t type) {
+    for (int depth = 0; type != NONE && depth < MAX_PRINT_DEPTH; ++depth) {
+        if (const auto* size = attribute(type, DW_AT_byte_size)) {
+            return size->value;
+        }
+        switch (m_dies[type].tag) {
+            case DW_TAG_pointer_type:
+            case DW_TAG_reference_type:
+            case DW_TAG_rvalue_reference_type:
+                return sizeof(uint64_t);
+            case DW_TAG_typedef:
+            case DW_TAG_const_type:
+            case DW_TAG_volatile_type:
+            case DW_TAG_restrict_type:
+            case DW_TAG_atomic_type:
+                type = type_of(type);
+                continue;
+            case DW_TAG_array_type: {
+                auto element = type_of(type);
+                auto element_size = type_size(element);
+                if (!element_size) return {};
+                uint64_t count = 1;
+                for (auto sub = first_child(type); sub != NONE; sub = m_dies[sub].next_sibling) {
+                    if (m_dies[sub].tag != DW_TAG_subrange_type) continue;
+                    if (const auto* n = attribute(sub, DW_AT_count)) {
+                        count *= n->value;
+                    } else if (const auto* upper = attribute(sub, DW_AT_upper_bound)) {
+                        count *= upper->value + 1;
+                    } else {
+                        return {};
+                    }
+                }
+                return count * *element_size;
+            }
+            default:
+                return {};
+        }
+    }
+    return {};
+}
+
+std::string DebugInfo::format_value(uint32_t type, std::span<const uint8_t> bytes) {
+    std::string out;
+    char buf[64];
+    type = strip_qualifiers(type);
+    auto size = type == NONE ? bytes.size() : std::min<uint64_t>(type_size(type).value_or(bytes.size()), bytes.size());
+    auto raw = read_uint(bytes.data(), size);
+    switch (type == NONE ? 0 : m_dies[type].tag) {
+        case DW_TAG_base_type: {
+            const auto* encoding = attribute(type, DW_AT_encoding);
+            switch (encoding ? encoding->value : static_cast<uint64_t>(DW_ATE_unsigned)) {
+                case DW_ATE_boolean:
+                    return raw ? "true" : "false";
+                case DW_ATE_float:
+                    if (size == sizeof(float)) {
+                        float f;
+                        memcpy(&f, bytes.data(), sizeof(f));
+                        snprintf(buf, sizeof(buf), "%g", f);
+                    } else if (size == sizeof(double)) {
+                        double d;
+                        memcpy(&d, bytes.data(), sizeof(d));
+                        snprintf(buf, sizeof(buf), "%g", d);
+                    } else if (size == sizeof(long double)) {
+                        long double d;
+                        memcpy(&d, bytes.data(), sizeof(d));
+                        snprintf(buf, sizeof(buf), "%Lg", d);
+                    } else {
+                        return "<unsupported float size>";
+                    }
+                    return buf;
+                case DW_ATE_signed:
+                    snprintf(buf, sizeof(buf), "%ld", sign_extend(raw, size));
+                    return buf;
+                case DW_ATE_signed_char:
+                case DW_ATE_unsigned_char: {
+                    int64_t value = encoding->value == DW_ATE_signed_char ? sign_extend(raw, size) : raw;
+                    if (isprint(static_cast<int>(raw & 0xff))) {
+                        snprintf(buf, sizeof(buf), "%ld '%c'", value, static_cast<char>(raw));
+                    } else {
+                        snprintf(buf, sizeof(buf), "%ld", value);
+                    }
+                    return buf;
+                }
+                default:
+                    snprintf(buf, sizeof(buf), "%lu", raw);
+                    return buf;
+            }
+        }
+        case DW_TAG_pointer_type:
+        case DW_TAG_reference_type:
+        case DW_TAG_rvalue_reference_type:
+            snprintf(buf, sizeof(buf), "%#lx", raw);
+            return buf;
+        case DW_TAG_enumeration_type: {
+            auto value = sign_extend(raw, size);
+            for (auto e = first_child(type); e != NONE; e = m_dies[e].next_sibling) {
+                const auto* constant = attribute(e, DW_AT_const_value);
+                if (m_dies[e].tag == DW_TAG_enumerator && constant &&
+                    sign_extend(constant->value, size) == value) {
+                    if (auto n = name(e)) return std::string(*n);
+                }
+            }
+            snprintf(buf, sizeof(buf), "%ld", value);
+            return buf;
+        }
+        case DW_TAG_structure_type:
+        case DW_TAG_class_type:
+        case DW_TAG_union_type: {
+            out = "{";
+            size_t printed = 0;
+            for (auto m = first_child(type); m != NONE; m = m_dies[m].next_sibling) {
+                if (m_dies[m].tag != DW_TAG_member || attribute(m, DW_AT_bit_size)) continue;
+                const auto* location = attribute(m, DW_AT_data_member_location);
+                uint64_t offset = location && !location->data ? location->value : 0;
+                auto member_type = type_of(m);
+                auto member_size = type_size(member_type).value_or(0);
+                if (offset + member_size > bytes.size()) continue;
+                if (printed++) out += ", ";
+                if (printed > MAX_PRINTED_ELEMENTS) {
+                    out += "...";
+                    break;
+                }
+                out += name(m).value_or("<anon>");
+                out += " = ";
+                out += format_value(member_type, bytes.subspan(offset, member_size));
+            }
+            return out + "}";
+        }
+        case DW_TAG_array_type: {
+            auto element = type_of(type);
+            auto element_size = type_size(element).value_or(0);
+            if (element_size == 0) break;
+            size_t count = bytes.size() / element_size;
+            // Character arrays read better as strings.
+            auto stripped = strip_qualifiers(element);
+            const auto* encoding = stripped == NONE ? nullptr : attribute(stripped, DW_AT_encoding);
+            if (element_size == 1 && encoding &&
+                (encoding->value == DW_ATE_signed_char || encoding->value == DW_ATE_unsigned_char)) {
+                out = "\"";
+                for (size_t i = 0; i < count && bytes[i]; ++i) {
+                    if (isprint(bytes[i])) {
+                        out += static_cast<char>(bytes[i]);
+                    } else {
+                        snprintf(buf, sizeof(buf), "\\%03o", bytes[i]);
+                        out += buf;
+                    }
+                }
+                return out + "\"";
+            }
+            out = "{";
+            for (size_t i = 0; i < count; ++i) {
+                if (i) out += ", ";
+                if (i == MAX_PRINTED_ELEMENTS) {
+                    out += "...";
+                    break;
+                }
+                out += format_value(element, bytes.subspan(i * element_size, element_size));
+            }
+            return out + "}";
+        }
+    }
+    for (size_t i = 0; i < bytes.size(); ++i) {
+        snprintf(buf, sizeof(buf), i ? " %02x" : "%02x", bytes[i]);
+        out += buf;
+    }
+    return out;
+}
+
+std::optional<std::vector<uint64_t>> DebugInfo::lookup_debug_names(std::string_view name) {
+    if (m_sections.debug_names.empty()) {
+        return {};
+    }
+    load_units();
+    std::vector<uint64_t> offsets;
+    const auto* p = m_sections.debug_names.data();
+    const auto* section_end = p + m_sections.debug_names.size();
+    // Linkers that do not merge name indexes leave one per unit, back to back.
+    while (p < section_end) {
+        bool is_dwarf64;
+        auto len = read_length(p, is_dwarf64);
+        const auto* index_end = p + len;
+        util::throw_assert(len <= static_cast<uint64_t>(section_end - p), "name index extends past .debug_names");
+        auto version = read<uint16_t>(p);
+        read<uint16_t>(p);
+        util::throw_assert(version == 5, "unsupported .debug_names version");
+        auto cu_count = read<uint32_t>(p);
+        auto local_tu_count = read<uint32_t>(p);
+        auto foreign_tu_count = read<uint32_t>(p);
+        auto bucket_count = read<uint32_t>(p);
+        auto name_count = read<uint32_t>(p);
+        auto abbrev_size = read<uint32_t>(p);
+        auto augmentation_size = read<uint32_t>(p);
+        p += augmentation_size;
+        size_t offset_size = is_dwarf64 ? 8 : 4;
+        const auto* cu_list = p;
+        p += (cu_count + local_tu_count) * offset_size + foreign_tu_count * sizeof(uint64_t);
+        const auto* buckets = p;
+        p += bucket_count * sizeof(uint32_t);
+        const auto* hashes = p;
+        if (bucket_count) p += name_count * sizeof(uint32_t);
+        const auto* string_offsets = p;
+        p += name_count * offset_size;
+        const auto* entry_offsets = p;
+        p += name_count * offset_size;
+        const auto* abbrevs = p;
+        const auto* entry_pool = abbrevs + abbrev_size;
+
+        auto name_matches = [&](uint32_t i) {
+            return string_at(m_sections.debug_str, read_uint(string_offsets + i * offset_size, offset_size)) == name;
+        };
+        std::vector<uint32_t> matches;
+        if (bucket_count) {
+            for (bool fold : {true, false}) {
+                auto hash = djb_hash(name, fold);
+                auto bucket = hash % bucket_count;
+                for (auto i = read_uint(buckets + bucket * 4, 4); i && i <= name_count; ++i) {
+                    auto h = read_uint(hashes + (i - 1) * 4, 4);
+                    if (h % bucket_count != bucket) break;
+                    if (h == hash && name_matches(i - 1)) matches.push_back(i - 1);
+                }
+                if (!matches.empty()) break;
+            }
+        } else {
+            for (uint32_t i = 0; i < name_count; ++i) {
+                if (name_matches(i)) matches.push_back(i);
+            }
+        }
+
+        for (auto i : matches) {
+            const auto* entry = entry_pool + read_uint(entry_offsets + i * offset_size, offset_size);
+            while (entry < index_end) {
+                auto code = read_uleb128(entry);
+                if (code == 0) break;
+                // Find the entry's abbreviation: code, tag, then (index attribute, form) pairs up to (0, 0).
+                const auto* a = abbrevs;
+                std::vector<std::pair<uint64_t, uint64_t>> specs;
+                bool found = false;
+                while (a < entry_pool && !found) {
+                    auto acode = read_uleb128(a);
+                    if (acode == 0) break;
+                    read_uleb128(a);
+                    specs.clear();
+                    while (true) {
+                        auto idx = read_uleb128(a);
+                        auto form = read_uleb128(a);
+                        if (idx == 0 && form == 0) break;
+                        specs.emplace_back(idx, form);
+                    }
+                    found = acode == code;
+                }
+                util::throw_assert(found, "unknown .debug_names abbreviation");
+                uint64_t cu = 0, die_offset = UINT64_MAX;
+                bool in_type_unit = false;
+                for (auto [idx, form] : specs) {
+                    Unit fake{};
+                    fake.is_dwarf64 = is_dwarf64;
+                    fake.version = 5;
+                    Attribute value;
+                    read_attribute(entry, index_end, fake, form, 0, value);
+                    if (idx == DW_IDX_compile_unit) cu = value.value;
+                    if (idx == DW_IDX_die_offset) die_offset = value.value;
+                    if (idx == DW_IDX_type_unit) in_type_unit = true;
+                }
+                if (!in_type_unit && die_offset != UINT64_MAX && cu < cu_count) {
+                    offsets.push_back(read_uint(cu_list + cu * offset_size, offset_size) + die_offset);
+                }
+            }
+        }
+        p = index_end;
+    }
+    return offsets;
+}
+
+std::optional<std::vector<uint64_t>> DebugInfo::lookup_gdb_index(std::string_view name) {
+    const auto& index = m_sections.gdb_index;
+    if (index.size() < 6 * sizeof(uint32_t)) {
+        return {};
+    }
+    const auto* p = index.data();
+    auto version = read<uint32_t>(p);
+    if (version < 7 || version > 9) {
+        return {};
+    }
+    auto cu_list = read<uint32_t>(p);
+    auto types_list = read<uint32_t>(p);
+    read<uint32_t>(p);
+    auto symbol_table = read<uint32_t>(p);
+    if (version >= 9) read<uint32_t>(p);
+    auto constant_pool = read<uint32_t>(p);
+    auto symbol_table_end = version >= 9 ? read_uint(index.data() + 5 * sizeof(uint32_t), 4) : constant_pool;
+    util::throw_assert(cu_list <= types_list && symbol_table <= symbol_table_end && constant_pool <= index.size(),
+                       "malformed .gdb_index");
+    size_t cu_count = (types_list - cu_list) / (2 * sizeof(uint64_t));
+    size_t slots = (symbol_table_end - symbol_table) / (2 * sizeof(uint32_t));
+
+    std::vector<uint64_t> cus;
+    if (slots && (slots & (slots - 1)) == 0) {
+        auto hash = gdb_index_hash(name, version);
+        auto slot = hash & (slots - 1);
+        auto step = ((hash * 17) & (slots - 1)) | 1;
+        for (size_t probes = 0; probes < slots; ++probes, slot = (slot + step) & (slots - 1)) {
+            const auto* entry = index.data() + symbol_table + slot * 2 * sizeof(uint32_t);
+            auto name_offset = read_uint(entry, 4), vector_offset = read_uint(entry + 4, 4);
+            if (name_offset == 0 && vector_offset == 0) break;
+            if (string_at(index, constant_pool + name_offset) != name) continue;
+            const auto* vec = index.data() + constant_pool + vector_offset;
+            auto count = read<uint32_t>(vec);
+            for (uint32_t i = 0; i < count; ++i) {
+                auto cu = read<uint32_t>(vec) & 0xffffff;
+                if (cu < cu_count) cus.push_back(read_uint(index.data() + cu_list + cu * 2 * sizeof(uint64_t), 8));
+            }
+            break;
+        }
+    }
+    std::sort(cus.begin(), cus.end());
+    cus.erase(std::unique(cus.begin(), cus.end()), cus.end());
+
+    std::vector<uint64_t> offsets;
+    for (auto cu : cus) {
+        for (auto offset : scan_unit(unit_containing(cu), name, DW_TAG_variable)) {
+            offsets.push_back(offset);
+        }
+    }
+    return offsets;
+}
+
+std::vector<uint64_t> DebugInfo::scan_unit(uint32_t unit, std::string_view wanted, uint16_t tag) {
+    std::vector<uint64_t> offsets;
+    std::vector<uint32_t> scopes{die_at(m_units[unit].first_die)};
+    while (!scopes.empty()) {
+        auto scope = scopes.back();
+        scopes.pop_back();
+        for (auto child = first_child(scope); child != NONE; child = m_dies[child].next_sibling) {
+            if (is_unit_child_tag(m_dies[child].tag)) {
+                scopes.push_back(child);
+            } else if (m_dies[child].tag == tag && name(child) == wanted) {
+                offsets.push_back(m_dies[child].offset);
+            }
+        }
+    }
+    return offsets;
+}
+
+uint32_t DebugInfo::find_definition(uint32_t declaration) {
+    auto offset = m_dies[declaration].offset;
+    std::vector<uint32_t> scopes{die_at(m_units[m_dies[declaration].unit].first_die)};
+    while (!scopes.empty()) {
+        auto scope = scopes.back();
+        scopes.pop_back();
+        for (auto child = first_child(scope); child != NONE; child = m_dies[child].next_sibling) {
+            if (is_unit_child_tag(m_dies[child].tag)) {
+                scopes.push_back(child);
+            } else if (const auto* spec = attribute(child, DW_AT_specification); spec && spec->value == offset) {
+                return child;
+            }
+        }
+    }
+    return NONE;
+}
+
+void DebugInfo::build_name_index() {
+    if (m_name_index_built) {
+        return;
+    }
+    m_name_index_built = true;
+    load_units();
+    for (size_t i = 0; i < m_units.size(); ++i) {
+        prepare_unit(i);
+    }
+
+    // Each unit is walked on the pool with throwaway state; only (name, offset) pairs come back.
+    using Names = std::vector<std::pair<std::string_view, uint64_t>>;
+    std::vector<std::future<Names>> tasks;
+    for (const auto& unit : m_units) {
+        tasks.push_back(m_pool.submit([this, unit] {
+            Names names;
+            const auto* begin = m_sections.debug_info.data();
+            const auto* p = begin + unit.first_die;
+            const auto* end = begin + unit.end;
+            Unit local = unit;
+            if (local.version >= 5) local.str_offsets_base = local.is_dwarf64 ? 16 : 8;
+            std::vector<Attribute> attrs;
+            // Depth 0 is the unit DIE itself; names are taken from its children and from namespaces.
+            std::vector<bool> scope_is_namespace;
+            while (p < end) {
+                uint64_t offset = p - begin;
+                auto code = read_uleb128(p, end);
+                if (code == 0) {
+                    if (scope_is_namespace.empty()) break;
+                    scope_is_namespace.pop_back();
+                    continue;
+                }
+                util::throw_assert(code < local.abbrevs->size(), "bad abbreviation code");
+                const auto& abbrev = (*local.abbrevs)[code];
+                attrs.resize(abbrev.specs.size());
+                const Attribute* name_attr = nullptr;
+                const Attribute* sibling = nullptr;
+                for (size_t i = 0; i < abbrev.specs.size(); ++i) {
+                    attrs[i].name = abbrev.specs[i].name;
+                    read_attribute(p, end, local, abbrev.specs[i].form, abbrev.specs[i].implicit_const, attrs[i]);
+                    if (attrs[i].name == DW_AT_name) name_attr = &attrs[i];
+                    if (attrs[i].name == DW_AT_sibling) sibling = &attrs[i];
+                    if (attrs[i].name == DW_AT_str_offsets_base) local.str_offsets_base = attrs[i].value;
+                }
+                if (offset == unit.first_die) {
+                    if (abbrev.has_children) scope_is_namespace.push_back(true);
+                    continue;
+                }
+                bool in_scope = !scope_is_namespace.empty() && scope_is_namespace.back();
+                if (in_scope && name_attr &&
+                    (abbrev.tag == DW_TAG_variable || abbrev.tag == DW_TAG_subprogram)) {
+                    if (auto n = string_value(m_sections, local, *name_attr)) names.emplace_back(*n, offset);
+                }
+                if (!abbrev.has_children) continue;
+                if (in_scope && is_unit_child_tag(abbrev.tag)) {
+                    scope_is_namespace.push_back(true);
+                } else {
+                    skip_children(p, begin, local, sibling);
+                }
+            }
+            return names;
+        }));
+    }
+    for (auto& task : tasks) {
+        for (auto [n, offset] : task.get()) {
+            m_name_index[n].push_back(offset);
+        }
+    }
+}
+
+std::vector<uint64_t> DebugInfo::lookup_name(std::string_view name) {
+    if (auto offsets = lookup_debug_names(name)) {
+        return *offsets;
+    }
+    if (auto offsets = lookup_gdb_index(name)) {
+        return *offsets;
+    }
+    build_name_index();
+    auto it = m_name_index.find(name);
+    return it == m_name_index.end() ? std::vector<uint64_t>{} : it->second;
+}
+
+std::optional<GlobalVariable> DebugInfo::resolve_global(uint32_t die) {
+    if (m_dies[die].tag != DW_TAG_variable || attribute(die, DW_AT_declaration)) {
+        return {};
+    }
+    const auto* location = attribute(die, DW_AT_location);
+    if (!location || !location->data || location->value == 0) {
+        return {};
+    }
+    std::span<const uint8_t> expr{location->data, location->value};
+    std::optional<uint64_t> addr;
+    const auto* p = expr.data();
+    auto op = *p++;
+    if (op == DW_OP_addrx || op == DW_OP_GNU_addr_index) {
+        auto index = read_uleb128(p, expr.data() + expr.size());
+        if (p == expr.data() + expr.size()) addr = resolve_addrx(m_dies[die].unit, index);
+    } else {
+        // Statically located variables need neither registers nor memory; anything else is out of reach here.
+        DWARF::ExpressionContext ctx{[](uint16_t) -> std::optional<uint64_t> { return {}; },
+                                     [](uint64_t, size_t) -> std::optional<uint64_t> { return {}; }};
+        try {
+            addr = m_expressions.get(expr).evaluate(ctx);
+        } catch (const std::exception&) {
+            return {};
+        }
+    }
+    if (!addr) {
+        return {};
+    }
+    auto type = type_of(die);
+    if (type == NONE) {
+        if (const auto* spec = attribute(die, DW_AT_specification)) type = type_of(die_at(spec->value));
+    }
+    return GlobalVariable{*addr, type, type_size(type).value_or(0)};
+}
+
+std::optional<GlobalVariable> DebugInfo::find_global(std::string_view name) {
+    for (auto offset : lookup_name(name)) {
+        auto die = die_at(offset);
+        if (auto var = resolve_global(die)) {
+            return var;
+        }
+        // Only the declaration is named when a definition follows an `extern`; gcc gives the definition just a
+        // DW_AT_specification and the location.
+        if (m_dies[die].tag == DW_TAG_variable && attribute(die, DW_AT_declaration)) {
+            if (auto definition = find_definition(die); definition != NONE) {
+                if (auto var = resolve_global(definition)) {
+                    return var;
+                }
+            }
+        }
+    }
+    return {};
+}
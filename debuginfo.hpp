@@ -0,0 +1,166 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "dwarf.hpp"
+#include "threadpool.hpp"
+
+// The raw sections the DIE reader works from. Any of them may be empty.
+struct DebugSections {
+    std::span<const uint8_t> debug_info;
+    std::span<const uint8_t> debug_abbrev;
+    std::span<const uint8_t> debug_str;
+    std::span<const uint8_t> debug_line_str;
+    std::span<const uint8_t> debug_str_offsets;
+    std::span<const uint8_t> debug_addr;
+    std::span<const uint8_t> debug_names;
+    std::span<const uint8_t> gdb_index;
+};
+
+// A global variable found through the debug info. `addr` is relative to the module's base.
+struct GlobalVariable {
+    uint64_t addr;
+    uint32_t type;
+    uint64_t size;
+};
+
+// Lazy reader for .debug_info. Names are resolved to a unit through .debug_names, .gdb_index or, without either, an
+// index built once over every unit's top-level DIEs. Only that unit's abbreviations and the DIEs actually visited are
+// parsed; they live in an arena and refer to each other by 32-bit index.
+class DebugInfo {
+   public:
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    struct Attribute {
+        uint16_t name;
+        uint16_t form;
+        // Constants, addresses, references (section offsets) and string/block lengths.
+        uint64_t value;
+        // Strings and blocks.
+        const uint8_t* data;
+    };
+
+    struct Die {
+        uint64_t offset;
+        // Where the children start, right after the attributes.
+        uint64_t children;
+        uint32_t unit;
+        uint32_t parent;
+        // The children are only parsed on demand; until then first_child is NONE even if has_children is set.
+        uint32_t first_child;
+        uint32_t next_sibling;
+        uint32_t attrs;
+        uint16_t attr_count;
+        uint16_t tag;
+        bool has_children;
+        bool children_loaded;
+    };
+
+    DebugInfo(const DebugSections& sections, ThreadPool& pool);
+
+    // Finds a global variable definition by name, with its location resolved.
+    std::optional<GlobalVariable> find_global(std::string_view name);
+
+    // Returns the DIE at a .debug_info offset, parsing it if needed.
+    uint32_t die_at(uint64_t offset);
+    const Die& die(uint32_t index) const { return m_dies[index]; }
+    // Parses the children of `index` if needed, and returns the first one (or NONE).
+    uint32_t first_child(uint32_t index);
+    const Attribute* attribute(uint32_t index, uint16_t name) const;
+    std::optional<std::string_view> name(uint32_t index);
+    // Follows DW_AT_type to the referenced DIE, or NONE for void.
+    uint32_t type_of(uint32_t index);
+    // Looks through typedefs and cv-qualifiers, which do not change a value's representation.
+    uint32_t strip_qualifiers(uint32_t type);
+    // Size in bytes of a type DIE, looking through qualifiers and typedefs.
+    std::optional<uint64_t> type_size(uint32_t type);
+    // Whether a base type is a signed integer, looking through qualifiers and typedefs.
+    bool is_signed(uint32_t type);
+    // Formats `bytes`, an object of type `type`, the way a C debugger would.
+    std::string format_value(uint32_t type, std::span<const uint8_t> bytes);
+
+   private:
+    struct AttributeSpec {
+        uint16_t name;
+        uint16_t form;
+        int64_t implicit_const;
+    };
+    struct Abbrev {
+        uint16_t tag = 0;
+        bool has_children = false;
+        std::vector<AttributeSpec> specs;
+    };
+    using AbbrevTable = std::vector<Abbrev>;
+
+    struct Unit {
+        uint64_t offset;
+        uint64_t end;
+        uint64_t first_die;
+        uint64_t abbrev_offset;
+        uint8_t version;
+        uint8_t address_size;
+        bool is_dwarf64;
+        // Resolved lazily from the unit DIE, for the strx and addrx forms.
+        bool bases_loaded = false;
+        uint64_t str_offsets_base = 0;
+        uint64_t addr_base = 0;
+        const AbbrevTable* abbrevs = nullptr;
+    };
+
+    static AbbrevTable parse_abbrevs(std::span<const uint8_t> section, uint64_t offset);
+    // Reads one attribute value, throwing if it extends past `end`. References are made absolute; strx/addrx forms
+    // keep their index.
+    static void read_attribute(const uint8_t*& p, const uint8_t* end, const Unit& unit, uint16_t form,
+                               int64_t implicit_const, Attribute& attr);
+    // Skips the descendants of a DIE whose attributes have just been read, using DW_AT_sibling if it has one.
+    static void skip_children(const uint8_t*& p, const uint8_t* begin, const Unit& unit, const Attribute* sibling);
+    static std::string_view string_at(std::span<const uint8_t> section, uint64_t offset);
+    // Resolves a string-class attribute; strx forms need the unit's bases loaded.
+    static std::optional<std::string_view> string_value(const DebugSections& sections, const Unit& unit,
+                                                        const Attribute& attr);
+
+    void load_units();
+    uint32_t unit_containing(uint64_t offset);
+    // Makes sure the unit's abbreviation table is parsed.
+    const Unit& prepare_unit(uint32_t unit);
+    void load_unit_bases(uint32_t unit);
+    // Parses the DIE at `p` into the arena, or returns NONE for a null entry. `p` is left after its attributes.
+    uint32_t parse_die(const uint8_t*& p, uint32_t unit, uint32_t parent);
+    uint64_t resolve_addrx(uint32_t unit, uint64_t index);
+
+    // Candidate DIE offsets for `name`, from whichever index the file has.
+    std::vector<uint64_t> lookup_name(std::string_view name);
+    std::optional<std::vector<uint64_t>> lookup_debug_names(std::string_view name);
+    std::optional<std::vector<uint64_t>> lookup_gdb_index(std::string_view name);
+    void build_name_index();
+    // Searches the top-level DIEs of `unit` for one called `name` with tag `tag`.
+    std::vector<uint64_t> scan_unit(uint32_t unit, std::string_view name, uint16_t tag);
+    // Searches the unit of a declaration for the top-level DIE that completes it through DW_AT_specification, or
+    // returns NONE.
+    uint32_t find_definition(uint32_t declaration);
+    std::optional<GlobalVariable> resolve_global(uint32_t die);
+
+    DebugSections m_sections;
+    ThreadPool& m_pool;
+    std::vector<Unit> m_units;
+    bool m_units_loaded = false;
+    std::unordered_map<uint64_t, std::unique_ptr<const AbbrevTable>> m_abbrevs;
+
+    std::vector<Die> m_dies;
+    std::vector<Attribute> m_attrs;
+    std::unordered_map<uint64_t, uint32_t> m_die_index;
+    DWARF::ExpressionCache m_expressions;
+
+    // Our own index over top-level names, used when the file has no accelerator table.
+    bool m_name_index_built = false;
+    std::unordered_map<std::string_view, std::vector<uint64_t>> m_name_index;
+};
@@ -0,0 +1,125 @@
+#include "debugregs.hpp"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/ptrace.h>
+#include <sys/user.h>
+
+#include <optional>
+
+#include "util.hpp"
+
+namespace {
+constexpr int DR6 = 6;
+constexpr int DR7 = 7;
+// DR6 bits B0-B3: the condition of the corresponding slot was met.
+constexpr uint64_t DR6_HITS = 0xf;
+
+void* debugreg_offset(int reg) {
+    return reinterpret_cast<void*>(offsetof(struct user, u_debugreg) + reg * sizeof(unsigned long));
+}
+
+uint64_t peek(pid_t pid, int reg) {
+    errno = 0;
+    uint64_t value = ptrace(PTRACE_PEEKUSER, pid, debugreg_offset(reg), nullptr);
+    util::throw_errno();
+    return value;
+}
+
+void poke(pid_t pid, int reg, uint64_t value) {
+    util::throw_errno(ptrace(PTRACE_POKEUSER, pid, debugreg_offset(reg), value));
+}
+
+// The R/W and LEN fields of a slot in DR7.
+uint64_t control_bits(const Watchpoint& wp) {
+    uint64_t rw = wp.kind == WatchKind::EXECUTE ? 0b00 : wp.kind == WatchKind::WRITE ? 0b01 : 0b11;
+    uint64_t len = wp.len == 1 ? 0b00 : wp.len == 2 ? 0b01 : wp.len == 4 ? 0b11 : 0b10;
+    return rw | len << 2;
+}
+}  // namespace
+
+bool DebugRegisters::valid(const Watchpoint& wp) {
+    if (wp.kind == WatchKind::EXECUTE) {
+        return wp.len == 1;
+    }
+    return (wp.len == 1 || wp.len == 2 || wp.len == 4 || wp.len == 8) && wp.addr % wp.len == 0;
+}
+
+std::optional<size_t> DebugRegisters::add(const Watchpoint& wp) {
+    util::throw_assert(valid(wp), "unsupported watchpoint");
+    for (size_t i = 0; i < NUM_SLOTS; ++i) {
+        if (!m_slots[i]) {
+            m_slots[i] = wp;
+            return i;
+        }
+    }
+    return {};
+}
+
+bool DebugRegisters::remove(size_t slot) {
+    if (slot >= NUM_SLOTS || !m_slots[slot]) {
+        return false;
+    }
+    m_slots[slot].reset();
+    return true;
+}
+
+void DebugRegisters::rebase(uint64_t delta) {
+    for (auto& wp : m_slots) {
+        if (wp) {
+            wp->addr += delta;
+        }
+    }
+}
+
+unsigned DebugRegisters::in_use() const {
+    unsigned mask = 0;
+    for (size_t i = 0; i < NUM_SLOTS; ++i) {
+        mask |= m_slots[i] ? 1u << i : 0;
+    }
+    return mask;
+}
+
+uint64_t DebugRegisters::dr7() const {
+    uint64_t value = 0;
+    for (size_t i = 0; i < NUM_SLOTS; ++i) {
+        if (m_slots[i]) {
+            // Local enable bit, then the 4-bit R/W and LEN field from bit 16.
+            value |= 1ull << (2 * i) | control_bits(*m_slots[i]) << (16 + 4 * i);
+        }
+    }
+    return value;
+}
+
+void DebugRegisters::write(pid_t pid, size_t slot) {
+    // The kernel checks each enabled slot against its address when DR7 is written, so a slot is disabled before its
+    // address changes and only enabled once the address is in place.
+    uint64_t enabled = dr7();
+    poke(pid, DR7, enabled & ~(0b11ull << (2 * slot)));
+    if (m_slots[slot]) {
+        poke(pid, slot, m_slots[slot]->addr);
+        poke(pid, DR7, enabled);
+    }
+}
+
+void DebugRegisters::write_all(pid_t pid) {
+    if (empty()) {
+        return;
+    }
+    for (size_t i = 0; i < NUM_SLOTS; ++i) {
+        if (m_slots[i]) {
+            poke(pid, i, m_slots[i]->addr);
+        }
+    }
+    poke(pid, DR7, dr7());
+}
+
+unsigned DebugRegisters::triggered(pid_t pid) {
+    uint64_t dr6 = peek(pid, DR6);
+    // The status bits are sticky, so clear them for the next stop.
+    if (dr6 & DR6_HITS) {
+        poke(pid, DR6, 0);
+    }
+    return dr6 & in_use();
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <array>
+#include <optional>
+
+// What a debug register traps on. EXECUTE stops before the instruction at the address runs; the others stop right
+// after the access.
+enum class WatchKind { EXECUTE, WRITE, READ_WRITE };
+
+// A hardware breakpoint (EXECUTE, one byte) or watchpoint over `len` bytes at `addr`.
+struct Watchpoint {
+    uint64_t addr;
+    size_t len;
+    WatchKind kind;
+};
+
+// The x86 debug registers of a tracee: DR0-DR3 hold the addresses, DR7 enables them and sets their kind and length,
+// and DR6 reports which one fired. They are accessed with PTRACE_PEEKUSER/POKEUSER. The slots outlive the process, so
+// write_all() puts them into each new one.
+class DebugRegisters {
+   public:
+    static constexpr size_t NUM_SLOTS = 4;
+
+    // Whether the CPU can watch `wp`: execute breakpoints cover one byte, watchpoints 1, 2, 4 or 8 bytes aligned to
+    // their length.
+    static bool valid(const Watchpoint& wp);
+
+    // Claims a free slot for `wp`, returning it, or nothing if all are in use. write() makes it take effect.
+    std::optional<size_t> add(const Watchpoint& wp);
+    // Frees a slot. Returns false if it was not in use.
+    bool remove(size_t slot);
+    const std::optional<Watchpoint>& slot(size_t slot) const { return m_slots.at(slot); }
+    bool empty() const { return in_use() == 0; }
+    // Moves every slot by `delta`, for addresses given relative to a PIE before it was loaded.
+    void rebase(uint64_t delta);
+
+    // Writes one slot's address and DR7 into the tracee.
+    void write(pid_t pid, size_t slot);
+    // Writes every slot into a newly started tracee.
+    void write_all(pid_t pid);
+    // Reads and clears DR6 after a SIGTRAP. Returns the mask of in-use slots whose condition was met.
+    unsigned triggered(pid_t pid);
+
+   private:
+    // Mask of the slots in use.
+    unsigned in_use() const;
+    uint64_t dr7() const;
+
+    std::array<std::optional<Watchpoint>, NUM_SLOTS> m_slots;
+};
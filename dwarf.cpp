@@ -4,142 +4,626 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <array>
+#include <optional>
+#include <span>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "dwarf2.h"
 #include "util.hpp"
 
 namespace {
-int64_t read_leb128(const uint8_t*& p) {
+using DWARF::read;
+using DWARF::read_leb128;
+using DWARF::read_length;
+using DWARF::read_uleb128;
+
+const DWARF::CIE& parse_cie(uint64_t offset, const DWARF::PointerBases& bases,
+                            std::unordered_map<uint64_t, DWARF::CIE>& cie_map) {
+    if (auto it = cie_map.find(offset); it != cie_map.end()) {
+        return it->second;
+    }
+    const auto* p = bases.section_start + offset;
+    bool is_dwarf64;
+    auto len = read_length(p, is_dwarf64);
+    const auto* end = p + len;
+    uint64_t id = is_dwarf64 ? read<uint64_t>(p) : read<uint32_t>(p);
+    util::throw_assert(len != 0 && id == 0, "FDE does not point at a CIE");
+
+    DWARF::CIE cie{};
+    cie.end = end;
+    cie.encoding = DW_EH_PE_absptr;
+    cie.lsda_encoding = DW_EH_PE_omit;
+    auto version = *p++;
+    util::throw_assert(version == 1 || version == 3 || version == 4, "unsupported CIE version");
+    const auto* augmentation = reinterpret_cast<const char*>(p);
+    p += strlen(augmentation) + 1;
+    if (version == 4) {
+        auto address_size = *p++;
+        auto segment_size = *p++;
+        util::throw_assert(address_size == 8 && segment_size == 0, "unsupported CIE address size");
+    }
+    cie.code_alignment_factor = read_uleb128(p);
+    cie.data_alignment_factor = read_leb128(p);
+    cie.return_address_register = version == 1 ? *p++ : read_uleb128(p);
+    util::throw_assert(cie.return_address_register < DWARF::NUM_CFI_REGISTERS, "unsupported return address column");
+
+    // With a 'z' augmentation the data length is known, so unknown augmentations can be skipped.
+    const uint8_t* augmentation_end = nullptr;
+    cie.has_z_augmentation = *augmentation == 'z';
+    if (cie.has_z_augmentation) {
+        auto n = read_uleb128(p);
+        augmentation_end = p + n;
+        ++augmentation;
+    }
+    for (; *augmentation != 0; ++augmentation) {
+        if (*augmentation == 'L') {
+            cie.lsda_encoding = *p++;
+        } else if (*augmentation == 'R') {
+            cie.encoding = *p++;
+        } else if (*augmentation == 'P') {
+            // The personality routine is only needed for exception handling, not unwinding.
+            auto encoding = *p++;
+            DWARF::read_encoded_value(p, bases, encoding & ~DW_EH_PE_indirect);
+        } else if (*augmentation == 'S') {
+            cie.is_signal_frame = true;
+        } else if (*augmentation == 'B') {
+            continue;
+        } else {
+            util::throw_assert(augmentation_end, "unsupported CIE augmentation");
+            break;
+        }
+    }
+    cie.initial_insns = augmentation_end ? augmentation_end : p;
+    return cie_map.emplace(offset, cie).first->second;
+}
+
+// Runs call frame instructions on `row`, advancing `loc` until it passes `pc`. `initial` is the row produced by the
+// CIE, which DW_CFA_restore falls back to; it is null while running the CIE itself.
+void run_cfi(const uint8_t* p, const uint8_t* end, const DWARF::CIE& cie, const DWARF::PointerBases& bases,
+             uint64_t pc, uint64_t& loc, DWARF::UnwindRow& row, const DWARF::UnwindRow* initial) {
+    using DWARF::RegisterRule;
+    std::vector<DWARF::UnwindRow> saved;
+    auto daf = cie.data_alignment_factor;
+    auto set_rule = [&](uint64_t reg, RegisterRule rule) {
+        // Rules for registers we do not track (vector registers and the like) are parsed but dropped.
+        if (reg < DWARF::NUM_CFI_REGISTERS) row.regs[reg] = rule;
+    };
+    auto restore = [&](uint64_t reg) {
+        if (reg < DWARF::NUM_CFI_REGISTERS) row.regs[reg] = initial ? initial->regs[reg] : RegisterRule{};
+    };
+    auto advance = [&](uint64_t delta) {
+        loc += delta * cie.code_alignment_factor;
+        return loc <= pc;
+    };
+    auto read_block = [&]() {
+        auto n = read_uleb128(p);
+        std::span<const uint8_t> block{p, n};
+        p += n;
+        return block;
+    };
+
+    while (p < end) {
+        auto op = *p++;
+        switch (op & 0xc0) {
+            case DW_CFA_advance_loc:
+                if (!advance(op & 0x3f)) return;
+                continue;
+            case DW_CFA_offset:
+                set_rule(op & 0x3f,
+                         {.kind = RegisterRule::OFFSET, .value = static_cast<int64_t>(read_uleb128(p)) * daf});
+                continue;
+            case DW_CFA_restore:
+                restore(op & 0x3f);
+                continue;
+        }
+        switch (op) {
+            case DW_CFA_nop:
+                break;
+            case DW_CFA_set_loc:
+                loc = DWARF::read_encoded_value(p, bases, cie.encoding);
+                if (loc > pc) return;
+                break;
+            case DW_CFA_advance_loc1:
+                if (!advance(read<uint8_t>(p))) return;
+                break;
+            case DW_CFA_advance_loc2:
+                if (!advance(read<uint16_t>(p))) return;
+                break;
+            case DW_CFA_advance_loc4:
+                if (!advance(read<uint32_t>(p))) return;
+                break;
+            case DW_CFA_offset_extended: {
+                auto reg = read_uleb128(p);
+                set_rule(reg, {.kind = RegisterRule::OFFSET, .value = static_cast<int64_t>(read_uleb128(p)) * daf});
+                break;
+            }
+            case DW_CFA_offset_extended_sf: {
+                auto reg = read_uleb128(p);
+                set_rule(reg, {.kind = RegisterRule::OFFSET, .value = read_leb128(p) * daf});
+                break;
+            }
+            case DW_CFA_GNU_negative_offset_extended: {
+                auto reg = read_uleb128(p);
+                set_rule(reg, {.kind = RegisterRule::OFFSET, .value = -static_cast<int64_t>(read_uleb128(p)) * daf});
+                break;
+            }
+            case DW_CFA_val_offset: {
+                auto reg = read_uleb128(p);
+                set_rule(reg, {.kind = RegisterRule::VAL_OFFSET, .value = static_cast<int64_t>(read_uleb128(p)) * daf});
+                break;
+            }
+            case DW_CFA_val_offset_sf: {
+                auto reg = read_uleb128(p);
+                set_rule(reg, {.kind = RegisterRule::VAL_OFFSET, .value = read_leb128(p) * daf});
+                break;
+            }
+            case DW_CFA_restore_extended:
+                restore(read_uleb128(p));
+                break;
+            case DW_CFA_undefined:
+                set_rule(read_uleb128(p), {.kind = RegisterRule::UNDEFINED});
+                break;
+            case DW_CFA_same_value:
+                set_rule(read_uleb128(p), {.kind = RegisterRule::SAME_VALUE});
+                break;
+            case DW_CFA_register: {
+                auto reg = read_uleb128(p);
+                set_rule(reg, {.kind = RegisterRule::REGISTER, .value = static_cast<int64_t>(read_uleb128(p))});
+                break;
+            }
+            case DW_CFA_expression: {
+                auto reg = read_uleb128(p);
+                set_rule(reg, {.kind = RegisterRule::EXPRESSION, .expr = read_block()});
+                break;
+            }
+            case DW_CFA_val_expression: {
+                auto reg = read_uleb128(p);
+                set_rule(reg, {.kind = RegisterRule::VAL_EXPRESSION, .expr = read_block()});
+                break;
+            }
+            case DW_CFA_remember_state:
+                saved.push_back(row);
+                break;
+            case DW_CFA_restore_state:
+                util::throw_assert(!saved.empty(), "DW_CFA_restore_state without saved state");
+                row = saved.back();
+                saved.pop_back();
+                break;
+            case DW_CFA_def_cfa: {
+                auto reg = read_uleb128(p);
+                row.cfa = {.reg = static_cast<uint16_t>(reg), .offset = static_cast<int64_t>(read_uleb128(p))};
+                break;
+            }
+            case DW_CFA_def_cfa_sf: {
+                auto reg = read_uleb128(p);
+                row.cfa = {.reg = static_cast<uint16_t>(reg), .offset = read_leb128(p) * daf};
+                break;
+            }
+            case DW_CFA_def_cfa_register:
+                row.cfa.is_expression = false;
+                row.cfa.reg = read_uleb128(p);
+                break;
+            case DW_CFA_def_cfa_offset:
+                row.cfa.offset = read_uleb128(p);
+                break;
+            case DW_CFA_def_cfa_offset_sf:
+                row.cfa.offset = read_leb128(p) * daf;
+                break;
+            case DW_CFA_def_cfa_expression:
+                row.cfa.is_expression = true;
+                row.cfa.expr = read_block();
+                break;
+            case DW_CFA_GNU_args_size:
+                read_uleb128(p);
+                break;
+            default:
+                util::throw_assert(false, "unsupported call frame instruction");
+        }
+    }
+}
+}  // namespace
+
+namespace DWARF {
+uint64_t read_uleb128_slow(const uint8_t*& p, const uint8_t* end) {
     uint64_t result = 0;
     size_t shift = 0;
     uint8_t byte;
     do {
+        util::throw_assert(p < end, "truncated LEB128");
         byte = *p++;
-        result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (shift < 64) result |= static_cast<uint64_t>(byte & 0x7f) << shift;
         shift += 7;
     } while (byte & 0x80);
-    if ((shift < sizeof(result) * 8) && (byte & 0x40)) result |= -(1UL << shift);
     return result;
 }
 
-uint64_t read_uleb128(const uint8_t*& p) {
+int64_t read_leb128_slow(const uint8_t*& p, const uint8_t* end) {
     uint64_t result = 0;
     size_t shift = 0;
     uint8_t byte;
     do {
+        util::throw_assert(p < end, "truncated LEB128");
         byte = *p++;
-        result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (shift < 64) result |= static_cast<uint64_t>(byte & 0x7f) << shift;
         shift += 7;
     } while (byte & 0x80);
+    if (shift < 64 && (byte & 0x40)) result |= -(1ull << shift);
     return result;
 }
 
-template <typename T>
-T read(const uint8_t*& p) {
-    T result;
-    memcpy(&result, p, sizeof(T));
-    p += sizeof(T);
-    return result;
-}
-
-uint64_t read_length(const uint8_t*& p, bool& is_dwarf64) {
-    uint64_t len = read<uint32_t>(p);
-    if (len == 0xffffffff) {
-        len = read<uint64_t>(p);
-        is_dwarf64 = true;
-    } else {
-        is_dwarf64 = false;
-    }
-    return len;
-}
-
-uint64_t read_encoded_value(const uint8_t*& p, const uint8_t* section_start, uint64_t section_vaddr, uint8_t encoding) {
+uint64_t read_encoded_value(const uint8_t*& p, const PointerBases& bases, uint8_t encoding) {
+    util::throw_assert(encoding != DW_EH_PE_omit, "cannot read an omitted pointer");
     uint64_t base;
     switch (encoding & 0x70) {
         case DW_EH_PE_absptr:
             base = 0;
             break;
         case DW_EH_PE_pcrel:
-            base = section_vaddr + (p - section_start);
+            base = bases.section_vaddr + (p - bases.section_start);
+            break;
+        case DW_EH_PE_textrel:
+            base = bases.text;
+            break;
+        case DW_EH_PE_datarel:
+            base = bases.data;
+            break;
+        case DW_EH_PE_funcrel:
+            base = bases.func;
+            break;
+        case DW_EH_PE_aligned:
+            // An absolute pointer, padded to pointer alignment in the loaded image.
+            p += -(bases.section_vaddr + (p - bases.section_start)) & (sizeof(uint64_t) - 1);
+            base = 0;
             break;
         default:
-            util::throw_assert(false, "unsupported encoding");
+            util::throw_assert(false, "unsupported pointer encoding");
+            __builtin_unreachable();
     }
-    util::throw_assert((encoding & 0x7) != 0);
     switch (encoding & 0xf) {
+        case DW_EH_PE_absptr:
+        case DW_EH_PE_udata8:
+        case DW_EH_PE_signed:
+        case DW_EH_PE_sdata8:
+            return base + read<uint64_t>(p);
+        case DW_EH_PE_uleb128:
+            return base + read_uleb128(p);
+        case DW_EH_PE_udata2:
+            return base + read<uint16_t>(p);
         case DW_EH_PE_udata4:
             return base + read<uint32_t>(p);
+        case DW_EH_PE_sleb128:
+            return base + read_leb128(p);
+        case DW_EH_PE_sdata2:
+            return base + read<int16_t>(p);
         case DW_EH_PE_sdata4:
             return base + read<int32_t>(p);
         default:
-            util::throw_assert(false, "unsupported encoding");
+            util::throw_assert(false, "unsupported pointer encoding");
             __builtin_unreachable();
     }
 }
-}  // namespace
 
-namespace DWARF {
-void parse_eh_frame_entry(const uint8_t*& p, const uint8_t* section_start, uint64_t section_vaddr,
-                          std::unordered_map<uint64_t, CIE>& cie_map, bool only_cie) {
+std::optional<FDE> parse_eh_frame_entry(const uint8_t*& p, const PointerBases& bases,
+                                        std::unordered_map<uint64_t, CIE>& cie_map) {
     const auto* start = p;
     bool is_dwarf64;
     auto len = read_length(p, is_dwarf64);
-    if (len == 0) return;
+    if (len == 0) return {};
     const auto* end = p + len;
+    const auto* id_field = p;
     uint64_t cie_ptr = is_dwarf64 ? read<uint64_t>(p) : read<uint32_t>(p);
     if (cie_ptr == 0) {
-        auto cie_offset = start - section_start;
-        if (cie_map.contains(cie_offset)) {
-            p = end;
+        parse_cie(start - bases.section_start, bases, cie_map);
+        p = end;
+        return {};
+    }
+
+    // In .eh_frame the CIE pointer is relative to its own field.
+    FDE fde;
+    fde.cie = &parse_cie(id_field - bases.section_start - cie_ptr, bases, cie_map);
+    fde.initial_location = read_encoded_value(p, bases, fde.cie->encoding);
+    fde.address_range = read_encoded_value(p, bases, fde.cie->encoding & 0xf);
+    if (fde.cie->has_z_augmentation) {
+        auto n = read_uleb128(p);
+        p += n;
+    }
+    fde.insns = p;
+    fde.end = end;
+    p = end;
+    return fde;
+}
+
+UnwindRow execute_cfi(const FDE& fde, uint64_t pc, const PointerBases& bases) {
+    const auto& cie = *fde.cie;
+    UnwindRow initial;
+    uint64_t loc = 0;
+    run_cfi(cie.initial_insns, cie.end, cie, bases, UINT64_MAX, loc, initial, nullptr);
+    UnwindRow row = initial;
+    loc = fde.initial_location;
+    run_cfi(fde.insns, fde.end, cie, bases, pc, loc, row, &initial);
+    return row;
+}
+
+uint64_t CompiledExpression::apply(Op op, uint64_t a, uint64_t b) {
+    auto sa = static_cast<int64_t>(a), sb = static_cast<int64_t>(b);
+    switch (op) {
+        case AND: return a & b;
+        case DIV:
+            util::throw_assert(sb != 0, "DWARF expression divides by zero");
+            return sa / sb;
+        case MINUS: return a - b;
+        case MOD:
+            util::throw_assert(b != 0, "DWARF expression divides by zero");
+            return a % b;
+        case MUL: return a * b;
+        case OR: return a | b;
+        case PLUS: return a + b;
+        case SHL: return b < 64 ? a << b : 0;
+        case SHR: return b < 64 ? a >> b : 0;
+        case SHRA: return sa >> (b < 64 ? b : 63);
+        case XOR: return a ^ b;
+        case EQ: return sa == sb;
+        case GE: return sa >= sb;
+        case GT: return sa > sb;
+        case LE: return sa <= sb;
+        case LT: return sa < sb;
+        default: return sa != sb;
+    }
+}
+
+void CompiledExpression::emit(Insn insn, size_t barrier) {
+    auto foldable = [&](size_t back, Op op) {
+        return m_code.size() >= barrier + back && m_code[m_code.size() - back].op == op;
+    };
+    // x + c and x - c become a single PLUS_CONST, which then merges into a preceding constant or register read.
+    if ((insn.op == PLUS || insn.op == MINUS) && foldable(1, CONST) && !foldable(2, CONST)) {
+        auto c = m_code.back().operand;
+        m_code.pop_back();
+        insn = {PLUS_CONST, 0, 0, 0, insn.op == PLUS ? c : -c};
+    }
+    if (insn.op == PLUS_CONST) {
+        if (foldable(1, CONST) || foldable(1, REG) || foldable(1, PLUS_CONST)) {
+            m_code.back().operand += insn.operand;
             return;
         }
-        CIE cie{};
-        auto version = *p++;
-        util::throw_assert(version == 1, "unsupported CIE version");
-        const auto* augmentation = reinterpret_cast<const char*>(p);
-        p += strlen(augmentation) + 1;
-        cie.code_alignment_factor = read_uleb128(p);
-        cie.data_alignment_factor = read_leb128(p);
-        cie.return_address_register = *p++;
-        cie.has_z_augmentation = *augmentation == 'z';
-        if (cie.has_z_augmentation) {
-            auto n = read_uleb128(p);
-            cie.initial_insns = p + n;
-            ++augmentation;
+        if (insn.operand == 0) return;
+    } else if ((insn.op == ABS || insn.op == NEG || insn.op == NOT) && foldable(1, CONST)) {
+        auto& c = m_code.back().operand;
+        auto sc = static_cast<int64_t>(c);
+        c = insn.op == ABS ? (sc < 0 ? -c : c) : insn.op == NEG ? -c : ~c;
+        return;
+    } else if (is_binary(insn.op) && foldable(1, CONST) && foldable(2, CONST)) {
+        auto b = m_code[m_code.size() - 1].operand, a = m_code[m_code.size() - 2].operand;
+        // Division by zero is left to fail if and when it is reached.
+        if (!((insn.op == DIV || insn.op == MOD) && b == 0)) {
+            m_code.pop_back();
+            m_code.back().operand = apply(insn.op, a, b);
+            return;
         }
-        for (; *augmentation != 0; ++augmentation) {
-            if (*augmentation == 'L')
-                ++p;
-            else if (*augmentation == 'R')
-                cie.encoding = *p++;
-            else if (*augmentation == 'P' || *augmentation == 'S')
-                util::throw_assert(false, "not implemented");
-            else
-                break;
+    }
+    if (insn.op == REG && insn.reg < 64) m_registers |= 1ull << insn.reg;
+    m_code.push_back(insn);
+}
+
+CompiledExpression CompiledExpression::compile(std::span<const uint8_t> expr) {
+    // Branch targets are byte offsets; they are found first so nothing is folded across one.
+    struct Decoded {
+        uint32_t offset;
+        Insn insn;
+        bool is_nop;
+    };
+    std::vector<Decoded> decoded;
+    std::vector<bool> is_target(expr.size() + 1);
+    const auto* begin = expr.data();
+    const auto* p = begin;
+    const auto* end = p + expr.size();
+    while (p < end) {
+        uint32_t offset = p - begin;
+        auto op = *p++;
+        Insn insn{STOP, 0, 0, 0, 0};
+        bool is_nop = false;
+        if (op >= DW_OP_lit0 && op <= DW_OP_lit31) {
+            insn = {CONST, 0, 0, 0, static_cast<uint64_t>(op - DW_OP_lit0)};
+        } else if (op >= DW_OP_breg0 && op <= DW_OP_breg31) {
+            insn = {REG, 0, static_cast<uint16_t>(op - DW_OP_breg0), 0, static_cast<uint64_t>(read_leb128(p))};
+        } else {
+            switch (op) {
+                case DW_OP_addr:
+                case DW_OP_const8u:
+                case DW_OP_const8s: insn = {CONST, 0, 0, 0, read<uint64_t>(p)}; break;
+                case DW_OP_const1u: insn = {CONST, 0, 0, 0, read<uint8_t>(p)}; break;
+                case DW_OP_const1s: insn = {CONST, 0, 0, 0, static_cast<uint64_t>(read<int8_t>(p))}; break;
+                case DW_OP_const2u: insn = {CONST, 0, 0, 0, read<uint16_t>(p)}; break;
+                case DW_OP_const2s: insn = {CONST, 0, 0, 0, static_cast<uint64_t>(read<int16_t>(p))}; break;
+                case DW_OP_const4u: insn = {CONST, 0, 0, 0, read<uint32_t>(p)}; break;
+                case DW_OP_const4s: insn = {CONST, 0, 0, 0, static_cast<uint64_t>(read<int32_t>(p))}; break;
+                case DW_OP_constu: insn = {CONST, 0, 0, 0, read_uleb128(p)}; break;
+                case DW_OP_consts: insn = {CONST, 0, 0, 0, static_cast<uint64_t>(read_leb128(p))}; break;
+                case DW_OP_bregx: {
+                    auto reg = read_uleb128(p);
+                    util::throw_assert(reg <= UINT16_MAX, "bad DW_OP_bregx register");
+                    insn = {REG, 0, static_cast<uint16_t>(reg), 0, static_cast<uint64_t>(read_leb128(p))};
+                    break;
+                }
+                case DW_OP_dup: insn.op = DUP; break;
+                case DW_OP_drop: insn.op = DROP; break;
+                case DW_OP_over: insn = {PICK, 1, 0, 0, 0}; break;
+                case DW_OP_pick: insn = {PICK, read<uint8_t>(p), 0, 0, 0}; break;
+                case DW_OP_swap: insn.op = SWAP; break;
+                case DW_OP_rot: insn.op = ROT; break;
+                case DW_OP_deref: insn = {DEREF, sizeof(uint64_t), 0, 0, 0}; break;
+                case DW_OP_deref_size:
+                    insn = {DEREF, read<uint8_t>(p), 0, 0, 0};
+                    util::throw_assert(insn.size >= 1 && insn.size <= 8, "bad DW_OP_deref_size");
+                    break;
+                case DW_OP_abs: insn.op = ABS; break;
+                case DW_OP_neg: insn.op = NEG; break;
+                case DW_OP_not: insn.op = NOT; break;
+                case DW_OP_plus_uconst: insn = {PLUS_CONST, 0, 0, 0, read_uleb128(p)}; break;
+                case DW_OP_and: insn.op = AND; break;
+                case DW_OP_div: insn.op = DIV; break;
+                case DW_OP_minus: insn.op = MINUS; break;
+                case DW_OP_mod: insn.op = MOD; break;
+                case DW_OP_mul: insn.op = MUL; break;
+                case DW_OP_or: insn.op = OR; break;
+                case DW_OP_plus: insn.op = PLUS; break;
+                case DW_OP_shl: insn.op = SHL; break;
+                case DW_OP_shr: insn.op = SHR; break;
+                case DW_OP_shra: insn.op = SHRA; break;
+                case DW_OP_xor: insn.op = XOR; break;
+                case DW_OP_eq: insn.op = EQ; break;
+                case DW_OP_ge: insn.op = GE; break;
+                case DW_OP_gt: insn.op = GT; break;
+                case DW_OP_le: insn.op = LE; break;
+                case DW_OP_lt: insn.op = LT; break;
+                case DW_OP_ne: insn.op = NE; break;
+                case DW_OP_skip:
+                case DW_OP_bra: {
+                    auto delta = read<int16_t>(p);
+                    util::throw_assert(delta >= begin - p && delta <= end - p, "DWARF branch out of range");
+                    uint32_t target = p + delta - begin;
+                    is_target[target] = true;
+                    insn = {op == DW_OP_skip ? SKIP : BRA, 0, 0, target, 0};
+                    break;
+                }
+                case DW_OP_nop: is_nop = true; break;
+                case DW_OP_stack_value: break;
+                default: util::throw_assert(false, "unsupported DWARF expression operation");
+            }
         }
-        if (!cie.initial_insns) cie.initial_insns = p;
-        printf("CIE: code align %lu, data align %ld, ret addr reg %lu, encoding %hhu\n", cie.code_alignment_factor,
-               cie.data_alignment_factor, cie.return_address_register, cie.encoding);
-        cie_map.emplace(cie_offset, cie);
-    } else {
-        util::throw_assert(!only_cie, "unexpected FDE");
-        auto cie_offset = p - (is_dwarf64 ? sizeof(uint64_t) : sizeof(uint32_t)) - section_start - cie_ptr;
-        auto it = cie_map.find(cie_offset);
-        if (it == cie_map.end()) {
-            const auto* new_cie = section_start + cie_offset;
-            parse_eh_frame_entry(new_cie, section_start, section_vaddr, cie_map, true);
-            it = cie_map.find(cie_offset);
+        decoded.push_back({offset, insn, is_nop});
+        if (op == DW_OP_stack_value) {
+            break;
         }
-        const auto& cie = it->second;
-        auto initial_addr = read_encoded_value(p, section_start, section_vaddr, cie.encoding);
-        auto range = read_encoded_value(p, section_start, section_vaddr, cie.encoding & 0xf);
-        if (cie.has_z_augmentation) {
-            auto n = read_uleb128(p);
-            p += n;
+    }
+    util::throw_assert(p <= end, "DWARF expression overruns its block");
+
+    CompiledExpression compiled;
+    // Maps byte offsets that start an operation to the index of the instruction that now starts there.
+    std::vector<uint32_t> index_at(expr.size() + 1, UINT32_MAX);
+    size_t barrier = 0;
+    for (const auto& [offset, insn, is_nop] : decoded) {
+        if (is_target[offset]) barrier = compiled.m_code.size();
+        index_at[offset] = compiled.m_code.size();
+        if (!is_nop) compiled.emit(insn, barrier);
+    }
+    index_at[expr.size()] = compiled.m_code.size();
+    for (auto& insn : compiled.m_code) {
+        if (insn.op == SKIP || insn.op == BRA) {
+            util::throw_assert(index_at[insn.target] != UINT32_MAX, "DWARF branch into an operand");
+            insn.target = index_at[insn.target];
         }
-        printf("FDE: initial addr %#lx, range %#lx\n", initial_addr, range);
     }
-    p = end;
+    return compiled;
+}
+
+std::optional<uint64_t> CompiledExpression::evaluate(const ExpressionContext& ctx,
+                                                     std::optional<uint64_t> initial) const {
+    std::array<std::optional<uint64_t>, 64> regs;
+    for (auto mask = m_registers; mask; mask &= mask - 1) {
+        auto reg = __builtin_ctzll(mask);
+        regs[reg] = ctx.read_register(reg);
+    }
+
+    std::vector<uint64_t> stack;
+    if (initial) stack.push_back(*initial);
+    auto pop = [&]() {
+        util::throw_assert(!stack.empty(), "DWARF expression stack underflow");
+        auto value = stack.back();
+        stack.pop_back();
+        return value;
+    };
+
+    for (size_t pc = 0; pc < m_code.size();) {
+        const auto& insn = m_code[pc++];
+        switch (insn.op) {
+            case CONST:
+                stack.push_back(insn.operand);
+                break;
+            case REG: {
+                auto value = insn.reg < 64 ? regs[insn.reg] : ctx.read_register(insn.reg);
+                if (!value) return {};
+                stack.push_back(*value + insn.operand);
+                break;
+            }
+            case DEREF: {
+                auto value = ctx.read_memory(pop(), insn.size);
+                if (!value) return {};
+                stack.push_back(*value);
+                break;
+            }
+            case DUP:
+                util::throw_assert(!stack.empty(), "DWARF expression stack underflow");
+                stack.push_back(stack.back());
+                break;
+            case DROP:
+                pop();
+                break;
+            case PICK:
+                util::throw_assert(insn.size < stack.size(), "DWARF expression stack underflow");
+                stack.push_back(stack[stack.size() - 1 - insn.size]);
+                break;
+            case SWAP: {
+                auto a = pop(), b = pop();
+                stack.push_back(a);
+                stack.push_back(b);
+                break;
+            }
+            case ROT: {
+                auto a = pop(), b = pop(), c = pop();
+                stack.push_back(a);
+                stack.push_back(c);
+                stack.push_back(b);
+                break;
+            }
+            case ABS: {
+                auto a = static_cast<int64_t>(pop());
+                stack.push_back(a < 0 ? -a : a);
+                break;
+            }
+            case NEG:
+                stack.push_back(-pop());
+                break;
+            case NOT:
+                stack.push_back(~pop());
+                break;
+            case PLUS_CONST:
+                stack.push_back(pop() + insn.operand);
+                break;
+            case SKIP:
+                pc = insn.target;
+                break;
+            case BRA:
+                if (pop() != 0) pc = insn.target;
+                break;
+            case STOP:
+                pc = m_code.size();
+                break;
+            default: {
+                auto b = pop(), a = pop();
+                stack.push_back(apply(insn.op, a, b));
+                break;
+            }
+        }
+    }
+    util::throw_assert(!stack.empty(), "DWARF expression left no value");
+    return stack.back();
+}
+
+const CompiledExpression& ExpressionCache::get(std::span<const uint8_t> expr) {
+    auto it = m_compiled.find(expr.data());
+    if (it == m_compiled.end() || it->second.first != expr.size()) {
+        auto compiled = CompiledExpression::compile(expr);
+        it = m_compiled.insert_or_assign(expr.data(), std::make_pair(expr.size(), std::move(compiled))).first;
+    }
+    return it->second.second;
+}
+
+std::optional<uint64_t> evaluate_expression(std::span<const uint8_t> expr, const ExpressionContext& ctx,
+                                            std::optional<uint64_t> initial) {
+    return CompiledExpression::compile(expr).evaluate(ctx, initial);
 }
 }  // namespace DWARF
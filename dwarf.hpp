@@ -1,19 +1,295 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
 
+#include <array>
+#include <functional>
+#include <optional>
+#include <span>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 namespace DWARF {
+// Primitive readers shared by the decoders. Each advances `p` past what it read. The LEB128 readers without an end
+// pointer trust the data to be well formed; the ones with one throw instead of reading past `end`.
+
+// Packs the low 7 bits of each byte of `word` together, least significant byte first: PEXT when the build targets
+// BMI2, shifts and masks otherwise.
+inline uint64_t compact_leb128_groups(uint64_t word) {
+#ifdef __BMI2__
+    return _pext_u64(word, 0x7f7f7f7f7f7f7f7f);
+#else
+    word &= 0x7f7f7f7f7f7f7f7f;
+    // Close the gaps pairwise: 7-bit groups into 14-bit ones, then 28, then 56.
+    word = (word & 0x007f007f007f007f) | (word & 0x7f007f007f007f00) >> 1;
+    word = (word & 0x00003fff00003fff) | (word & 0x3fff00003fff0000) >> 2;
+    return (word & 0x000000000fffffff) | (word & 0x0fffffff00000000) >> 4;
+#endif
+}
+
+// Byte-at-a-time decoding for values that are truncated or longer than 8 bytes.
+uint64_t read_uleb128_slow(const uint8_t*& p, const uint8_t* end);
+int64_t read_leb128_slow(const uint8_t*& p, const uint8_t* end);
+
+// Returns the length of the LEB128 starting in `word` (the next 8 bytes, little-endian), or 0 if it is longer.
+inline unsigned leb128_length(uint64_t word) {
+    uint64_t stops = ~word & 0x8080808080808080;
+    return stops ? (__builtin_ctzll(stops) + 1) / 8 : 0;
+}
+
+inline uint64_t read_uleb128(const uint8_t*& p, const uint8_t* end) {
+    if (p < end && *p < 0x80) return *p++;
+    // Most multi-byte values end within one word, which is then decoded without a loop.
+    if (end - p >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        if (auto len = leb128_length(word)) {
+            p += len;
+            return compact_leb128_groups(len == 8 ? word : word & ((1ull << 8 * len) - 1));
+        }
+    }
+    return read_uleb128_slow(p, end);
+}
+
+inline int64_t read_leb128(const uint8_t*& p, const uint8_t* end) {
+    if (p < end && *p < 0x80) return static_cast<int64_t>(static_cast<uint64_t>(*p++) << 57) >> 57;
+    if (end - p >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        if (auto len = leb128_length(word)) {
+            p += len;
+            auto value = compact_leb128_groups(len == 8 ? word : word & ((1ull << 8 * len) - 1));
+            auto shift = 64 - 7 * len;
+            return static_cast<int64_t>(value << shift) >> shift;
+        }
+    }
+    return read_leb128_slow(p, end);
+}
+
+inline int64_t read_leb128(const uint8_t*& p) {
+    if (*p < 0x80) return static_cast<int64_t>(static_cast<uint64_t>(*p++) << 57) >> 57;
+    uint64_t result = 0;
+    size_t shift = 0;
+    uint8_t byte;
+    do {
+        byte = *p++;
+        result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    if ((shift < sizeof(result) * 8) && (byte & 0x40)) result |= -(1UL << shift);
+    return result;
+}
+
+inline uint64_t read_uleb128(const uint8_t*& p) {
+    if (*p < 0x80) return *p++;
+    uint64_t result = 0;
+    size_t shift = 0;
+    uint8_t byte;
+    do {
+        byte = *p++;
+        result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return result;
+}
+
+template <typename T>
+T read(const uint8_t*& p) {
+    T result;
+    memcpy(&result, p, sizeof(T));
+    p += sizeof(T);
+    return result;
+}
+
+// Reads an initial length field, which also tells the 32- and 64-bit DWARF formats apart.
+inline uint64_t read_length(const uint8_t*& p, bool& is_dwarf64) {
+    uint64_t len = read<uint32_t>(p);
+    if (len == 0xffffffff) {
+        len = read<uint64_t>(p);
+        is_dwarf64 = true;
+    } else {
+        is_dwarf64 = false;
+    }
+    return len;
+}
+
+// x86-64 DWARF register numbers. Column 16 holds the return address, i.e. the caller's RIP.
+enum CfiRegister : uint16_t {
+    REG_RAX,
+    REG_RDX,
+    REG_RCX,
+    REG_RBX,
+    REG_RSI,
+    REG_RDI,
+    REG_RBP,
+    REG_RSP,
+    REG_R8,
+    REG_R9,
+    REG_R10,
+    REG_R11,
+    REG_R12,
+    REG_R13,
+    REG_R14,
+    REG_R15,
+    REG_RA,
+    NUM_CFI_REGISTERS,
+};
+
+// Where DW_EH_PE_* encoded pointers are read from, and the bases their application modes are relative to.
+struct PointerBases {
+    const uint8_t* section_start = nullptr;
+    uint64_t section_vaddr = 0;
+    uint64_t text = 0;
+    uint64_t data = 0;
+    uint64_t func = 0;
+};
+
 struct CIE {
     uint64_t code_alignment_factor;
     int64_t data_alignment_factor;
     uint64_t return_address_register;
     const uint8_t* initial_insns;
+    const uint8_t* end;
     uint8_t encoding;
+    uint8_t lsda_encoding;
     bool has_z_augmentation;
+    bool is_signal_frame;
+};
+
+struct FDE {
+    const CIE* cie;
+    uint64_t initial_location;
+    uint64_t address_range;
+    const uint8_t* insns;
+    const uint8_t* end;
+};
+
+struct RegisterRule {
+    enum Kind : uint8_t { SAME_VALUE, UNDEFINED, OFFSET, VAL_OFFSET, REGISTER, EXPRESSION, VAL_EXPRESSION };
+    Kind kind = SAME_VALUE;
+    // The CFA offset for OFFSET/VAL_OFFSET, or the source register for REGISTER.
+    int64_t value = 0;
+    std::span<const uint8_t> expr = {};
+};
+
+struct CfaRule {
+    bool is_expression = false;
+    uint16_t reg = REG_RSP;
+    int64_t offset = 0;
+    std::span<const uint8_t> expr = {};
+};
+
+// The unwind rules in effect at one address.
+struct UnwindRow {
+    CfaRule cfa;
+    std::array<RegisterRule, NUM_CFI_REGISTERS> regs;
+};
+
+// Target access for expression evaluation. Both return nothing if the register or memory is unavailable.
+struct ExpressionContext {
+    std::function<std::optional<uint64_t>(uint16_t reg)> read_register;
+    std::function<std::optional<uint64_t>(uint64_t addr, size_t size)> read_memory;
+};
+
+// Decodes a DW_EH_PE_* encoded pointer. DW_EH_PE_indirect is not followed: the address of the pointer is returned.
+uint64_t read_encoded_value(const uint8_t*& p, const PointerBases& bases, uint8_t encoding);
+
+// Parses the .eh_frame entry at `p` and advances past it. CIEs are cached in `cie_map` by section offset. Returns the
+// entry if it is an FDE; CIEs and the terminator yield nothing.
+std::optional<FDE> parse_eh_frame_entry(const uint8_t*& p, const PointerBases& bases,
+                                        std::unordered_map<uint64_t, CIE>& cie_map);
+
+// Runs the CIE's initial instructions and then the FDE's up to `pc`, and returns the row in effect at `pc`. `bases`
+// must be the ones the FDE was parsed with, for DW_CFA_set_loc.
+UnwindRow execute_cfi(const FDE& fde, uint64_t pc, const PointerBases& bases);
+
+// A DWARF expression decoded once into flat instructions, with constants folded, branch targets resolved to
+// instruction indexes and the registers it reads collected up front.
+class CompiledExpression {
+   public:
+    static CompiledExpression compile(std::span<const uint8_t> expr);
+
+    // Returns the top of the stack, or nothing if the expression needs an unavailable register or memory. `initial`
+    // is pushed first, as DW_CFA_expression requires for the CFA. Each register is read from `ctx` at most once.
+    std::optional<uint64_t> evaluate(const ExpressionContext& ctx, std::optional<uint64_t> initial = {}) const;
+    size_t size() const { return m_code.size(); }
+
+   private:
+    enum Op : uint8_t {
+        CONST,
+        REG,
+        DEREF,
+        DUP,
+        DROP,
+        PICK,
+        SWAP,
+        ROT,
+        ABS,
+        NEG,
+        NOT,
+        PLUS_CONST,
+        AND,
+        DIV,
+        MINUS,
+        MOD,
+        MUL,
+        OR,
+        PLUS,
+        SHL,
+        SHR,
+        SHRA,
+        XOR,
+        EQ,
+        GE,
+        GT,
+        LE,
+        LT,
+        NE,
+        SKIP,
+        BRA,
+        STOP,
+    };
+    struct Insn {
+        Op op;
+        // DEREF size or PICK index.
+        uint8_t size;
+        uint16_t reg;
+        // Instruction index for SKIP and BRA.
+        uint32_t target;
+        // CONST value, or the offset added by REG and PLUS_CONST.
+        uint64_t operand;
+    };
+
+    static bool is_binary(Op op) { return op >= AND && op <= NE; }
+    // Computes a binary operation; throws on division by zero.
+    static uint64_t apply(Op op, uint64_t a, uint64_t b);
+    // Appends `insn`, folding it into the instructions after `barrier` when their result is known at compile time.
+    void emit(Insn insn, size_t barrier);
+
+    std::vector<Insn> m_code;
+    // Bit i is set if DWARF register i < 64 is read; higher registers are read at each use.
+    uint64_t m_registers = 0;
+};
+
+// Compiled expressions keyed by the address of their bytes, which stays valid for as long as the owner's mappings.
+class ExpressionCache {
+   public:
+    // Returns the compiled form of `expr`, compiling it on first use.
+    const CompiledExpression& get(std::span<const uint8_t> expr);
+    void clear() { m_compiled.clear(); }
+
+   private:
+    std::unordered_map<const uint8_t*, std::pair<size_t, CompiledExpression>> m_compiled;
 };
 
-void parse_eh_frame_entry(const uint8_t*& p, const uint8_t* section_start, uint64_t section_vaddr,
-                          std::unordered_map<uint64_t, CIE>& cie_map, bool only_cie = false);
+// Compiles and evaluates `expr` once. Callers that evaluate the same expression repeatedly should use an
+// ExpressionCache instead.
+std::optional<uint64_t> evaluate_expression(std::span<const uint8_t> expr, const ExpressionContext& ctx,
+                                            std::optional<uint64_t> initial = {});
 }  // namespace DWARF
@@ -1,82 +1,660 @@
 #include "elf.hpp"
 
 #include <elf.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
+#include <algorithm>
+#include <functional>
+#include <future>
+#include <initializer_list>
+#include <memory>
 #include <optional>
+#include <string>
 #include <string_view>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include "dwarf.hpp"
+#include "dwarf2.h"
+#include "threadpool.hpp"
 #include "util.hpp"
 
-ELF::ELF(const char* filename, uint64_t base) : m_base(base) { parse(filename); }
+#ifndef ELFCOMPRESS_ZSTD
+#define ELFCOMPRESS_ZSTD 2
+#endif
+
+namespace {
+// A compressed section's payload, the algorithm it uses and the size it inflates to.
+struct CompressedPayload {
+    uint32_t type;
+    uint64_t size;
+    std::span<const uint8_t> data;
+};
+
+CompressedPayload compressed_payload(const Section& sec) {
+    auto bytes = sec.bytes;
+    if (sec.header->sh_flags & SHF_COMPRESSED) {
+        util::throw_assert(bytes.size() >= sizeof(Elf64_Chdr), "truncated compression header");
+        Elf64_Chdr chdr;
+        memcpy(&chdr, bytes.data(), sizeof(chdr));
+        return {chdr.ch_type, chdr.ch_size, bytes.subspan(sizeof(chdr))};
+    }
+    // Legacy .zdebug_* sections: "ZLIB", then the big-endian uncompressed size.
+    util::throw_assert(bytes.size() >= 12 && memcmp(bytes.data(), "ZLIB", 4) == 0, "bad .zdebug section header");
+    uint64_t size = 0;
+    for (size_t i = 4; i < 12; ++i) {
+        size = size << 8 | bytes[i];
+    }
+    return {ELFCOMPRESS_ZLIB, size, bytes.subspan(12)};
+}
+
+// Inflates `payload` into `out`, which must be exactly the uncompressed size.
+void decompress(const CompressedPayload& payload, std::span<uint8_t> out) {
+    if (payload.type == ELFCOMPRESS_ZLIB) {
+        z_stream stream{};
+        util::throw_assert(inflateInit(&stream) == Z_OK, "inflateInit failed");
+        stream.next_in = const_cast<Bytef*>(payload.data.data());
+        stream.avail_in = payload.data.size();
+        stream.next_out = out.data();
+        int ret = Z_OK;
+        // avail_out is 32 bits wide, so larger sections are inflated a window at a time.
+        while (ret == Z_OK) {
+            stream.avail_out = std::min<size_t>(out.size() - stream.total_out, UINT32_MAX);
+            ret = inflate(&stream, Z_FINISH);
+        }
+        auto total = stream.total_out;
+        inflateEnd(&stream);
+        util::throw_assert(ret == Z_STREAM_END && total == out.size(), "corrupt zlib-compressed section");
+        return;
+    }
+#ifdef HAVE_ZSTD
+    if (payload.type == ELFCOMPRESS_ZSTD) {
+        auto n = ZSTD_decompress(out.data(), out.size(), payload.data.data(), payload.data.size());
+        util::throw_assert(!ZSTD_isError(n) && n == out.size(), "corrupt zstd-compressed section");
+        return;
+    }
+#endif
+    util::throw_assert(false, "unknown section compression type");
+}
+
+bool compression_supported(uint32_t type) {
+#ifdef HAVE_ZSTD
+    if (type == ELFCOMPRESS_ZSTD) return true;
+#endif
+    return type == ELFCOMPRESS_ZLIB;
+}
+
+// Returns the directory for cached symbol indexes, creating it if needed, or nothing if caching is unavailable.
+std::optional<std::string> symbol_cache_dir() {
+    if (getenv("CYDBG_NO_SYMBOL_CACHE")) {
+        return {};
+    }
+    std::string dir;
+    if (const char* xdg = getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+        dir = xdg;
+    } else if (const char* home = getenv("HOME"); home && *home) {
+        dir = std::string(home) + "/.cache";
+    } else {
+        return {};
+    }
+    mkdir(dir.c_str(), 0755);
+    dir += "/cydbg";
+    if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+        return {};
+    }
+    return dir;
+}
+}  // namespace
+
+ELF::ELF(const char* filename, uint64_t base, bool lazy_symbols) : m_path(filename), m_base(base) {
+    parse(filename, lazy_symbols);
+}
 
 ELF& ELF::operator=(ELF&& other) {
+    m_path = std::move(other.m_path);
     m_base = other.m_base;
     m_file = other.m_file;
     m_filesize = other.m_filesize;
     m_shnum = other.m_shnum;
     m_shdrs = other.m_shdrs;
+    m_phnum = other.m_phnum;
+    m_phdrs = other.m_phdrs;
     m_shstrtab = other.m_shstrtab;
+    m_sections = std::move(other.m_sections);
+    m_sections_by_name = std::move(other.m_sections_by_name);
+    m_sections_by_type = std::move(other.m_sections_by_type);
+    m_eh_frame = other.m_eh_frame;
+    m_eh_frame_bases = other.m_eh_frame_bases;
+    m_cies = std::move(other.m_cies);
+    m_decompressed = std::move(other.m_decompressed);
+    other.m_decompressed.clear();
+    m_lines = std::move(other.m_lines);
+    m_debug_info = std::move(other.m_debug_info);
+    m_eh_frame_hdr_table = other.m_eh_frame_hdr_table;
+    m_eh_frame_hdr_count = other.m_eh_frame_hdr_count;
+    m_eh_frame_hdr_encoding = other.m_eh_frame_hdr_encoding;
+    m_eh_frame_hdr_bases = other.m_eh_frame_hdr_bases;
+    m_fde_starts = std::move(other.m_fde_starts);
+    m_fde_offsets = std::move(other.m_fde_offsets);
+    m_fde_index_built = other.m_fde_index_built;
     m_entry = other.m_entry;
-    m_syms = std::move(other.m_syms);
+    m_sym_index = std::move(other.m_sym_index);
+    m_symbols_loaded = other.m_symbols_loaded;
+    m_symbol_load = std::move(other.m_symbol_load);
+    m_has_symtab = other.m_has_symtab;
+    m_mtime = other.m_mtime;
+    m_gnu_hash = other.m_gnu_hash;
+    m_sysv_hash = other.m_sysv_hash;
+    m_dynsym = other.m_dynsym;
+    m_dynstr = other.m_dynstr;
     other.m_file = nullptr;
     return *this;
 }
 
 ELF::~ELF() {
+    // Background tasks read the mapping, so they must finish before it goes away.
+    if (m_symbol_load) {
+        m_symbol_load->done.wait();
+    }
+    for (auto [sec, bytes] : m_decompressed) {
+        if (!bytes.empty()) munmap(bytes.data(), bytes.size());
+    }
     if (m_file) {
         munmap(m_file, m_filesize);
     }
 }
 
 std::optional<std::string_view> ELF::interp() const {
-    auto* interp_shdr = find_section(".interp");
-    if (!interp_shdr) {
+    const auto* interp = section(".interp");
+    if (!interp) {
         return {};
     }
-    return reinterpret_cast<char*>(m_file + interp_shdr->sh_offset);
+    return reinterpret_cast<const char*>(interp->bytes.data());
 }
 
 std::optional<uint64_t> ELF::lookup_sym(std::string_view name) const {
-    auto sym = m_syms.find(name);
-    if (sym == m_syms.end()) return {};
-    return m_base + sym->second;
+    if (!m_symbols_loaded) {
+        // Only .symtab has symbols the dynamic hash tables cannot see.
+        if (auto addr = lookup_dynsym(name); addr || !m_has_symtab) {
+            return addr;
+        }
+        load_symbols(false);
+    }
+    auto addr = m_sym_index.find(name);
+    if (!addr) return {};
+    return m_base + *addr;
+}
+
+std::optional<SymbolMatch> ELF::lookup_addr(uint64_t addr) const {
+    load_symbols(false);
+    return m_sym_index.lookup(addr - m_base);
+}
+
+const SymbolIndex& ELF::symbols() const {
+    load_symbols(false);
+    return m_sym_index;
+}
+
+std::optional<uint64_t> ELF::lookup_dynsym(std::string_view name) const {
+    auto matches = [&](uint32_t i) {
+        const auto& sym = m_dynsym[i];
+        return ELF64_ST_TYPE(sym.st_info) == STT_FUNC && sym.st_shndx != SHN_UNDEF &&
+               std::string_view(m_dynstr + sym.st_name) == name;
+    };
+    if (m_gnu_hash) {
+        // Header: nbuckets, symoffset, bloom_size, bloom_shift, then the 64-bit Bloom filter, buckets and chains.
+        uint32_t nbuckets = m_gnu_hash[0], symoffset = m_gnu_hash[1], bloom_size = m_gnu_hash[2];
+        uint32_t bloom_shift = m_gnu_hash[3];
+        if (nbuckets == 0 || bloom_size == 0) {
+            return {};
+        }
+        const auto* bloom = reinterpret_cast<const uint64_t*>(m_gnu_hash + 4);
+        const auto* buckets = reinterpret_cast<const uint32_t*>(bloom + bloom_size);
+        const auto* chain = buckets + nbuckets;
+        uint32_t h = 5381;
+        for (char c : name) {
+            h = h * 33 + static_cast<uint8_t>(c);
+        }
+        uint64_t word = bloom[(h / 64) % bloom_size];
+        uint64_t mask = (1UL << (h % 64)) | (1UL << ((h >> bloom_shift) % 64));
+        if ((word & mask) != mask) {
+            return {};
+        }
+        for (uint32_t i = buckets[h % nbuckets]; i >= symoffset; ++i) {
+            uint32_t h2 = chain[i - symoffset];
+            if ((h | 1) == (h2 | 1) && matches(i)) {
+                return m_base + m_dynsym[i].st_value;
+            }
+            if (h2 & 1) {
+                break;
+            }
+        }
+        return {};
+    }
+    if (m_sysv_hash) {
+        uint32_t nbucket = m_sysv_hash[0];
+        const auto* bucket = m_sysv_hash + 2;
+        const auto* chain = bucket + nbucket;
+        uint32_t h = 0;
+        for (char c : name) {
+            h = (h << 4) + static_cast<uint8_t>(c);
+            uint32_t g = h & 0xf0000000;
+            if (g) h ^= g >> 24;
+            h &= ~g;
+        }
+        for (uint32_t i = bucket[h % nbucket]; i != STN_UNDEF; i = chain[i]) {
+            if (matches(i)) {
+                return m_base + m_dynsym[i].st_value;
+            }
+        }
+        return {};
+    }
+    load_symbols(false);
+    auto addr = m_sym_index.find(name);
+    if (!addr) return {};
+    return m_base + *addr;
 }
 
-std::optional<std::string_view> ELF::lookup_addr(uint64_t addr) const {
-    addr -= m_base;
-    std::optional<std::string_view> ret;
-    std::optional<uint64_t> ret_addr;
-    for (const auto& [sym, sym_addr] : m_syms) {
-        if (addr >= sym_addr && sym_addr >= ret_addr.value_or(0)) {
-            ret = sym;
-            ret_addr = sym_addr;
+std::vector<std::pair<uint64_t, uint64_t>> ELF::load_segments() const {
+    std::vector<std::pair<uint64_t, uint64_t>> ret;
+    for (size_t i = 0; i < m_phnum; ++i) {
+        if (m_phdrs[i].p_type == PT_LOAD) {
+            ret.emplace_back(m_phdrs[i].p_vaddr, m_phdrs[i].p_memsz);
         }
     }
     return ret;
 }
 
-Elf64_Shdr* ELF::find_section(const char* name) const {
+std::optional<std::string> ELF::build_id() const {
+    for (const auto* note : sections(SHT_NOTE)) {
+        const auto* p = note->bytes.data();
+        const auto* end = p + note->bytes.size();
+        while (p + sizeof(Elf64_Nhdr) <= end) {
+            Elf64_Nhdr nhdr;
+            memcpy(&nhdr, p, sizeof(nhdr));
+            const auto* name = p + sizeof(nhdr);
+            const auto* desc = name + ((nhdr.n_namesz + 3) & ~3u);
+            p = desc + ((nhdr.n_descsz + 3) & ~3u);
+            if (p > end) {
+                break;
+            }
+            if (nhdr.n_type == NT_GNU_BUILD_ID && nhdr.n_namesz == 4 && memcmp(name, "GNU", 4) == 0) {
+                std::string ret;
+                for (size_t j = 0; j < nhdr.n_descsz; ++j) {
+                    char hex[3];
+                    snprintf(hex, sizeof(hex), "%02x", desc[j]);
+                    ret += hex;
+                }
+                return ret;
+            }
+        }
+    }
+    return {};
+}
+
+const Section* ELF::section(std::string_view name) const {
+    auto it = m_sections_by_name.find(name);
+    return it == m_sections_by_name.end() ? nullptr : it->second;
+}
+
+std::span<const Section* const> ELF::sections(uint32_t type) const {
+    auto it = m_sections_by_type.find(type);
+    if (it == m_sections_by_type.end()) {
+        return {};
+    }
+    return it->second;
+}
+
+const Section* ELF::find_debug_section(std::string_view name) const {
+    if (const auto* sec = section(name)) {
+        return sec;
+    }
+    if (!name.starts_with(".debug_")) {
+        return nullptr;
+    }
+    return section(".z" + std::string(name.substr(1)));
+}
+
+std::span<const uint8_t> ELF::debug_section(std::string_view name) const {
+    const auto* sec = find_debug_section(name);
+    if (!sec) {
+        return {};
+    }
+    if (!sec->compressed) {
+        return sec->bytes;
+    }
+    if (auto it = m_decompressed.find(sec); it != m_decompressed.end()) {
+        return it->second;
+    }
+    decompress_sections({name}, ThreadPool::global());
+    return m_decompressed.at(sec);
+}
+
+void ELF::decompress_sections(std::initializer_list<std::string_view> names, ThreadPool& pool) const {
+    // Mappings are made and recorded here, so only the inflating itself runs on the pool.
+    std::vector<std::pair<const Section*, std::future<void>>> tasks;
+    for (auto name : names) {
+        const auto* sec = find_debug_section(name);
+        if (!sec || !sec->compressed || m_decompressed.contains(sec)) {
+            continue;
+        }
+        auto payload = compressed_payload(*sec);
+        std::span<uint8_t> out;
+        // An algorithm we were built without only costs the debug info in that section, so it reads as empty.
+        if (!compression_supported(payload.type)) {
+            fprintf(stderr, "%s: cannot decompress %.*s (compression type %u)\n", m_path.c_str(),
+                    static_cast<int>(name.size()), name.data(), payload.type);
+            m_decompressed.emplace(sec, out);
+            continue;
+        }
+        if (payload.size) {
+            void* map = mmap(nullptr, payload.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            util::throw_assert(map != MAP_FAILED, "cannot map decompressed section");
+            out = {static_cast<uint8_t*>(map), payload.size};
+        }
+        m_decompressed.emplace(sec, out);
+        tasks.emplace_back(sec, pool.submit([payload, out] { decompress(payload, out); }));
+    }
+    // A section that fails to inflate is dropped, so a later access retries and reports the error again.
+    std::exception_ptr error;
+    for (auto& [sec, task] : tasks) {
+        try {
+            task.get();
+        } catch (...) {
+            error = std::current_exception();
+            auto bytes = m_decompressed.at(sec);
+            if (!bytes.empty()) munmap(bytes.data(), bytes.size());
+            m_decompressed.erase(sec);
+        }
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+const LineTable& ELF::lines() const {
+    if (!m_lines) {
+        auto& pool = ThreadPool::global();
+        decompress_sections({".debug_line", ".debug_line_str", ".debug_str"}, pool);
+        LineSections sections;
+        sections.debug_line = debug_section(".debug_line");
+        sections.debug_line_str = debug_section(".debug_line_str");
+        sections.debug_str = debug_section(".debug_str");
+        m_lines = std::make_unique<LineTable>(LineTable::build(sections, pool));
+    }
+    return *m_lines;
+}
+
+std::optional<SourceLocation> ELF::lookup_line(uint64_t addr) const { return lines().lookup(addr - m_base); }
+
+std::vector<uint64_t> ELF::find_line(std::string_view file, uint32_t line) const {
+    auto addrs = lines().find(file, line);
+    for (auto& addr : addrs) {
+        addr += m_base;
+    }
+    return addrs;
+}
+
+DebugInfo& ELF::debug_info() const {
+    if (!m_debug_info) {
+        auto& pool = ThreadPool::global();
+        decompress_sections({".debug_info", ".debug_abbrev", ".debug_str", ".debug_line_str", ".debug_str_offsets",
+                             ".debug_addr", ".debug_names"},
+                            pool);
+        DebugSections sections;
+        sections.debug_info = debug_section(".debug_info");
+        sections.debug_abbrev = debug_section(".debug_abbrev");
+        sections.debug_str = debug_section(".debug_str");
+        sections.debug_line_str = debug_section(".debug_line_str");
+        sections.debug_str_offsets = debug_section(".debug_str_offsets");
+        sections.debug_addr = debug_section(".debug_addr");
+        sections.debug_names = debug_section(".debug_names");
+        if (const auto* sec = section(".gdb_index")) sections.gdb_index = sec->bytes;
+        m_debug_info = std::make_unique<DebugInfo>(sections, pool);
+    }
+    return *m_debug_info;
+}
+
+std::optional<DWARF::FDE> ELF::find_fde(uint64_t addr) const {
+    if (!m_eh_frame) {
+        return {};
+    }
+    uint64_t offset;
+    if (m_eh_frame_hdr_table && m_eh_frame_hdr_encoding == (DW_EH_PE_datarel | DW_EH_PE_sdata4)) {
+        // The common case: int32 pairs relative to .eh_frame_hdr, searched straight from the mapping.
+        const auto* table = reinterpret_cast<const int32_t*>(m_eh_frame_hdr_table);
+        auto rel = static_cast<int64_t>(addr - m_eh_frame_hdr_bases.data);
+        size_t lo = 0, hi = m_eh_frame_hdr_count;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (table[2 * mid] <= rel) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo == 0) {
+            return {};
+        }
+        offset = m_eh_frame_hdr_bases.data + table[2 * lo - 1] - m_eh_frame->header->sh_addr;
+    } else {
+        build_fde_index();
+        auto it = std::upper_bound(m_fde_starts.begin(), m_fde_starts.end(), addr);
+        if (it == m_fde_starts.begin()) {
+            return {};
+        }
+        offset = m_fde_offsets[it - m_fde_starts.begin() - 1];
+    }
+    if (offset >= m_eh_frame->bytes.size()) {
+        return {};
+    }
+    const auto* p = m_eh_frame->bytes.data() + offset;
+    auto fde = DWARF::parse_eh_frame_entry(p, m_eh_frame_bases, m_cies);
+    if (fde && addr - fde->initial_location < fde->address_range) {
+        return fde;
+    }
+    return {};
+}
+
+void ELF::parse_eh_frame_hdr() {
+    const auto* hdr = section(".eh_frame_hdr");
+    if (!hdr || hdr->bytes.size() < 4) {
+        return;
+    }
+    const auto* p = hdr->bytes.data();
+    const auto* end = p + hdr->bytes.size();
+    auto version = p[0], eh_frame_ptr_encoding = p[1], count_encoding = p[2], table_encoding = p[3];
+    p += 4;
+    if (version != 1 || count_encoding == DW_EH_PE_omit || table_encoding == DW_EH_PE_omit) {
+        return;
+    }
+    m_eh_frame_hdr_bases.section_start = hdr->bytes.data();
+    m_eh_frame_hdr_bases.section_vaddr = hdr->header->sh_addr;
+    m_eh_frame_hdr_bases.data = hdr->header->sh_addr;
+    DWARF::read_encoded_value(p, m_eh_frame_hdr_bases, eh_frame_ptr_encoding);
+    m_eh_frame_hdr_count = DWARF::read_encoded_value(p, m_eh_frame_hdr_bases, count_encoding);
+    m_eh_frame_hdr_table = p;
+    m_eh_frame_hdr_encoding = table_encoding;
+    if (table_encoding == (DW_EH_PE_datarel | DW_EH_PE_sdata4) &&
+        m_eh_frame_hdr_count > static_cast<size_t>(end - p) / (2 * sizeof(int32_t))) {
+        m_eh_frame_hdr_table = nullptr;
+    }
+}
+
+void ELF::build_fde_index() const {
+    if (m_fde_index_built) {
+        return;
+    }
+    m_fde_index_built = true;
+    std::vector<std::pair<uint64_t, uint64_t>> entries;
+    if (m_eh_frame_hdr_table) {
+        // An unusual table encoding: decode it once, it is already sorted.
+        const auto* p = m_eh_frame_hdr_table;
+        for (size_t i = 0; i < m_eh_frame_hdr_count; ++i) {
+            auto start = DWARF::read_encoded_value(p, m_eh_frame_hdr_bases, m_eh_frame_hdr_encoding);
+            auto fde = DWARF::read_encoded_value(p, m_eh_frame_hdr_bases, m_eh_frame_hdr_encoding);
+            entries.emplace_back(start, fde - m_eh_frame->header->sh_addr);
+        }
+    } else {
+        const auto* begin = m_eh_frame->bytes.data();
+        const auto* p = begin;
+        const auto* end = p + m_eh_frame->bytes.size();
+        while (p < end) {
+            uint64_t offset = p - begin;
+            if (auto fde = DWARF::parse_eh_frame_entry(p, m_eh_frame_bases, m_cies)) {
+                entries.emplace_back(fde->initial_location, offset);
+            }
+        }
+        std::sort(entries.begin(), entries.end());
+    }
+    m_fde_starts.reserve(entries.size());
+    m_fde_offsets.reserve(entries.size());
+    for (const auto& [start, offset] : entries) {
+        m_fde_starts.push_back(start);
+        m_fde_offsets.push_back(offset);
+    }
+}
+
+void ELF::index_sections() {
+    m_sections.reserve(m_shnum);
     for (size_t i = 0; i < m_shnum; ++i) {
-        auto* shdr = m_shdrs + i;
-        const char* sh_name = m_shstrtab + shdr->sh_name;
-        if (strcmp(name, sh_name) == 0) {
-            return shdr;
+        const auto* shdr = m_shdrs + i;
+        std::span<const uint8_t> bytes;
+        if (shdr->sh_type != SHT_NOBITS && shdr->sh_type != SHT_NULL) {
+            util::throw_assert(shdr->sh_offset <= m_filesize && shdr->sh_size <= m_filesize - shdr->sh_offset,
+                               "section extends past the end of the file");
+            bytes = {m_file + shdr->sh_offset, shdr->sh_size};
+        }
+        bool compressed = (shdr->sh_flags & SHF_COMPRESSED) ||
+                          std::string_view(m_shstrtab + shdr->sh_name).starts_with(".zdebug_");
+        m_sections.push_back({shdr, bytes, compressed && !bytes.empty()});
+    }
+    // Built in a second pass so the pointers into m_sections are stable. The first section of a name wins.
+    m_sections_by_name.reserve(m_shnum);
+    for (const auto& sec : m_sections) {
+        m_sections_by_name.emplace(m_shstrtab + sec.header->sh_name, &sec);
+        m_sections_by_type[sec.header->sh_type].push_back(&sec);
+    }
+}
+
+void ELF::start_symbol_load(ThreadPool& pool, bool verbose) const {
+    if (m_symbols_loaded || m_symbol_load) {
+        return;
+    }
+    auto load = std::make_shared<SymbolLoad>();
+
+    // The index is cached on disk under the build ID, falling back to the file's identity for binaries without one.
+    std::string key, cache_path;
+    auto cache_dir = symbol_cache_dir();
+    if (auto id = build_id()) {
+        key = "build-id:" + *id;
+        if (cache_dir) cache_path = *cache_dir + "/" + *id + ".symidx";
+    } else {
+        char buf[512];
+        char* real = realpath(m_path.c_str(), nullptr);
+        snprintf(buf, sizeof(buf), "file:%s:%zu:%ld.%09ld", real ? real : m_path.c_str(), m_filesize, m_mtime.tv_sec,
+                 m_mtime.tv_nsec);
+        free(real);
+        key = buf;
+        if (cache_dir) {
+            snprintf(buf, sizeof(buf), "/file-%016zx.symidx", std::hash<std::string>{}(key));
+            cache_path = *cache_dir + buf;
+        }
+    }
+    if (!cache_path.empty() && load->index.load(cache_path, key)) {
+        load->cached = true;
+        std::promise<void> done;
+        done.set_value();
+        load->done = done.get_future().share();
+        m_symbol_load = std::move(load);
+        return;
+    }
+
+    // Each chunk of a symbol table is filtered on its own worker. The merge task is queued after all of them, so by
+    // the time it runs every chunk has been picked up and waiting on them cannot deadlock the pool.
+    std::vector<std::future<std::vector<SymbolIndex::Symbol>>> chunks;
+    const auto* file = m_file;
+    auto collect_syms = [&](const char* symtab_name, const char* strtab_name) {
+        const auto* symtab_sec = section(symtab_name);
+        if (!symtab_sec) {
+            if (verbose) printf("No %s section found\n", symtab_name);
+            return;
+        }
+        const auto* symtab_shdr = symtab_sec->header;
+        util::throw_assert(symtab_shdr->sh_entsize == sizeof(Elf64_Sym), "symbol table has unexpected entry size");
+        util::throw_assert(symtab_shdr->sh_type == SHT_SYMTAB || symtab_shdr->sh_type == SHT_DYNSYM);
+        const auto* strtab_sec = section(strtab_name);
+        util::throw_assert(strtab_sec, "symbol table has no corresponding string table");
+        util::throw_assert(strtab_sec->header->sh_type == SHT_STRTAB);
+
+        auto syms = symtab_sec->as<Elf64_Sym>();
+        const auto* symtab = syms.data();
+        uint64_t strtab = strtab_sec->header->sh_offset;
+        size_t count = syms.size();
+        for (size_t first = 0; first < count; first += SYMBOL_CHUNK) {
+            size_t last = std::min(count, first + SYMBOL_CHUNK);
+            chunks.push_back(pool.submit([symtab, strtab, first, last] {
+                std::vector<SymbolIndex::Symbol> syms;
+                for (size_t i = first; i < last; ++i) {
+                    const auto* sym = symtab + i;
+                    if (ELF64_ST_TYPE(sym->st_info) == STT_FUNC && sym->st_shndx != SHN_UNDEF) {
+                        syms.push_back({sym->st_value, sym->st_size, strtab + sym->st_name,
+                                        static_cast<uint8_t>(ELF64_ST_BIND(sym->st_info))});
+                    }
+                }
+                return syms;
+            }));
         }
+    };
+    collect_syms(".symtab", ".strtab");
+    collect_syms(".dynsym", ".dynstr");
+
+    auto shared_chunks = std::make_shared<decltype(chunks)>(std::move(chunks));
+    load->done = pool.submit([load, shared_chunks, file, cache_path, key] {
+                         // Chunks are merged in table order so the first definition of a name still wins.
+                         for (auto& chunk : *shared_chunks) {
+                             for (const auto& sym : chunk.get()) {
+                                 load->index.add(sym);
+                             }
+                         }
+                         load->index.finish(reinterpret_cast<const char*>(file));
+                         if (!cache_path.empty()) {
+                             load->index.save(cache_path, key);
+                         }
+                     })
+                     .share();
+    m_symbol_load = std::move(load);
+}
+
+void ELF::load_symbols(bool verbose) const {
+    if (m_symbols_loaded) {
+        return;
+    }
+    start_symbol_load(ThreadPool::global(), verbose);
+    m_symbol_load->done.get();
+    m_sym_index = std::move(m_symbol_load->index);
+    if (verbose) {
+        printf("%zu symbols loaded from %s%s\n", m_sym_index.name_count(), m_path.c_str(),
+               m_symbol_load->cached ? " (cached)" : "");
     }
-    return nullptr;
+    m_symbol_load.reset();
+    m_symbols_loaded = true;
 }
 
-void ELF::parse(const char* filename) {
+void ELF::parse(const char* filename, bool lazy_symbols) {
     int fd = util::throw_errno(open(filename, O_RDONLY));
 
     struct stat sb;
@@ -96,47 +674,38 @@ void ELF::parse(const char* filename) {
     util::throw_assert(ehdr->e_shentsize == sizeof(Elf64_Shdr), "wrong shdr size");
 
     m_shdrs = reinterpret_cast<Elf64_Shdr*>(m_file + ehdr->e_shoff);
+    m_phnum = ehdr->e_phnum;
+    m_phdrs = reinterpret_cast<Elf64_Phdr*>(m_file + ehdr->e_phoff);
     auto* shdr_shstrtab = m_shdrs + ehdr->e_shstrndx;
     util::throw_assert(shdr_shstrtab->sh_type == SHT_STRTAB, "shstrtab is not a string table");
     m_shstrtab = reinterpret_cast<char*>(m_file + shdr_shstrtab->sh_offset);
+    index_sections();
 
-    auto collect_syms = [this](const char* symtab_name, const char* strtab_name) {
-        auto* symtab_shdr = find_section(symtab_name);
-        if (!symtab_shdr) {
-            printf("No %s section found\n", symtab_name);
-            return;
+    // Exported symbols can be looked up in place through the file's own hash tables, without building anything.
+    for (uint32_t type : {SHT_GNU_HASH, SHT_HASH}) {
+        for (const auto* sec : sections(type)) {
+            const auto& dynsym_shdr = m_shdrs[sec->header->sh_link];
+            const auto* table = sec->as<uint32_t>().data();
+            (type == SHT_GNU_HASH ? m_gnu_hash : m_sysv_hash) = table;
+            m_dynsym = reinterpret_cast<const Elf64_Sym*>(m_file + dynsym_shdr.sh_offset);
+            m_dynstr = reinterpret_cast<const char*>(m_file + m_shdrs[dynsym_shdr.sh_link].sh_offset);
         }
-        util::throw_assert(symtab_shdr->sh_entsize == sizeof(Elf64_Sym), "symbol table has unexpected entry size");
-        util::throw_assert(symtab_shdr->sh_type == SHT_SYMTAB || symtab_shdr->sh_type == SHT_DYNSYM);
-        auto* strtab_shdr = find_section(strtab_name);
-        util::throw_assert(strtab_shdr, "symbol table has no corresponding string table");
-        util::throw_assert(strtab_shdr->sh_type == SHT_STRTAB);
-
-        auto* symtab = reinterpret_cast<Elf64_Sym*>(m_file + symtab_shdr->sh_offset);
-        auto* strtab = reinterpret_cast<char*>(m_file + strtab_shdr->sh_offset);
-        for (size_t i = 0; i < symtab_shdr->sh_size / sizeof(Elf64_Sym); ++i) {
-            auto* sym = symtab + i;
-            if (ELF64_ST_TYPE(sym->st_info) == STT_FUNC && sym->st_shndx != SHN_UNDEF) {
-                m_syms.emplace(strtab + sym->st_name, sym->st_value);
-            }
-        }
-    };
-
-    collect_syms(".symtab", ".strtab");
-    collect_syms(".dynsym", ".dynstr");
-    printf("%zu symbols loaded from %s\n", m_syms.size(), filename);
+    }
+    m_has_symtab = section(".symtab") != nullptr;
+    m_mtime = sb.st_mtim;
+    if (!lazy_symbols) {
+        load_symbols(true);
+    }
 
-    auto* eh_frame_shdr = find_section(".eh_frame");
-    if (!eh_frame_shdr) {
+    m_eh_frame = section(".eh_frame");
+    if (!m_eh_frame) {
         puts("No .eh_frame section found");
     } else {
-#if 0
-        auto* eh_frame = m_file + eh_frame_shdr->sh_offset;
-        size_t eh_frame_size = eh_frame_shdr->sh_size;
-        const auto* p = eh_frame;
-        std::unordered_map<size_t, DWARF::CIE> cie_map;
-        while (p < eh_frame + eh_frame_size) DWARF::parse_eh_frame_entry(p, eh_frame, eh_frame_shdr->sh_addr, cie_map);
-#endif
+        m_eh_frame_bases.section_start = m_eh_frame->bytes.data();
+        m_eh_frame_bases.section_vaddr = m_eh_frame->header->sh_addr;
+        if (const auto* text = section(".text")) m_eh_frame_bases.text = text->header->sh_addr;
+        if (const auto* got = section(".got")) m_eh_frame_bases.data = got->header->sh_addr;
+        parse_eh_frame_hdr();
     }
 
     close(fd);
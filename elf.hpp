@@ -2,15 +2,46 @@
 
 #include <elf.h>
 #include <stdint.h>
+#include <time.h>
 
+#include <future>
+#include <initializer_list>
+#include <memory>
 #include <optional>
+#include <span>
+#include <string>
 #include <string_view>
 #include <unordered_map>
 #include <utility>
+#include <vector>
+
+#include "debuginfo.hpp"
+#include "dwarf.hpp"
+#include "lines.hpp"
+#include "symtab.hpp"
+#include "threadpool.hpp"
+
+// A section header together with its bytes in the mapped file. SHT_NOBITS sections have no bytes.
+struct Section {
+    const Elf64_Shdr* header;
+    std::span<const uint8_t> bytes;
+    // Set for SHF_COMPRESSED and legacy .zdebug_* sections: `bytes` is then the compressed form, and the contents
+    // must be read through ELF::debug_section.
+    bool compressed = false;
+
+    // Views the section as an array of T, dropping any trailing partial element.
+    template <typename T>
+    std::span<const T> as() const {
+        return {reinterpret_cast<const T*>(bytes.data()), bytes.size() / sizeof(T)};
+    }
+};
 
 class ELF {
    public:
-    explicit ELF(const char* filename, uint64_t base = 0);
+    // Construction only maps the file and indexes its headers. Without `lazy_symbols` the symbol index is then loaded
+    // right away; otherwise it is only waited for once an address lookup, or a name lookup the dynamic hash tables
+    // cannot answer, needs it.
+    explicit ELF(const char* filename, uint64_t base = 0, bool lazy_symbols = false);
     ELF(const ELF& other) = delete;
     ELF& operator=(const ELF& other) = delete;
     ELF(ELF&& other) { *this = std::move(other); }
@@ -20,18 +51,98 @@ class ELF {
     void set_base_from_entry(uint64_t entry) { m_base = entry - m_entry; }
     std::optional<std::string_view> interp() const;
     std::optional<uint64_t> lookup_sym(std::string_view name) const;
-    std::optional<std::string_view> lookup_addr(uint64_t addr) const;
+    std::optional<SymbolMatch> lookup_addr(uint64_t addr) const;
+    const std::string& path() const { return m_path; }
+    // Returns the (p_vaddr, p_memsz) pairs of the PT_LOAD segments, relative to base().
+    std::vector<std::pair<uint64_t, uint64_t>> load_segments() const;
+    // Returns the function symbols, with addresses relative to base().
+    const SymbolIndex& symbols() const;
+    bool symbols_loaded() const { return m_symbols_loaded; }
+    // Starts loading the symbol index in the background: from the on-disk cache if possible, otherwise by filtering
+    // the symbol tables in parallel chunks on `pool`. Lookups must still happen on a single thread.
+    void start_symbol_load(ThreadPool& pool, bool verbose = false) const;
+    // Looks up an exported function through DT_GNU_HASH or DT_HASH, straight from the mapped file.
+    std::optional<uint64_t> lookup_dynsym(std::string_view name) const;
+    // Returns the hex NT_GNU_BUILD_ID note, if the file has one.
+    std::optional<std::string> build_id() const;
+    // Returns the first section called `name`, or nullptr. Both lookups use the directory built at parse time.
+    const Section* section(std::string_view name) const;
+    // Returns all sections of the given SHT_* type, in header order.
+    std::span<const Section* const> sections(uint32_t type) const;
+    // Returns the contents of a DWARF section such as ".debug_info", decompressing it on first use if it is stored
+    // compressed (zlib or zstd, or as the legacy ".zdebug_info"). Empty if the file has no such section.
+    std::span<const uint8_t> debug_section(std::string_view name) const;
+    // Decompresses the named sections that are compressed and not yet cached, one task per section on `pool`.
+    void decompress_sections(std::initializer_list<std::string_view> names, ThreadPool& pool) const;
+    // Returns the line table, decoding .debug_line in parallel on first use. Addresses are relative to base().
+    const LineTable& lines() const;
+    // Returns the source position of `addr`, an absolute address.
+    std::optional<SourceLocation> lookup_line(uint64_t addr) const;
+    // Returns the absolute addresses where code for `file:line` starts. See LineTable::find.
+    std::vector<uint64_t> find_line(std::string_view file, uint32_t line) const;
+    // Returns the .debug_info reader, created on first use. It parses DIEs lazily, so it is not const.
+    DebugInfo& debug_info() const;
+    // Returns the .eh_frame FDE covering `addr`, relative to base(), by binary search over .eh_frame_hdr or, without
+    // one, over a sorted index of the FDEs built on first use.
+    std::optional<DWARF::FDE> find_fde(uint64_t addr) const;
+    // The bases FDEs from find_fde were decoded with, for DWARF::execute_cfi.
+    const DWARF::PointerBases& eh_frame_bases() const { return m_eh_frame_bases; }
 
    private:
-    Elf64_Shdr* find_section(const char* name) const;
-    void parse(const char* filename);
+    void index_sections();
+    // Finds ".debug_foo" or, failing that, its legacy compressed form ".zdebug_foo".
+    const Section* find_debug_section(std::string_view name) const;
+    void parse_eh_frame_hdr();
+    void build_fde_index() const;
+    void parse(const char* filename, bool lazy_symbols);
+    // Finishes loading the symbol index, starting the load first if nobody has.
+    void load_symbols(bool verbose) const;
+
+    static constexpr size_t SYMBOL_CHUNK = 1 << 16;
+
+    // A symbol index being loaded in the background, kept off the ELF object itself so the ELF can move meanwhile.
+    struct SymbolLoad {
+        std::shared_future<void> done;
+        SymbolIndex index;
+        bool cached = false;
+    };
 
+    std::string m_path;
     uint64_t m_base;
     uint8_t* m_file;
     size_t m_filesize;
     size_t m_shnum;
     Elf64_Shdr* m_shdrs;
+    size_t m_phnum;
+    Elf64_Phdr* m_phdrs;
     const char* m_shstrtab;
+    std::vector<Section> m_sections;
+    std::unordered_map<std::string_view, const Section*> m_sections_by_name;
+    std::unordered_map<uint32_t, std::vector<const Section*>> m_sections_by_type;
     uint64_t m_entry;
-    std::unordered_map<std::string_view, uint64_t> m_syms;
+    timespec m_mtime;
+    const Section* m_eh_frame = nullptr;
+    DWARF::PointerBases m_eh_frame_bases;
+    mutable std::unordered_map<uint64_t, DWARF::CIE> m_cies;
+    // The .eh_frame_hdr search table: (initial location, FDE address) pairs in m_eh_frame_hdr_encoding.
+    const uint8_t* m_eh_frame_hdr_table = nullptr;
+    size_t m_eh_frame_hdr_count = 0;
+    uint8_t m_eh_frame_hdr_encoding = 0;
+    DWARF::PointerBases m_eh_frame_hdr_bases;
+    // Sorted FDE start addresses and their .eh_frame offsets, for tables that cannot be searched in place.
+    mutable std::vector<uint64_t> m_fde_starts;
+    mutable std::vector<uint64_t> m_fde_offsets;
+    mutable bool m_fde_index_built = false;
+    // Decompressed section contents, each in its own anonymous mapping, released with the ELF.
+    mutable std::unordered_map<const Section*, std::span<uint8_t>> m_decompressed;
+    mutable std::unique_ptr<LineTable> m_lines;
+    mutable std::unique_ptr<DebugInfo> m_debug_info;
+    mutable SymbolIndex m_sym_index;
+    mutable bool m_symbols_loaded = false;
+    mutable std::shared_ptr<SymbolLoad> m_symbol_load;
+    bool m_has_symtab = false;
+    const uint32_t* m_gnu_hash = nullptr;
+    const uint32_t* m_sysv_hash = nullptr;
+    const Elf64_Sym* m_dynsym = nullptr;
+    const char* m_dynstr = nullptr;
 };
@@ -0,0 +1,352 @@
+#include "lines.hpp"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <future>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "dwarf.hpp"
+#include "dwarf2.h"
+#include "threadpool.hpp"
+#include "util.hpp"
+
+namespace {
+using DWARF::read;
+using DWARF::read_leb128;
+using DWARF::read_length;
+using DWARF::read_uleb128;
+
+// Units are handed to the pool in batches of about this many bytes of line programs.
+constexpr size_t BATCH_BYTES = 1 << 16;
+
+// The rows of one line program, with file indexes into its own file table.
+struct UnitRows {
+    std::vector<std::string> files;
+    std::vector<std::pair<uint64_t, LineTable::Row>> rows;
+};
+
+std::string join_path(std::string_view dir, std::string_view name) {
+    if (dir.empty() || name.starts_with('/')) {
+        return std::string(name);
+    }
+    std::string path(dir);
+    if (!path.ends_with('/')) path += '/';
+    path += name;
+    return path;
+}
+
+std::string_view read_string_at(std::span<const uint8_t> section, uint64_t offset) {
+    util::throw_assert(offset < section.size(), "string offset out of range");
+    const auto* s = reinterpret_cast<const char*>(section.data() + offset);
+    return {s, strnlen(s, section.size() - offset)};
+}
+
+// Reads one attribute of a DWARF 5 directory or file entry. Strings are returned through `str`, numbers through the
+// return value.
+uint64_t read_entry_attribute(const uint8_t*& p, uint64_t form, bool is_dwarf64, const LineSections& sections,
+                              std::string_view& str) {
+    switch (form) {
+        case DW_FORM_string: {
+            str = reinterpret_cast<const char*>(p);
+            p += str.size() + 1;
+            return 0;
+        }
+        case DW_FORM_line_strp:
+        case DW_FORM_strp: {
+            uint64_t offset = is_dwarf64 ? read<uint64_t>(p) : read<uint32_t>(p);
+            str = read_string_at(form == DW_FORM_line_strp ? sections.debug_line_str : sections.debug_str, offset);
+            return 0;
+        }
+        case DW_FORM_udata:
+            return read_uleb128(p);
+        case DW_FORM_data1:
+            return read<uint8_t>(p);
+        case DW_FORM_data2:
+            return read<uint16_t>(p);
+        case DW_FORM_data4:
+            return read<uint32_t>(p);
+        case DW_FORM_data8:
+            return read<uint64_t>(p);
+        case DW_FORM_data16:
+            p += 16;
+            return 0;
+        case DW_FORM_block: {
+            auto n = read_uleb128(p);
+            p += n;
+            return 0;
+        }
+        default:
+            util::throw_assert(false, "unsupported form in line table header");
+            __builtin_unreachable();
+    }
+}
+
+// Reads a DWARF 5 directory or file name table, calling `sink(path, directory index)` for each entry.
+template <typename Sink>
+void read_entry_table(const uint8_t*& p, bool is_dwarf64, const LineSections& sections, Sink&& sink) {
+    std::vector<std::pair<uint64_t, uint64_t>> formats(*p++);
+    for (auto& [type, form] : formats) {
+        type = read_uleb128(p);
+        form = read_uleb128(p);
+    }
+    auto count = read_uleb128(p);
+    for (uint64_t i = 0; i < count; ++i) {
+        std::string_view path;
+        uint64_t dir = 0;
+        for (auto [type, form] : formats) {
+            std::string_view str;
+            auto value = read_entry_attribute(p, form, is_dwarf64, sections, str);
+            if (type == DW_LNCT_path) path = str;
+            if (type == DW_LNCT_directory_index) dir = value;
+        }
+        sink(path, dir);
+    }
+}
+
+// Runs the line program of the unit at `p`, which must end at `unit_end`.
+UnitRows decode_unit(const uint8_t* p, const uint8_t* unit_end, const LineSections& sections) {
+    UnitRows unit;
+    bool is_dwarf64;
+    read_length(p, is_dwarf64);
+    auto version = read<uint16_t>(p);
+    util::throw_assert(version >= 2 && version <= 5, "unsupported .debug_line version");
+    if (version >= 5) {
+        auto address_size = *p++;
+        auto segment_size = *p++;
+        util::throw_assert(address_size == 8 && segment_size == 0, "unsupported .debug_line address size");
+    }
+    uint64_t header_length = is_dwarf64 ? read<uint64_t>(p) : read<uint32_t>(p);
+    const auto* program = p + header_length;
+    uint8_t min_inst_length = *p++;
+    if (version >= 4) ++p;  // maximum_operations_per_instruction, only meaningful for VLIW
+    bool default_is_stmt = *p++;
+    auto line_base = static_cast<int8_t>(*p++);
+    uint8_t line_range = *p++;
+    uint8_t opcode_base = *p++;
+    util::throw_assert(line_range != 0 && opcode_base != 0, "malformed .debug_line header");
+    const auto* opcode_lengths = p;
+    p += opcode_base - 1;
+
+    std::vector<std::string> dirs;
+    if (version >= 5) {
+        read_entry_table(p, is_dwarf64, sections, [&](std::string_view path, uint64_t) { dirs.emplace_back(path); });
+        read_entry_table(p, is_dwarf64, sections, [&](std::string_view path, uint64_t dir) {
+            unit.files.push_back(join_path(dir < dirs.size() ? dirs[dir] : "", path));
+        });
+    } else {
+        // Directory 0 is the compilation directory, which the header does not record. Files count from 1.
+        dirs.emplace_back();
+        while (*p) {
+            const auto* dir = reinterpret_cast<const char*>(p);
+            dirs.emplace_back(dir);
+            p += strlen(dir) + 1;
+        }
+        ++p;
+        unit.files.emplace_back();
+        while (*p) {
+            const auto* name = reinterpret_cast<const char*>(p);
+            p += strlen(name) + 1;
+            auto dir = read_uleb128(p);
+            read_uleb128(p);
+            read_uleb128(p);
+            unit.files.push_back(join_path(dir < dirs.size() ? dirs[dir] : "", name));
+        }
+    }
+
+    p = program;
+    uint64_t address = 0;
+    uint32_t file = 1, line = 1, column = 0;
+    bool is_stmt = default_is_stmt;
+    // Sequences of code the linker discarded are left at address 0 or a tombstone and must not shadow live code.
+    bool dead = false;
+    std::optional<std::pair<uint32_t, uint32_t>> prev_line;
+    auto emit = [&](bool end_sequence) {
+        if (dead) return;
+        uint8_t flags = (is_stmt ? LineTable::IS_STMT : 0) | (end_sequence ? LineTable::END_SEQUENCE : 0);
+        std::pair<uint32_t, uint32_t> cur{file, line};
+        if (is_stmt && !end_sequence && prev_line != cur) {
+            flags |= LineTable::LINE_START;
+        }
+        prev_line = cur;
+        unit.rows.push_back({address, {file, line, static_cast<uint16_t>(column), flags}});
+    };
+    auto reset = [&]() {
+        address = 0;
+        file = 1;
+        line = 1;
+        column = 0;
+        is_stmt = default_is_stmt;
+        dead = false;
+        prev_line.reset();
+    };
+
+    while (p < unit_end) {
+        uint8_t op = *p++;
+        if (op >= opcode_base) {
+            uint8_t adjusted = op - opcode_base;
+            address += (adjusted / line_range) * min_inst_length;
+            line += line_base + adjusted % line_range;
+            emit(false);
+            continue;
+        }
+        switch (op) {
+            case DW_LNS_extended_op: {
+                auto len = read_uleb128(p, unit_end);
+                util::throw_assert(len <= static_cast<uint64_t>(unit_end - p), "line table opcode overruns its unit");
+                const auto* next = p + len;
+                if (len == 0) break;
+                switch (*p++) {
+                    case DW_LNE_end_sequence:
+                        emit(true);
+                        reset();
+                        break;
+                    case DW_LNE_set_address:
+                        address = read<uint64_t>(p);
+                        dead = address == 0 || address >= UINT64_MAX - 1;
+                        break;
+                }
+                p = next;
+                break;
+            }
+            case DW_LNS_copy:
+                emit(false);
+                break;
+            case DW_LNS_advance_pc:
+                address += read_uleb128(p, unit_end) * min_inst_length;
+                break;
+            case DW_LNS_advance_line:
+                line += read_leb128(p, unit_end);
+                break;
+            case DW_LNS_set_file:
+                file = read_uleb128(p, unit_end);
+                break;
+            case DW_LNS_set_column:
+                column = read_uleb128(p, unit_end);
+                break;
+            case DW_LNS_negate_stmt:
+                is_stmt = !is_stmt;
+                break;
+            case DW_LNS_const_add_pc:
+                address += ((255 - opcode_base) / line_range) * min_inst_length;
+                break;
+            case DW_LNS_fixed_advance_pc:
+                address += read<uint16_t>(p);
+                break;
+            default:
+                // Opcodes without effect on the rows we keep, or unknown ones: skip their ULEB operands.
+                for (uint8_t i = 0; i < opcode_lengths[op - 1]; ++i) {
+                    read_uleb128(p, unit_end);
+                }
+                break;
+        }
+    }
+    return unit;
+}
+}  // namespace
+
+LineTable LineTable::build(const LineSections& sections, ThreadPool& pool) {
+    // Only the unit lengths are read up front; everything else is decoded on the pool.
+    std::vector<std::future<std::vector<UnitRows>>> batches;
+    const auto* begin = sections.debug_line.data();
+    const auto* end = begin + sections.debug_line.size();
+    const auto* p = begin;
+    while (p < end) {
+        std::vector<std::pair<const uint8_t*, const uint8_t*>> units;
+        const auto* batch_start = p;
+        while (p < end && static_cast<size_t>(p - batch_start) < BATCH_BYTES) {
+            const auto* unit = p;
+            bool is_dwarf64;
+            auto len = read_length(p, is_dwarf64);
+            util::throw_assert(len <= static_cast<uint64_t>(end - p), "line table unit extends past its section");
+            p += len;
+            units.emplace_back(unit, p);
+        }
+        batches.push_back(pool.submit([units = std::move(units), sections] {
+            std::vector<UnitRows> decoded;
+            for (auto [unit, unit_end] : units) {
+                decoded.push_back(decode_unit(unit, unit_end, sections));
+            }
+            return decoded;
+        }));
+    }
+
+    // Merge in unit order, mapping each unit's file table onto one deduplicated table.
+    LineTable table;
+    std::unordered_map<std::string, uint32_t> file_ids;
+    std::vector<std::pair<uint64_t, Row>> rows;
+    for (auto& batch : batches) {
+        for (auto& unit : batch.get()) {
+            std::vector<uint32_t> ids(unit.files.size());
+            for (size_t i = 0; i < unit.files.size(); ++i) {
+                auto [it, inserted] = file_ids.emplace(std::move(unit.files[i]), table.m_files.size());
+                if (inserted) table.m_files.push_back(it->first);
+                ids[i] = it->second;
+            }
+            for (auto& [addr, row] : unit.rows) {
+                if (row.file >= ids.size()) continue;
+                row.file = ids[row.file];
+                rows.emplace_back(addr, row);
+            }
+        }
+    }
+
+    // At an address where one sequence ends and another begins, the end row sorts first so lookups see the start.
+    std::stable_sort(rows.begin(), rows.end(), [](const auto& a, const auto& b) {
+        bool a_end = a.second.flags & END_SEQUENCE, b_end = b.second.flags & END_SEQUENCE;
+        return a.first < b.first || (a.first == b.first && a_end > b_end);
+    });
+    table.m_addrs.reserve(rows.size());
+    table.m_rows.reserve(rows.size());
+    table.m_max_lines.assign(table.m_files.size(), 0);
+    for (const auto& [addr, row] : rows) {
+        if (row.flags & LINE_START) {
+            table.m_by_line[line_key(row.file, row.line)].push_back(table.m_rows.size());
+            table.m_max_lines[row.file] = std::max(table.m_max_lines[row.file], row.line);
+        }
+        table.m_addrs.push_back(addr);
+        table.m_rows.push_back(row);
+    }
+    return table;
+}
+
+std::optional<SourceLocation> LineTable::lookup(uint64_t addr) const {
+    auto it = std::upper_bound(m_addrs.begin(), m_addrs.end(), addr);
+    if (it == m_addrs.begin()) {
+        return {};
+    }
+    const auto& row = m_rows[it - m_addrs.begin() - 1];
+    if (row.flags & END_SEQUENCE) {
+        return {};
+    }
+    return SourceLocation{m_files[row.file], row.line, row.column};
+}
+
+std::vector<uint64_t> LineTable::find(std::string_view file, uint32_t line) const {
+    std::vector<uint64_t> addrs;
+    for (uint32_t id = 0; id < m_files.size(); ++id) {
+        std::string_view path = m_files[id];
+        if (path != file && !(path.ends_with(file) && path[path.size() - file.size() - 1] == '/')) {
+            continue;
+        }
+        for (uint32_t l = line; l <= m_max_lines[id]; ++l) {
+            auto it = m_by_line.find(line_key(id, l));
+            if (it == m_by_line.end()) {
+                continue;
+            }
+            for (auto row : it->second) {
+                addrs.push_back(m_addrs[row]);
+            }
+            break;
+        }
+    }
+    std::sort(addrs.begin(), addrs.end());
+    addrs.erase(std::unique(addrs.begin(), addrs.end()), addrs.end());
+    return addrs;
+}
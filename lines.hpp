@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "threadpool.hpp"
+
+// A source position. `file` points into the LineTable it came from.
+struct SourceLocation {
+    std::string_view file;
+    uint32_t line;
+    uint32_t column;
+};
+
+// The raw sections a line table is decoded from. The string sections are only used by DWARF 5 headers.
+struct LineSections {
+    std::span<const uint8_t> debug_line;
+    std::span<const uint8_t> debug_line_str;
+    std::span<const uint8_t> debug_str;
+};
+
+// A module's .debug_line programs, run into one address-sorted row table. Rows are packed parallel arrays so the
+// binary search only touches the addresses; a hash over (file, line) answers the reverse lookup.
+class LineTable {
+   public:
+    // Decodes every line program (DWARF 2 to 5), in batches of units on `pool`, and merges the rows.
+    static LineTable build(const LineSections& sections, ThreadPool& pool);
+
+    // Returns the row covering `addr`.
+    std::optional<SourceLocation> lookup(uint64_t addr) const;
+    // Returns the addresses where code for `line` starts, in every file matching `file`: a whole path or any suffix of
+    // it that starts after a '/'. A line without code resolves to the next line in the file that has some.
+    std::vector<uint64_t> find(std::string_view file, uint32_t line) const;
+    size_t size() const { return m_addrs.size(); }
+
+    struct Row {
+        uint32_t file;
+        uint32_t line;
+        uint16_t column;
+        uint8_t flags;
+    };
+    static constexpr uint8_t IS_STMT = 1;
+    static constexpr uint8_t END_SEQUENCE = 2;
+    // The first statement row of a run of rows for the same line.
+    static constexpr uint8_t LINE_START = 4;
+
+   private:
+    static uint64_t line_key(uint32_t file, uint32_t line) { return static_cast<uint64_t>(file) << 32 | line; }
+
+    std::vector<uint64_t> m_addrs;
+    std::vector<Row> m_rows;
+    std::vector<std::string> m_files;
+    std::vector<uint32_t> m_max_lines;
+    // Indexes of the LINE_START rows for each (file, line).
+    std::unordered_map<uint64_t, std::vector<uint32_t>> m_by_line;
+};
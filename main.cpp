@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <system_error>
 
@@ -12,6 +13,9 @@ int main(int argc, char* argv[], char* envp[]) {
     }
 
     Tracee proc(argv[1]);
+    if (const char* limit = getenv("CYDBG_STACK_SNAPSHOT")) {
+        proc.set_stack_snapshot_limit(strtoul(limit, nullptr, 0));
+    }
     Operation op(proc);
 
     try {
@@ -0,0 +1,39 @@
+#include "memcache.hpp"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+
+const PageCache::Page* PageCache::find(uint64_t page) const {
+    auto it = m_pages.find(page);
+    return it == m_pages.end() ? nullptr : it->second.get();
+}
+
+void PageCache::insert(uint64_t page, const uint8_t* data) {
+    if (m_pages.size() >= MAX_PAGES) {
+        m_pages.clear();
+    }
+    auto& slot = m_pages[page];
+    if (!slot) {
+        slot = std::make_unique<Page>();
+    }
+    memcpy(slot->data(), data, PAGE_BYTES);
+}
+
+void PageCache::update(uint64_t addr, const void* data, size_t sz) {
+    const auto* p = static_cast<const uint8_t*>(data);
+    while (sz > 0) {
+        uint64_t page = page_of(addr);
+        size_t off = addr - page;
+        size_t n = std::min(sz, PAGE_BYTES - off);
+        auto it = m_pages.find(page);
+        if (it != m_pages.end()) {
+            memcpy(it->second->data() + off, p, n);
+        }
+        addr += n;
+        p += n;
+        sz -= n;
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <array>
+#include <memory>
+#include <unordered_map>
+
+// Page-granular cache of tracee memory. It is only valid while the tracee is stopped, so the owner must clear it
+// before resuming the child and keep it coherent by writing through any modifications.
+class PageCache {
+   public:
+    static constexpr size_t PAGE_BYTES = 0x1000;
+    // Upper bound on the number of cached pages before the cache is dropped wholesale.
+    static constexpr size_t MAX_PAGES = 1024;
+
+    using Page = std::array<uint8_t, PAGE_BYTES>;
+
+    static uint64_t page_of(uint64_t addr) { return addr & ~(PAGE_BYTES - 1); }
+
+    // Returns the cached contents of the page starting at `page`, or nullptr on a miss.
+    const Page* find(uint64_t page) const;
+    // Stores a copy of the page starting at `page`.
+    void insert(uint64_t page, const uint8_t* data);
+    // Updates any cached bytes in [addr, addr + sz) after the tracee's memory was written.
+    void update(uint64_t addr, const void* data, size_t sz);
+    void clear() { m_pages.clear(); }
+
+   private:
+    std::unordered_map<uint64_t, std::unique_ptr<Page>> m_pages;
+};
@@ -0,0 +1,162 @@
+#include "modules.hpp"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "elf.hpp"
+#include "symtab.hpp"
+
+void ModuleMap::rebuild(std::vector<const ELF*> modules) {
+    m_modules = std::move(modules);
+    struct Range {
+        uint64_t start;
+        uint64_t end;
+        uint32_t owner;
+    };
+    std::vector<Range> ranges;
+    m_names.clear();
+    m_deferred.clear();
+    for (uint32_t i = 0; i < m_modules.size(); ++i) {
+        const auto* module = m_modules[i];
+        for (auto [vaddr, memsz] : module->load_segments()) {
+            ranges.push_back({module->base() + vaddr, module->base() + vaddr + memsz, i});
+        }
+        // Modules with deferred symbols answer name lookups through their own hash tables instead.
+        if (!module->symbols_loaded()) {
+            m_deferred.push_back(module);
+            continue;
+        }
+        const auto& symbols = module->symbols();
+        for (size_t j = 0; j < symbols.name_count(); ++j) {
+            m_names.emplace(symbols.name(j), module->base() + symbols.name_addr(j));
+        }
+    }
+    std::sort(ranges.begin(), ranges.end(), [](const Range& a, const Range& b) { return a.start < b.start; });
+    m_starts.clear();
+    m_ends.clear();
+    m_owners.clear();
+    for (const auto& range : ranges) {
+        m_starts.push_back(range.start);
+        m_ends.push_back(range.end);
+        m_owners.push_back(range.owner);
+    }
+}
+
+const ELF* ModuleMap::find(uint64_t addr) const {
+    size_t n = m_starts.size();
+    if (n == 0 || addr < m_starts[0]) {
+        return nullptr;
+    }
+    const uint64_t* base = m_starts.data();
+    while (n > 1) {
+        size_t half = n / 2;
+        base = base[half] <= addr ? base + half : base;
+        n -= half;
+    }
+    size_t i = base - m_starts.data();
+    return addr < m_ends[i] ? m_modules[m_owners[i]] : nullptr;
+}
+
+std::optional<SymbolMatch> ModuleMap::lookup_addr(uint64_t addr) const {
+    const auto* module = find(addr);
+    if (!module) {
+        return {};
+    }
+    return module->lookup_addr(addr);
+}
+
+std::optional<SourceLocation> ModuleMap::lookup_line(uint64_t addr) const {
+    const auto* module = find(addr);
+    if (!module) {
+        return {};
+    }
+    return module->lookup_line(addr);
+}
+
+std::vector<uint64_t> ModuleMap::find_line(std::string_view file, uint32_t line) const {
+    std::vector<uint64_t> addrs;
+    for (const auto* module : m_modules) {
+        // A line can start several times in one function (loop conditions, inlined copies); keep its first address.
+        std::unordered_map<uint64_t, uint64_t> by_function;
+        for (auto addr : module->find_line(file, line)) {
+            auto sym = module->lookup_addr(addr);
+            auto function = sym ? addr - sym->offset : addr;
+            auto [it, inserted] = by_function.emplace(function, addr);
+            if (!inserted) it->second = std::min(it->second, addr);
+        }
+        for (auto [function, addr] : by_function) {
+            addrs.push_back(addr);
+        }
+    }
+    std::sort(addrs.begin(), addrs.end());
+    return addrs;
+}
+
+std::optional<std::pair<const ELF*, GlobalVariable>> ModuleMap::find_global(std::string_view name) const {
+    for (const auto* module : m_modules) {
+        if (auto var = module->debug_info().find_global(name)) {
+            return std::make_pair(module, *var);
+        }
+    }
+    return {};
+}
+
+std::vector<uint64_t> ModuleMap::find_functions(std::string_view pattern) const {
+    std::vector<const ELF*> modules = m_modules;
+    if (auto bang = pattern.find('!'); bang != std::string_view::npos) {
+        const auto* module = find_module(pattern.substr(0, bang));
+        modules.assign(module ? 1 : 0, module);
+        pattern = pattern.substr(bang + 1);
+    }
+    std::vector<uint64_t> addrs;
+    for (const auto* module : modules) {
+        const auto& symbols = module->symbols();
+        for (size_t i = 0; i < symbols.name_count(); ++i) {
+            if (symbols.name(i).find(pattern) != std::string_view::npos) {
+                addrs.push_back(module->base() + symbols.name_addr(i));
+            }
+        }
+    }
+    // Aliases share an address.
+    std::sort(addrs.begin(), addrs.end());
+    addrs.erase(std::unique(addrs.begin(), addrs.end()), addrs.end());
+    return addrs;
+}
+
+std::optional<uint64_t> ModuleMap::lookup_sym(std::string_view name) const {
+    if (auto bang = name.find('!'); bang != std::string_view::npos) {
+        const auto* module = find_module(name.substr(0, bang));
+        if (!module) {
+            return {};
+        }
+        return module->lookup_sym(name.substr(bang + 1));
+    }
+    auto it = m_names.find(name);
+    if (it != m_names.end()) {
+        return it->second;
+    }
+    for (const auto* module : m_deferred) {
+        if (auto addr = module->lookup_sym(name)) {
+            return addr;
+        }
+    }
+    return {};
+}
+
+const ELF* ModuleMap::find_module(std::string_view name) const {
+    for (const auto* module : m_modules) {
+        std::string_view path = module->path();
+        std::string_view basename = path.substr(path.rfind('/') + 1);
+        if (path == name || basename == name ||
+            (basename.starts_with(name) && basename.size() > name.size() && basename[name.size()] == '.')) {
+            return module;
+        }
+    }
+    return nullptr;
+}
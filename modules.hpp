@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <optional>
+#include <string_view>
+#include <utility>
+#include <unordered_map>
+#include <vector>
+
+#include "elf.hpp"
+#include "lines.hpp"
+#include "symtab.hpp"
+
+// Process-wide view of the loaded modules (main executable, dynamic loader and shared libraries). Addresses are routed
+// to their module through a sorted interval array over the modules' loaded segments, then resolved by that module's
+// symbol index. Names go through one global table over the modules whose symbols are loaded, then through the
+// deferred modules' own dynamic hash tables in priority order, or through `module!symbol` to pick a specific module.
+class ModuleMap {
+   public:
+    // Rebuilds the index. `modules` is in symbol lookup priority order and must outlive the map or the next rebuild.
+    void rebuild(std::vector<const ELF*> modules);
+    // Returns the module whose loaded segments contain `addr`.
+    const ELF* find(uint64_t addr) const;
+    std::optional<SymbolMatch> lookup_addr(uint64_t addr) const;
+    std::optional<uint64_t> lookup_sym(std::string_view name) const;
+    std::optional<SourceLocation> lookup_line(uint64_t addr) const;
+    // Returns where code for `file:line` starts in every module: the lowest such address in each function.
+    std::vector<uint64_t> find_line(std::string_view file, uint32_t line) const;
+    // Returns the sorted start addresses of the functions whose names contain `pattern`, in every module or, as
+    // `module!pattern`, in one.
+    std::vector<uint64_t> find_functions(std::string_view pattern) const;
+    // Finds a global variable's definition in the debug info, searching modules in lookup priority order.
+    std::optional<std::pair<const ELF*, GlobalVariable>> find_global(std::string_view name) const;
+
+   private:
+    // Matches `libc.so.6`, `libc` or a full path against a module's path.
+    const ELF* find_module(std::string_view name) const;
+
+    std::vector<const ELF*> m_modules;
+    std::vector<uint64_t> m_starts;
+    std::vector<uint64_t> m_ends;
+    std::vector<uint32_t> m_owners;
+    std::unordered_map<std::string_view, uint64_t> m_names;
+    std::vector<const ELF*> m_deferred;
+};
@@ -5,73 +5,92 @@
 #include <readline/readline.h>  // if you have issues, consider installing readline-dev or readline-devel
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <optional>
+#include <exception>
 #include <string>
+#include <system_error>
 #include <vector>
 
 #include "dbg.hpp"
+#include "xstate.hpp"
 
 std::optional<Register> Operation::get_register(std::string input) {
-    if (input == "r15" || input == "R15")
-        return R15;
-    else if (input == "r14" || input == "R14")
-        return R14;
-    else if (input == "r13" || input == "R13")
-        return R13;
-    else if (input == "r12" || input == "R12")
-        return R12;
-    else if (input == "r11" || input == "R11")
-        return R11;
-    else if (input == "r10" || input == "R10")
-        return R10;
-    else if (input == "r9" || input == "R9")
-        return R9;
-    else if (input == "r8" || input == "R8")
-        return R8;
-    else if (input == "rbp" || input == "RBP")
-        return RBP;
-    else if (input == "rbx" || input == "RBX")
-        return RBX;
-    else if (input == "rax" || input == "RAX")
-        return RAX;
-    else if (input == "rcx" || input == "RCX")
-        return RCX;
-    else if (input == "rdx" || input == "RDX")
-        return RDX;
-    else if (input == "rsi" || input == "RSI")
-        return RSI;
-    else if (input == "rdi" || input == "RDI")
-        return RDI;
-    else if (input == "rip" || input == "RIP")
-        return RIP;
-    else if (input == "rsp" || input == "RSP")
-        return RSP;
-    else if (input == "orig_rax" || input == "ORIG_RAX")
-        return ORIG_RAX;
-    else if (input == "cs" || input == "CS")
-        return CS;
-    else if (input == "eflags" || input == "EFLAGS")
-        return EFLAGS;
-    else if (input == "ss" || input == "SS")
-        return SS;
-    else if (input == "ds" || input == "DS")
-        return DS;
-    else if (input == "es" || input == "ES")
-        return ES;
-    else if (input == "fs" || input == "FS")
-        return FS;
-    else if (input == "gs" || input == "GS")
-        return GS;
-    else if (input == "fs_base" || input == "FS_BASE")
-        return FS_BASE;
-    else if (input == "gs_base" || input == "GS_BASE")
-        return GS_BASE;
-    else {
-        printf("Invalid register `%s`\n", input.c_str());
+    std::string lower = input;
+    for (auto& c : lower) {
+        c = tolower(c);
+    }
+    for (size_t i = 0; i < REGISTER_NAMES.size(); i++) {
+        if (lower == REGISTER_NAMES[i]) {
+            return static_cast<Register>(i);
+        }
+    }
+    printf("Invalid register `%s`\n", input.c_str());
+    return {};
+}
+
+std::optional<VectorLane> Operation::get_vector_lane(std::string arg, size_t lane_size) {
+    std::optional<size_t> lane;
+    if (auto open = arg.find('['); open != std::string::npos && arg.back() == ']') {
+        lane = std::stoul(arg.substr(open + 1, arg.size() - open - 2));
+        arg.resize(open);
+    }
+    auto reg = XState::parse(arg);
+    if (!reg) {
+        printf("Invalid register `%s`\n", arg.c_str());
+        return {};
+    }
+    size_t reg_size = XState::size(*reg);
+    if (lane_size == 0) {
+        lane_size = std::min<size_t>(reg_size, 8);
+    }
+    if (lane_size != 1 && lane_size != 2 && lane_size != 4 && lane_size != 8) {
+        printf("Invalid lane size %zu\n", lane_size);
+        return {};
+    }
+    if (lane_size > reg_size || (lane && *lane >= reg_size / lane_size)) {
+        printf("Lane out of range for `%s`\n", arg.c_str());
         return {};
     }
+    return VectorLane{.reg = *reg, .lane = lane, .lane_size = lane_size};
+}
+
+bool Operation::is_vector_register(const std::string& arg) {
+    return XState::parse(arg.substr(0, arg.find('['))).has_value();
+}
+
+void Operation::read_vector_register(const std::string& arg, size_t lane_size) {
+    auto vl = get_vector_lane(arg, lane_size);
+    if (!vl) {
+        return;
+    }
+    uint8_t buf[64];
+    m_tracee.read_vector_register(vl->reg, buf);
+    size_t first = vl->lane.value_or(0);
+    size_t last = vl->lane ? first + 1 : XState::size(vl->reg) / vl->lane_size;
+    printf("%s = {", arg.c_str());
+    for (size_t i = first; i < last; i++) {
+        uint64_t value = 0;
+        memcpy(&value, buf + i * vl->lane_size, vl->lane_size);
+        printf(i == first ? "%#lx" : ", %#lx", value);
+    }
+    printf("}\n");
+}
+
+void Operation::write_vector_register(const std::string& arg, size_t lane_size, uint64_t value) {
+    auto vl = get_vector_lane(arg, lane_size);
+    if (!vl) {
+        return;
+    }
+    uint8_t buf[64];
+    m_tracee.read_vector_register(vl->reg, buf);
+    memcpy(buf + vl->lane.value_or(0) * vl->lane_size, &value, vl->lane_size);
+    m_tracee.write_vector_register(vl->reg, buf);
+    printf("Written to %s\n", arg.c_str());
 }
 
 std::optional<uint64_t> Operation::get_addr(std::string arg) {
@@ -86,6 +105,96 @@ std::optional<uint64_t> Operation::get_addr(std::string arg) {
     return {};
 }
 
+std::optional<std::pair<uint64_t, size_t>> Operation::get_data_addr(const std::string& arg) {
+    if (!isdigit(arg[0])) {
+        if (auto var = m_tracee.find_global(arg)) {
+            return {{var->first->base() + var->second.addr, var->second.size}};
+        }
+    }
+    if (auto addr = get_addr(arg)) {
+        return {{*addr, 8}};
+    }
+    return {};
+}
+
+void Operation::watch(const std::vector<std::string>& arguments, WatchKind kind) {
+    auto location = get_data_addr(arguments.at(1));
+    if (!location) {
+        return;
+    }
+    auto [addr, len] = *location;
+    if (arguments.size() > 2) {
+        len = std::stoul(arguments.at(2));
+    }
+    if (auto slot = m_tracee.insert_watchpoint({.addr = addr, .len = len, .kind = kind})) {
+        printf("Watchpoint %zu on %zu bytes at %#lx\n", *slot, len, addr);
+    }
+}
+
+void Operation::trace_status() {
+    auto* buffer = m_tracee.trace_buffer();
+    if (!buffer) {
+        printf("No tracepoints\n");
+        return;
+    }
+    buffer->drain();
+    auto hits = buffer->hits();
+    const auto& tracepoints = m_tracee.tracepoints();
+    for (size_t id = 0; id < tracepoints.size(); ++id) {
+        printf("Tracepoint %zu at %#lx%s: %lu hits\n", id, tracepoints[id].addr,
+               tracepoints[id].active ? "" : " (process exited)", hits[id]);
+    }
+    if (auto dropped = buffer->dropped()) {
+        printf("%lu records dropped while the buffer was full\n", dropped);
+    }
+    static constexpr size_t SHOWN = 10;
+    auto records = buffer->recent();
+    for (size_t i = records.size() > SHOWN ? records.size() - SHOWN : 0; i < records.size(); ++i) {
+        const auto& r = records[i];
+        // rdi, rsi and rdx are the first arguments at a function entry.
+        printf("#%lu tp %lu: rip = %#lx, rsp = %#lx, rdi = %#lx, rsi = %#lx, rdx = %#lx", r.seq - 1, r.id,
+               r.regs[TraceRecord::RIP], r.regs[4], r.regs[7], r.regs[6], r.regs[2]);
+        if (r.id < tracepoints.size()) {
+            const auto& memory = tracepoints[r.id].memory;
+            for (size_t j = 0; j < memory.size(); ++j) {
+                printf(", [%#lx] = %#lx", memory[j], r.memory[j]);
+            }
+        }
+        printf("\n");
+    }
+}
+
+std::optional<Condition> Operation::get_condition(const std::vector<std::string>& arguments, size_t first) {
+    std::string text;
+    for (size_t i = first; i < arguments.size(); ++i) {
+        text += (i == first ? "" : " ") + arguments[i];
+    }
+    std::string error;
+    auto condition = m_tracee.compile_condition(text, error);
+    if (!condition) {
+        printf("Bad condition `%s`: %s\n", text.c_str(), error.c_str());
+    }
+    return condition;
+}
+
+void Operation::list_breakpoints() {
+    for (const auto& bp : m_tracee.breakpoint_status()) {
+        printf("%#lx: %lu hits", bp.addr, bp.hits);
+        if (!bp.condition.empty()) {
+            printf(", if %s", bp.condition.c_str());
+        }
+        if (bp.ignore) {
+            printf(", ignoring the next %lu", bp.ignore);
+        }
+        if (auto sym = m_tracee.lookup_addr(bp.addr)) {
+            printf(" (%.*s", static_cast<int>(sym->name.size()), sym->name.data());
+            if (sym->offset) printf("+%#lx", sym->offset);
+            printf(")");
+        }
+        printf("\n");
+    }
+}
+
 std::vector<std::string> Operation::get_tokenize_command() {
     std::vector<std::string> command_arguments;
     std::string command = readline("cydbg> ");
@@ -109,43 +218,163 @@ std::vector<std::string> Operation::get_tokenize_command() {
 
     return command_arguments;
 }
+std::optional<std::pair<std::string, uint32_t>> Operation::get_file_line(const std::string& arg) {
+    auto colon = arg.rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 == arg.size() ||
+        !std::all_of(arg.begin() + colon + 1, arg.end(), [](char c) { return isdigit(c); })) {
+        return {};
+    }
+    return {{arg.substr(0, colon), std::stoul(arg.substr(colon + 1))}};
+}
 
 void Operation::execute_command(const std::vector<std::string>& arguments) {
     std::string command = arguments.at(0);
 
     if (command == "b" || command == "brk" || command == "break" || command == "breakpoint") {
+        // `b LOCATION if CONDITION`; the condition is compiled before anything is inserted.
+        std::optional<Condition> condition;
+        if (arguments.size() > 2 && !arguments.at(2).empty()) {
+            if (arguments.at(2) != "if") {
+                printf("Usage: b LOCATION [if CONDITION]\n");
+                return;
+            }
+            if (!(condition = get_condition(arguments, 3))) {
+                return;
+            }
+        }
+        if (auto file_line = get_file_line(arguments.at(1))) {
+            auto addrs = m_tracee.find_line(file_line->first, file_line->second);
+            if (addrs.empty()) {
+                printf("No code for %s\n", arguments.at(1).c_str());
+            }
+            for (auto addr : addrs) {
+                m_tracee.insert_breakpoint(addr);
+                m_tracee.set_breakpoint_condition(addr, condition);
+                auto loc = m_tracee.lookup_line(addr);
+                printf("Breakpoint added at %#lx", addr);
+                if (loc) printf(" (%.*s:%u)", static_cast<int>(loc->file.size()), loc->file.data(), loc->line);
+                printf("\n");
+            }
+            return;
+        }
         auto addr = get_addr(arguments.at(1));
         if (addr) {
             m_tracee.insert_breakpoint(addr.value());
+            m_tracee.set_breakpoint_condition(addr.value(), std::move(condition));
             printf("Breakpoint added at %#lx\n", addr.value());
         }
+    } else if (command == "rb" || command == "rbreak") {
+        auto addrs = m_tracee.find_functions(arguments.size() > 1 ? arguments.at(1) : "");
+        auto start = std::chrono::steady_clock::now();
+        size_t added = m_tracee.insert_breakpoints(addrs);
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        printf("Added %zu breakpoints on %zu functions in %.1f ms\n", added, addrs.size(), elapsed.count());
+    } else if (command == "condition") {
+        auto addr = get_addr(arguments.at(1));
+        if (!addr) {
+            return;
+        }
+        std::optional<Condition> condition;
+        if (arguments.size() > 2 && !(condition = get_condition(arguments, 2))) {
+            return;
+        }
+        if (!m_tracee.set_breakpoint_condition(*addr, std::move(condition))) {
+            printf("No breakpoint at %#lx\n", *addr);
+        }
+    } else if (command == "ignore") {
+        auto addr = get_addr(arguments.at(1));
+        auto count = std::stoul(arguments.at(2));
+        if (addr && !m_tracee.set_breakpoint_ignore(*addr, count)) {
+            printf("No breakpoint at %#lx\n", *addr);
+        }
+    } else if (command == "bl" || command == "breakpoints") {
+        list_breakpoints();
+    } else if (command == "hb" || command == "hbreak") {
+        auto addr = get_addr(arguments.at(1));
+        if (!addr) {
+            return;
+        }
+        if (auto slot = m_tracee.insert_watchpoint({.addr = *addr, .len = 1, .kind = WatchKind::EXECUTE})) {
+            printf("Hardware breakpoint %zu at %#lx\n", *slot, *addr);
+        }
+    } else if (command == "watch") {
+        watch(arguments, WatchKind::WRITE);
+    } else if (command == "awatch") {
+        watch(arguments, WatchKind::READ_WRITE);
+    } else if (command == "hd" || command == "hdelete") {
+        auto slot = std::stoul(arguments.at(1));
+        if (m_tracee.remove_watchpoint(slot)) {
+            printf("Deleted debug register slot %zu\n", slot);
+        } else {
+            printf("Debug register slot %zu is not in use\n", slot);
+        }
+    } else if (command == "tp" || command == "trace") {
+        auto addr = get_addr(arguments.at(1));
+        std::vector<uint64_t> memory;
+        for (size_t i = 2; i < arguments.size(); ++i) {
+            auto location = get_data_addr(arguments.at(i));
+            if (!location) {
+                return;
+            }
+            memory.push_back(location->first);
+        }
+        if (!addr) {
+            return;
+        }
+        if (auto id = m_tracee.insert_tracepoint(*addr, memory)) {
+            printf("Tracepoint %zu at %#lx\n", *id, *addr);
+        }
+    } else if (command == "ts" || command == "tstatus") {
+        trace_status();
     } else if (command == "bt" || command == "backtrace") {
         std::vector<long> result = m_tracee.backtrace();
         std::cout << "Backtrace:\n";
         for (unsigned long i = 0; i < result.size(); i++) {
             auto addr = result.at(i);
-            auto name = m_tracee.lookup_addr(addr);
+            auto sym = m_tracee.lookup_addr(addr);
 
             std::cout << "#" << i << ": 0x" << std::hex << result.at(i) << std::dec;
-            if (name.has_value()) {
-                std::cout << " (" << *name << ")";
+            if (sym.has_value()) {
+                std::cout << " (" << sym->name;
+                if (sym->offset) {
+                    std::cout << "+0x" << std::hex << sym->offset << std::dec;
+                }
+                std::cout << ")";
+            }
+            // Return addresses may already belong to the next line, so callers are looked up at the call itself.
+            if (auto loc = m_tracee.lookup_line(i == 0 ? addr : addr - 1)) {
+                std::cout << " at " << loc->file << ":" << loc->line;
             }
             std::cout << '\n';
         }
+    } else if (command == "disas" || command == "disassemble") {
+        auto addr = arguments.size() > 1 ? get_addr(arguments.at(1)) : m_tracee.read_register(Register::RIP, 8);
+        int count = arguments.size() > 2 ? std::stoi(arguments.at(2)) : 10;
+        if (addr) {
+            m_tracee.disassemble(count, addr.value());
+        }
     } else if (command == "si" || command == "stepin") {
         std::cout << "Stepping into child\n";
         m_tracee.step_into();
     } else if (command == "rr" || command == "readreg") {
         auto reg_name = arguments.at(1);
+        if (is_vector_register(reg_name)) {
+            read_vector_register(reg_name, arguments.size() > 2 ? std::stoul(arguments.at(2)) : 0);
+            return;
+        }
         auto reg = get_register(reg_name);
         if (reg) {
             printf("%s = %#lx\n", reg_name.c_str(), m_tracee.read_register(reg.value(), 8));
         }
     } else if (command == "wr" || command == "writereg") {
         auto reg_name = arguments.at(1);
-        auto reg = get_register(reg_name);
         auto width = std::stoi(arguments.at(2));
         auto value = std::stoul(arguments.at(3));
+        if (is_vector_register(reg_name)) {
+            write_vector_register(reg_name, width, value);
+            return;
+        }
+        auto reg = get_register(reg_name);
         if (reg) {
             m_tracee.write_register(reg.value(), width, value);
             printf("Written to %s\n", reg_name.c_str());
@@ -155,11 +384,35 @@ void Operation::execute_command(const std::vector<std::string>& arguments) {
     } else if (command == "x" || command == "readmem") {
         auto addr = get_addr(arguments.at(1));
         auto size = std::stoul(arguments.at(2));
-        if (addr) {
-            unsigned long output;
+        if (addr && size <= sizeof(unsigned long)) {
+            unsigned long output = 0;
             m_tracee.read_memory(addr.value(), &output, size);
             printf("%#lx: %#lx\n", addr.value(), output);
+        } else if (addr) {
+            std::vector<uint8_t> output(size);
+            size_t n = m_tracee.read_memory_partial(addr.value(), output.data(), size);
+            for (size_t i = 0; i < n; i += 16) {
+                printf("%#lx:", addr.value() + i);
+                for (size_t j = i; j < std::min(n, i + 16); j++) {
+                    printf(" %02x", output[j]);
+                }
+                printf("\n");
+            }
+            if (n < size) {
+                printf("Cannot access memory at %#lx\n", addr.value() + n);
+            }
         }
+    } else if (command == "p" || command == "print") {
+        auto var = m_tracee.find_global(arguments.at(1));
+        if (!var) {
+            printf("No global variable `%s`\n", arguments.at(1).c_str());
+            return;
+        }
+        auto& [module, global] = *var;
+        std::vector<uint8_t> bytes(global.size);
+        m_tracee.read_memory(module->base() + global.addr, bytes.data(), bytes.size());
+        auto value = module->debug_info().format_value(global.type, bytes);
+        printf("%s = %s\n", arguments.at(1).c_str(), value.c_str());
     } else if (command == "set" || command == "writemem") {
         auto addr = get_addr(arguments.at(1));
         auto size = std::stoul(arguments.at(2));
@@ -177,13 +430,24 @@ void Operation::execute_command(const std::vector<std::string>& arguments) {
                   << "bt/backtrace\n"
                   << "b/brk/break/breakpoint *0xHEXADDR\n"
                   << "b/brk/break/breakpoint SYMBOL\n"
+                  << "b/brk/break/breakpoint FILE:LINE\n"
+                  << "hb/hbreak *0xHEXADDR|SYMBOL\n"
+                  << "watch GLOBAL|*0xHEXADDR [NBYTES]\n"
+                  << "awatch GLOBAL|*0xHEXADDR [NBYTES]\n"
+                  << "hd/hdelete SLOT\n"
+                  << "tp/trace *0xHEXADDR|SYMBOL [GLOBAL|*0xHEXADDR]...\n"
+                  << "ts/tstatus\n"
                   << "c/continue\n"
+                  << "disas/disassemble [*0xHEXADDR|SYMBOL] [COUNT]\n"
                   << "si/stepin\n"
                   << "rr/readreg REG\n"
+                  << "rr/readreg VREG[LANE] [LANEBYTES]\n"
                   << "wr/writereg REG NBYTES VALUE\n"
+                  << "wr/writereg VREG[LANE] LANEBYTES VALUE\n"
                   << "i/inj/inject ___"
                   << "x/readmem *0xHEXADDR SIZE\n"
                   << "x/readmem SYMBOL SIZE\n"
+                  << "p/print GLOBAL\n"
                   << "set/writemem *0xHEXADDR SIZE VALUE\n"
                   << "set/writemem SYMBOL SIZE VALUE\n";
     }
@@ -191,5 +455,13 @@ void Operation::execute_command(const std::vector<std::string>& arguments) {
 
 void Operation::parse_and_run() {
     auto command = get_tokenize_command();
-    execute_command(command);
+    // An error such as malformed or unsupported debug information fails only the command that ran into it. System
+    // errors still end the session.
+    try {
+        execute_command(command);
+    } catch (const std::system_error&) {
+        throw;
+    } catch (const std::exception& e) {
+        printf("Error: %s\n", e.what());
+    }
 }
@@ -4,9 +4,18 @@
 
 #include <optional>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "dbg.hpp"
+#include "xstate.hpp"
+
+// One lane (or, without `lane`, all lanes) of a vector register, as written `xmm0[3]` on the command line.
+struct VectorLane {
+    VectorRegister reg;
+    std::optional<size_t> lane;
+    size_t lane_size;
+};
 
 class Operation {
    public:
@@ -15,7 +24,25 @@ class Operation {
 
    private:
     std::optional<uint64_t> get_addr(std::string arg);
+    // Resolves a global variable or, failing that, an address as get_addr does. Returns the address and the
+    // variable's size (8 for a bare address).
+    std::optional<std::pair<uint64_t, size_t>> get_data_addr(const std::string& arg);
+    // Sets a watchpoint on `arg`, a global variable (watching its whole size by default) or an address.
+    void watch(const std::vector<std::string>& arguments, WatchKind kind);
+    // Joins `arguments` from `first` on into a condition and compiles it, printing the error if it does not compile.
+    std::optional<Condition> get_condition(const std::vector<std::string>& arguments, size_t first);
+    // Lists the breakpoints with their hit counts, conditions and ignore counts.
+    void list_breakpoints();
+    // Prints the tracepoints' hit counts and their most recent records.
+    void trace_status();
+    // Parses `FILE:LINE`, or returns nothing if `arg` has another form.
+    std::optional<std::pair<std::string, uint32_t>> get_file_line(const std::string& arg);
     std::optional<Register> get_register(std::string input);
+    // Parses `VREG` or `VREG[LANE]`. A `lane_size` of 0 picks the default of 8 bytes (or less for smaller registers).
+    std::optional<VectorLane> get_vector_lane(std::string arg, size_t lane_size);
+    bool is_vector_register(const std::string& arg);
+    void read_vector_register(const std::string& arg, size_t lane_size);
+    void write_vector_register(const std::string& arg, size_t lane_size, uint64_t value);
     std::vector<std::string> get_tokenize_command();
     void execute_command(const std::vector<std::string>& arguments);
 
@@ -0,0 +1,191 @@
+#include "relocate.hpp"
+
+#include <capstone/capstone.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <optional>
+#include <span>
+#include <vector>
+
+namespace {
+constexpr uint8_t RBX = 3;
+constexpr uint8_t RSI = 6;
+constexpr uint8_t RDI = 7;
+
+bool is_legacy_prefix(uint8_t byte) {
+    switch (byte) {
+        case 0xf0:
+        case 0xf2:
+        case 0xf3:
+        case 0x2e:
+        case 0x36:
+        case 0x3e:
+        case 0x26:
+        case 0x64:
+        case 0x65:
+        case 0x66:
+        case 0x67:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Returns the ModRM number of the candidate register `reg` is part of, or nothing for other registers.
+std::optional<uint8_t> candidate_of(unsigned reg) {
+    switch (reg) {
+        case X86_REG_RBX:
+        case X86_REG_EBX:
+        case X86_REG_BX:
+        case X86_REG_BL:
+        case X86_REG_BH:
+            return RBX;
+        case X86_REG_RSI:
+        case X86_REG_ESI:
+        case X86_REG_SI:
+        case X86_REG_SIL:
+            return RSI;
+        case X86_REG_RDI:
+        case X86_REG_EDI:
+        case X86_REG_DI:
+        case X86_REG_DIL:
+            return RDI;
+        default:
+            return {};
+    }
+}
+
+// Rewrites the RIP-relative operand of `d` to address off an unused register. Returns false if it cannot.
+bool rebase_rip_operand(DisplacedInsn& d, const cs_detail& detail) {
+    size_t i = 0;
+    while (i < d.size && is_legacy_prefix(d.bytes[i])) {
+        ++i;
+    }
+    std::optional<size_t> rex;
+    if (i < d.size && (d.bytes[i] & 0xf0) == 0x40) {
+        rex = i;
+    } else if (i < d.size && (d.bytes[i] == 0xc4 || d.bytes[i] == 0xc5 || d.bytes[i] == 0x62)) {
+        // VEX and EVEX keep the inverted REX bits inside the prefix; not worth rewriting.
+        return false;
+    }
+    size_t modrm_offset = detail.x86.encoding.modrm_offset;
+    if (modrm_offset == 0 || modrm_offset >= d.size) {
+        return false;
+    }
+    uint8_t modrm = d.bytes[modrm_offset];
+    unsigned used = 0;
+    // Explicit operands, as decoded: a byte operand in the ModRM reg field names AH-BH without a REX prefix but
+    // SPL-DIL with one.
+    for (size_t j = 0; j < detail.x86.op_count; ++j) {
+        const auto& op = detail.x86.operands[j];
+        if (op.type != X86_OP_REG) continue;
+        if (auto reg = candidate_of(op.reg)) used |= 1u << *reg;
+    }
+    // Implicit operands, such as RBX in cmpxchg16b.
+    for (size_t j = 0; j < detail.regs_read_count; ++j) {
+        if (auto reg = candidate_of(detail.regs_read[j])) used |= 1u << *reg;
+    }
+    for (size_t j = 0; j < detail.regs_write_count; ++j) {
+        if (auto reg = candidate_of(detail.regs_write[j])) used |= 1u << *reg;
+    }
+    for (uint8_t reg : {RBX, RSI, RDI}) {
+        if (used & (1u << reg)) {
+            continue;
+        }
+        // mod=10: [reg + disp32], keeping the displacement in place. REX.B would extend the base to r8-r15.
+        d.bytes[modrm_offset] = 0b10 << 6 | (modrm & 0x38) | reg;
+        if (rex) {
+            d.bytes[*rex] &= ~0x1;
+        }
+        d.base_reg = reg;
+        return true;
+    }
+    return false;
+}
+}  // namespace
+
+std::optional<DisplacedInsn> displace_instruction(std::span<const uint8_t> code, uint64_t addr) {
+    csh handle;
+    if (cs_open(CS_ARCH_X86, CS_MODE_64, &handle) != CS_ERR_OK) {
+        return {};
+    }
+    cs_option(handle, CS_OPT_DETAIL, CS_OPT_ON);
+    cs_insn* insn;
+    std::optional<DisplacedInsn> ret;
+    if (cs_disasm(handle, code.data(), std::min(code.size(), DisplacedInsn::MAX_SIZE), addr, 1, &insn) == 1) {
+        DisplacedInsn d;
+        d.size = insn->size;
+        memcpy(d.bytes.data(), insn->bytes, d.size);
+        d.relative_branch = cs_insn_group(handle, insn, X86_GRP_BRANCH_RELATIVE);
+        d.call = cs_insn_group(handle, insn, X86_GRP_CALL);
+        d.syscall = insn->id == X86_INS_SYSCALL;
+        const auto& detail = *insn->detail;
+        bool rip_relative = false;
+        for (size_t i = 0; i < detail.x86.op_count; ++i) {
+            const auto& op = detail.x86.operands[i];
+            rip_relative |= op.type == X86_OP_MEM && op.mem.base == X86_REG_RIP;
+        }
+        if (!rip_relative || rebase_rip_operand(d, detail)) {
+            ret = d;
+        }
+        cs_free(insn, 1);
+    }
+    cs_close(&handle);
+    return ret;
+}
+
+std::optional<RelocatedCode> relocate_instructions(std::span<const uint8_t> code, uint64_t addr, uint64_t new_addr,
+                                                   size_t min_size) {
+    csh handle;
+    if (cs_open(CS_ARCH_X86, CS_MODE_64, &handle) != CS_ERR_OK) {
+        return {};
+    }
+    cs_option(handle, CS_OPT_DETAIL, CS_OPT_ON);
+    cs_insn* insn = cs_malloc(handle);
+    RelocatedCode ret;
+    const uint8_t* p = code.data();
+    size_t left = code.size();
+    uint64_t pc = addr;
+    bool ok = true;
+    while (ok && ret.original_size < min_size) {
+        uint64_t at = new_addr + ret.bytes.size();
+        if (!cs_disasm_iter(handle, &p, &left, &pc, insn)) {
+            ok = false;
+            break;
+        }
+        std::vector<uint8_t> bytes(insn->bytes, insn->bytes + insn->size);
+        const auto& x86 = insn->detail->x86;
+        // Both kinds of field are relative to the end of the instruction, which moves by the same amount as its start.
+        auto adjust = [&](size_t offset) {
+            int32_t field;
+            memcpy(&field, &bytes[offset], sizeof(field));
+            int64_t moved = field + static_cast<int64_t>(insn->address - at);
+            if (moved != static_cast<int32_t>(moved)) {
+                return false;
+            }
+            field = moved;
+            memcpy(&bytes[offset], &field, sizeof(field));
+            return true;
+        };
+        bool rip_relative = false;
+        for (size_t i = 0; i < x86.op_count; ++i) {
+            rip_relative |= x86.operands[i].type == X86_OP_MEM && x86.operands[i].mem.base == X86_REG_RIP;
+        }
+        if (rip_relative) {
+            ok = x86.encoding.disp_size == 4 && adjust(x86.encoding.disp_offset);
+        } else if (cs_insn_group(handle, insn, X86_GRP_BRANCH_RELATIVE)) {
+            ok = x86.encoding.imm_size == 4 && adjust(x86.encoding.imm_offset);
+        }
+        ret.bytes.insert(ret.bytes.end(), bytes.begin(), bytes.end());
+        ret.original_size += insn->size;
+    }
+    cs_free(insn, 1);
+    cs_close(&handle);
+    if (!ok) {
+        return {};
+    }
+    return ret;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <optional>
+#include <span>
+#include <vector>
+
+// An instruction rewritten to run at another address for one single step, as in displaced stepping. After the step
+// the debugger finishes what the move broke: see the fields below.
+struct DisplacedInsn {
+    static constexpr size_t MAX_SIZE = 15;
+
+    std::array<uint8_t, MAX_SIZE> bytes{};
+    uint8_t size = 0;
+    // For RIP-relative operands: the number (0-7, in ModRM order) of a general purpose register the instruction does
+    // not use. The operand is rewritten to address off that register instead, so it must hold the original address
+    // of the next instruction during the step and get its own value back afterwards.
+    std::optional<uint8_t> base_reg;
+    // Relative jumps and calls land relative to the copy; the target is moved back by the displacement.
+    bool relative_branch = false;
+    // Calls push the address after the copy, which is replaced with the address after the original.
+    bool call = false;
+    // `syscall` saves the address after the copy in RCX.
+    bool syscall = false;
+};
+
+// Decodes the instruction at the start of `code`, which lives at `addr`, and prepares it to be displaced. Returns
+// nothing if it cannot be decoded or relocated (RIP-relative VEX and EVEX instructions).
+std::optional<DisplacedInsn> displace_instruction(std::span<const uint8_t> code, uint64_t addr);
+
+// Whole instructions copied to another address for good, as for the trampoline of a tracepoint.
+struct RelocatedCode {
+    std::vector<uint8_t> bytes;
+    // How many bytes of the original they replace.
+    size_t original_size = 0;
+};
+
+// Copies whole instructions from the start of `code`, which lives at `addr`, until at least `min_size` bytes are
+// covered, rewritten to run at `new_addr`: RIP-relative displacements and rel32 branch targets are adjusted to reach
+// the same addresses. Returns nothing if an instruction cannot be decoded or moved (rel8 branches, and anything whose
+// target would be out of rel32 range).
+std::optional<RelocatedCode> relocate_instructions(std::span<const uint8_t> code, uint64_t addr, uint64_t new_addr,
+                                                   size_t min_size);
@@ -0,0 +1,320 @@
+#include "symtab.hpp"
+
+#include <elf.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+// Which of several aliases at the same address to report: the name with the fewest leading underscores (malloc over
+// __libc_malloc, puts over _IO_puts), then global over weak over local.
+int alias_rank(uint8_t bind, const char* name) {
+    int rank = bind == STB_GLOBAL ? 0 : bind == STB_WEAK ? 1 : 2;
+    int underscores = 0;
+    while (name[underscores] == '_') {
+        ++underscores;
+    }
+    return std::min(underscores, 255) * 4 + rank;
+}
+
+uint32_t hash_name(std::string_view name) {
+    uint32_t h = 2166136261u;
+    for (char c : name) {
+        h = (h ^ static_cast<uint8_t>(c)) * 16777619u;
+    }
+    return h;
+}
+
+constexpr char INDEX_MAGIC[8] = {'C', 'Y', 'D', 'B', 'G', 'S', 'Y', 'M'};
+constexpr uint32_t INDEX_VERSION = 2;
+
+// On-disk layout: this header, the key, then each array 8-byte aligned in the order of the counts, then the strings.
+struct IndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t key_size;
+    uint64_t n_entries;
+    uint64_t n_named;
+    uint64_t n_slots;
+    uint64_t strings_size;
+};
+
+size_t align8(size_t n) { return (n + 7) & ~size_t{7}; }
+}  // namespace
+
+void SymbolIndex::use_owned() {
+    m_starts = m_owned->starts;
+    m_sizes = m_owned->sizes;
+    m_names = m_owned->names;
+    m_parents = m_owned->parents;
+    m_named_addrs = m_owned->named_addrs;
+    m_named_names = m_owned->named_names;
+    m_slots = m_owned->slots;
+}
+
+void SymbolIndex::finish(const char* strings) {
+    m_strings = strings;
+    m_mapping.reset();
+    m_owned = std::make_unique<Owned>();
+    auto& o = *m_owned;
+
+    // Names keep the first definition added, before the address sort reorders things.
+    std::unordered_map<std::string_view, uint32_t> seen;
+    for (const auto& sym : m_pending) {
+        if (seen.emplace(strings + sym.name, o.named_addrs.size()).second) {
+            o.named_addrs.push_back(sym.start);
+            o.named_names.push_back(sym.name);
+        }
+    }
+    size_t n_slots = 1;
+    while (n_slots < 2 * o.named_addrs.size()) {
+        n_slots *= 2;
+    }
+    o.slots.assign(n_slots, NONE);
+    for (uint32_t i = 0; i < o.named_addrs.size(); ++i) {
+        size_t slot = hash_name(strings + o.named_names[i]) & (n_slots - 1);
+        while (o.slots[slot] != NONE) {
+            slot = (slot + 1) & (n_slots - 1);
+        }
+        o.slots[slot] = i;
+    }
+
+    // Larger symbols first at equal starts, so nested symbols come after the symbols that contain them.
+    std::sort(m_pending.begin(), m_pending.end(), [&](const Symbol& a, const Symbol& b) {
+        if (a.start != b.start) return a.start < b.start;
+        if (a.size != b.size) return a.size > b.size;
+        return alias_rank(a.bind, strings + a.name) < alias_rank(b.bind, strings + b.name);
+    });
+    for (size_t i = 0; i < m_pending.size(); ++i) {
+        const auto& sym = m_pending[i];
+        // Aliases, and unsized labels at the start of a sized symbol, add nothing.
+        if (i > 0 && sym.start == m_pending[i - 1].start && (sym.size == m_pending[i - 1].size || sym.size == 0)) {
+            continue;
+        }
+        o.starts.push_back(sym.start);
+        o.sizes.push_back(static_cast<uint32_t>(std::min<uint64_t>(sym.size, UINT32_MAX)));
+        o.names.push_back(sym.name);
+    }
+    m_pending.clear();
+    m_pending.shrink_to_fit();
+
+    for (size_t i = 0; i < o.starts.size(); ++i) {
+        if (o.sizes[i] == 0) {
+            uint64_t next = i + 1 < o.starts.size() ? o.starts[i + 1] : o.starts[i] + 1;
+            o.sizes[i] = static_cast<uint32_t>(std::min<uint64_t>(std::max<uint64_t>(next - o.starts[i], 1), UINT32_MAX));
+        }
+    }
+
+    o.parents.assign(o.starts.size(), NONE);
+    std::vector<uint32_t> open;
+    for (uint32_t i = 0; i < o.starts.size(); ++i) {
+        while (!open.empty() && o.starts[open.back()] + o.sizes[open.back()] <= o.starts[i]) {
+            open.pop_back();
+        }
+        if (!open.empty()) {
+            o.parents[i] = open.back();
+        }
+        open.push_back(i);
+    }
+    use_owned();
+}
+
+std::optional<SymbolMatch> SymbolIndex::lookup(uint64_t addr) const {
+    size_t n = m_starts.size();
+    if (n == 0 || addr < m_starts[0]) {
+        return {};
+    }
+    // Find the last entry starting at or before addr without a data-dependent branch.
+    const uint64_t* base = m_starts.data();
+    while (n > 1) {
+        size_t half = n / 2;
+        base = base[half] <= addr ? base + half : base;
+        n -= half;
+    }
+    for (uint32_t i = base - m_starts.data(); i != NONE; i = m_parents[i]) {
+        if (addr - m_starts[i] < m_sizes[i]) {
+            return SymbolMatch{m_strings + m_names[i], addr - m_starts[i]};
+        }
+    }
+    return {};
+}
+
+std::optional<uint64_t> SymbolIndex::find(std::string_view name) const {
+    if (m_slots.empty()) {
+        return {};
+    }
+    size_t mask = m_slots.size() - 1;
+    for (size_t slot = hash_name(name) & mask; m_slots[slot] != NONE; slot = (slot + 1) & mask) {
+        uint32_t i = m_slots[slot];
+        if (this->name(i) == name) {
+            return m_named_addrs[i];
+        }
+    }
+    return {};
+}
+
+void SymbolIndex::save(const std::string& path, std::string_view key) const {
+    // Gather the referenced names into a private string table so the file does not depend on the ELF's layout.
+    std::string strings;
+    std::unordered_map<uint64_t, uint64_t> remap;
+    auto intern = [&](uint64_t off) {
+        auto [it, inserted] = remap.emplace(off, strings.size());
+        if (inserted) {
+            strings.append(m_strings + off);
+            strings.push_back('\0');
+        }
+        return it->second;
+    };
+    std::vector<uint64_t> names(m_names.size()), named_names(m_named_names.size());
+    std::transform(m_names.begin(), m_names.end(), names.begin(), intern);
+    std::transform(m_named_names.begin(), m_named_names.end(), named_names.begin(), intern);
+
+    IndexHeader hdr{};
+    memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.version = INDEX_VERSION;
+    hdr.key_size = key.size();
+    hdr.n_entries = m_starts.size();
+    hdr.n_named = m_named_addrs.size();
+    hdr.n_slots = m_slots.size();
+    hdr.strings_size = strings.size();
+
+    std::string out;
+    auto put = [&out](const void* data, size_t sz) {
+        out.append(static_cast<const char*>(data), sz);
+        out.resize(align8(out.size()));
+    };
+    put(&hdr, sizeof(hdr));
+    put(key.data(), key.size());
+    put(m_starts.data(), m_starts.size_bytes());
+    put(m_sizes.data(), m_sizes.size_bytes());
+    put(names.data(), names.size() * sizeof(uint64_t));
+    put(m_parents.data(), m_parents.size_bytes());
+    put(m_named_addrs.data(), m_named_addrs.size_bytes());
+    put(named_names.data(), named_names.size() * sizeof(uint64_t));
+    put(m_slots.data(), m_slots.size_bytes());
+    put(strings.data(), strings.size());
+
+    // Write to a temporary file and rename it into place so concurrent debuggers never see a partial index.
+    std::string tmp = path + ".tmp." + std::to_string(getpid());
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return;
+    }
+    bool ok = write(fd, out.data(), out.size()) == static_cast<ssize_t>(out.size());
+    close(fd);
+    if (!ok || rename(tmp.c_str(), path.c_str()) < 0) {
+        unlink(tmp.c_str());
+    }
+}
+
+bool SymbolIndex::load(const std::string& path, std::string_view key) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) < 0 || static_cast<size_t>(sb.st_size) < sizeof(IndexHeader)) {
+        close(fd);
+        return false;
+    }
+    size_t size = sb.st_size;
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    std::shared_ptr<const uint8_t> mapping(static_cast<const uint8_t*>(map),
+                                           [size](const uint8_t* p) { munmap(const_cast<uint8_t*>(p), size); });
+
+    IndexHeader hdr;
+    memcpy(&hdr, map, sizeof(hdr));
+    if (memcmp(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic)) != 0 || hdr.version != INDEX_VERSION ||
+        hdr.key_size != key.size() || hdr.n_entries > size || hdr.n_named > size || hdr.n_slots > size) {
+        return false;
+    }
+    size_t off = align8(sizeof(hdr));
+    auto take = [&](size_t bytes) -> const uint8_t* {
+        if (off > size || bytes > size - off) {
+            return nullptr;
+        }
+        const auto* p = mapping.get() + off;
+        off = align8(off + bytes);
+        return p;
+    };
+    const auto* file_key = take(key.size());
+    if (!file_key || memcmp(file_key, key.data(), key.size()) != 0) {
+        return false;
+    }
+    const auto* starts = take(hdr.n_entries * sizeof(uint64_t));
+    const auto* sizes = take(hdr.n_entries * sizeof(uint32_t));
+    const auto* names = take(hdr.n_entries * sizeof(uint64_t));
+    const auto* parents = take(hdr.n_entries * sizeof(uint32_t));
+    const auto* named_addrs = take(hdr.n_named * sizeof(uint64_t));
+    const auto* named_names = take(hdr.n_named * sizeof(uint64_t));
+    const auto* slots = take(hdr.n_slots * sizeof(uint32_t));
+    const auto* strings = take(hdr.strings_size);
+    if (!starts || !sizes || !names || !parents || !named_addrs || !named_names || !slots || !strings ||
+        hdr.n_slots <= hdr.n_named || (hdr.n_slots & (hdr.n_slots - 1)) != 0 ||
+        (hdr.strings_size > 0 && strings[hdr.strings_size - 1] != 0)) {
+        return false;
+    }
+    // Every index the lookups follow must stay in bounds: names inside the string table, parents strictly earlier
+    // (so the walk ends), and slots naming a symbol, with at least one empty slot to stop each probe.
+    auto in_strings = [&](const uint8_t* p, size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            uint64_t v;
+            memcpy(&v, p + i * sizeof(v), sizeof(v));
+            if (v >= hdr.strings_size) return false;
+        }
+        return true;
+    };
+    if (!in_strings(names, hdr.n_entries) || !in_strings(named_names, hdr.n_named)) {
+        return false;
+    }
+    for (size_t i = 0; i < hdr.n_entries; ++i) {
+        uint32_t parent;
+        memcpy(&parent, parents + i * sizeof(parent), sizeof(parent));
+        if (parent != NONE && parent >= i) {
+            return false;
+        }
+    }
+    size_t empty_slots = 0;
+    for (size_t i = 0; i < hdr.n_slots; ++i) {
+        uint32_t slot;
+        memcpy(&slot, slots + i * sizeof(slot), sizeof(slot));
+        if (slot == NONE) {
+            ++empty_slots;
+        } else if (slot >= hdr.n_named) {
+            return false;
+        }
+    }
+    if (empty_slots == 0) {
+        return false;
+    }
+
+    m_pending.clear();
+    m_owned.reset();
+    m_mapping = std::move(mapping);
+    m_strings = reinterpret_cast<const char*>(strings);
+    m_starts = {reinterpret_cast<const uint64_t*>(starts), hdr.n_entries};
+    m_sizes = {reinterpret_cast<const uint32_t*>(sizes), hdr.n_entries};
+    m_names = {reinterpret_cast<const uint64_t*>(names), hdr.n_entries};
+    m_parents = {reinterpret_cast<const uint32_t*>(parents), hdr.n_entries};
+    m_named_addrs = {reinterpret_cast<const uint64_t*>(named_addrs), hdr.n_named};
+    m_named_names = {reinterpret_cast<const uint64_t*>(named_names), hdr.n_named};
+    m_slots = {reinterpret_cast<const uint32_t*>(slots), hdr.n_slots};
+    return true;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A symbol containing a looked up address, and the address's offset into it.
+struct SymbolMatch {
+    std::string_view name;
+    uint64_t offset;
+};
+
+// A module's symbol table, indexed both ways. Addresses go through an address-sorted interval array searched with a
+// branchless binary search; entries are parallel arrays so the search only touches the start addresses. Names go
+// through an open-addressing hash table. All of it is flat, so it can be saved to disk and mapped back in as is.
+class SymbolIndex {
+   public:
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    // A symbol to add. `name` is an offset into the string table passed to finish(), `bind` is its STB_* binding.
+    struct Symbol {
+        uint64_t start;
+        uint64_t size;
+        uint64_t name;
+        uint8_t bind;
+    };
+
+    void add(const Symbol& sym) { m_pending.push_back(sym); }
+    // Sorts the symbols, collapses aliases, links overlapping symbols and hashes the names. Must be called before
+    // any lookups.
+    void finish(const char* strings);
+    // Returns the innermost symbol whose range contains `addr`. Symbols without a size extend to the next symbol.
+    std::optional<SymbolMatch> lookup(uint64_t addr) const;
+    // Returns the address of the first symbol added with this name.
+    std::optional<uint64_t> find(std::string_view name) const;
+
+    // Number of distinct names, and the name and address of each, for building process-wide tables.
+    size_t name_count() const { return m_named_addrs.size(); }
+    std::string_view name(size_t i) const { return m_strings + m_named_names[i]; }
+    uint64_t name_addr(size_t i) const { return m_named_addrs[i]; }
+
+    // Writes the index to `path`, tagged with `key` so a stale file is never loaded for a different module.
+    void save(const std::string& path, std::string_view key) const;
+    // Maps a previously saved index. Returns false if the file is missing, corrupt or has a different key.
+    bool load(const std::string& path, std::string_view key);
+
+   private:
+    // Points the spans at the owned vectors after building.
+    void use_owned();
+
+    std::vector<Symbol> m_pending;
+    const char* m_strings = nullptr;
+
+    std::span<const uint64_t> m_starts;
+    std::span<const uint32_t> m_sizes;
+    std::span<const uint64_t> m_names;
+    // Index of the closest earlier entry whose range contains this entry's start, or NONE.
+    std::span<const uint32_t> m_parents;
+    std::span<const uint64_t> m_named_addrs;
+    std::span<const uint64_t> m_named_names;
+    // Hash slots holding an index into the named arrays, or NONE. The size is a power of two.
+    std::span<const uint32_t> m_slots;
+
+    struct Owned {
+        std::vector<uint64_t> starts;
+        std::vector<uint32_t> sizes;
+        std::vector<uint64_t> names;
+        std::vector<uint32_t> parents;
+        std::vector<uint64_t> named_addrs;
+        std::vector<uint64_t> named_names;
+        std::vector<uint32_t> slots;
+    };
+    // Backing storage: either built in memory or a mapped index file.
+    std::unique_ptr<Owned> m_owned;
+    std::shared_ptr<const uint8_t> m_mapping;
+};
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Fixed-size pool of worker threads running tasks in FIFO order. Because tasks start in submission order, a task may
+// safely wait on the futures of tasks submitted before it.
+class ThreadPool {
+   public:
+    explicit ThreadPool(size_t threads = std::thread::hardware_concurrency());
+    ThreadPool(const ThreadPool& other) = delete;
+    ThreadPool& operator=(const ThreadPool& other) = delete;
+    ~ThreadPool();
+
+    // Queues `f` and returns a future for its result. Exceptions thrown by `f` are rethrown by the future.
+    template <typename F>
+    std::future<std::invoke_result_t<F>> submit(F f) {
+        auto task = std::make_shared<std::packaged_task<std::invoke_result_t<F>()>>(std::move(f));
+        auto future = task->get_future();
+        {
+            std::lock_guard lock(m_mutex);
+            m_tasks.emplace_back([task] { (*task)(); });
+        }
+        m_cv.notify_one();
+        return future;
+    }
+
+    // The pool shared by the whole debugger.
+    static ThreadPool& global();
+
+   private:
+    void worker();
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<std::function<void()>> m_tasks;
+    bool m_stop = false;
+    std::vector<std::thread> m_threads;
+};
@@ -0,0 +1,234 @@
+#include "tracepoint.hpp"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <initializer_list>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stop_token>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "relocate.hpp"
+#include "util.hpp"
+
+static_assert(sizeof(TraceRecord) <= TraceBuffer::RECORD_SIZE);
+static_assert(TraceBuffer::RECORD_SIZE == 1 << 8, "the trampoline scales the slot index with a shift by 8");
+
+TraceBuffer::TraceBuffer() {
+    m_fd = util::throw_errno(memfd_create("cydbg-trace", MFD_CLOEXEC));
+    util::throw_errno(ftruncate(m_fd, SIZE));
+    void* map = mmap(nullptr, SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (map == MAP_FAILED) {
+        util::throw_errno();
+    }
+    m_map = static_cast<uint8_t*>(map);
+}
+
+TraceBuffer::~TraceBuffer() {
+    // The drain thread reads the mapping, so it has to stop before the mapping goes.
+    if (m_drainer.joinable()) {
+        m_drainer.request_stop();
+        m_drainer.join();
+    }
+    munmap(m_map, SIZE);
+    close(m_fd);
+}
+
+void TraceBuffer::start() {
+    if (m_drainer.joinable()) {
+        return;
+    }
+    m_drainer = std::jthread([this](std::stop_token stop) {
+        while (!stop.stop_requested()) {
+            drain();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+}
+
+void TraceBuffer::drain() {
+    std::lock_guard lock(m_mutex);
+    uint64_t tail = header(TAIL_OFFSET);
+    uint64_t head = std::atomic_ref(header(HEAD_OFFSET)).load(std::memory_order_acquire);
+    for (; tail < head; ++tail) {
+        auto* slot = reinterpret_cast<TraceRecord*>(m_map + RECORDS_OFFSET + (tail % CAPACITY) * RECORD_SIZE);
+        // A reserved slot whose trampoline has not finished writing it yet; the next drain picks it up.
+        if (std::atomic_ref(slot->seq).load(std::memory_order_acquire) != tail + 1) {
+            break;
+        }
+        const TraceRecord& record = *slot;
+        ++m_hits[record.id];
+        if (m_recent.size() < MAX_KEPT) {
+            m_recent.push_back(record);
+        } else {
+            m_recent[m_recent_next] = record;
+            m_recent_next = (m_recent_next + 1) % MAX_KEPT;
+        }
+    }
+    // The slots up to the new tail may be reused as soon as it is published.
+    std::atomic_ref(header(TAIL_OFFSET)).store(tail, std::memory_order_release);
+}
+
+std::unordered_map<uint64_t, uint64_t> TraceBuffer::hits() {
+    std::lock_guard lock(m_mutex);
+    return m_hits;
+}
+
+std::vector<TraceRecord> TraceBuffer::recent() {
+    std::lock_guard lock(m_mutex);
+    std::vector<TraceRecord> ret(m_recent.begin() + m_recent_next, m_recent.end());
+    ret.insert(ret.end(), m_recent.begin(), m_recent.begin() + m_recent_next);
+    return ret;
+}
+
+uint64_t TraceBuffer::dropped() const {
+    return std::atomic_ref(header(DROPPED_OFFSET)).load(std::memory_order_relaxed);
+}
+
+namespace {
+// Registers in ModRM numbering.
+constexpr uint8_t RAX = 0;
+constexpr uint8_t RCX = 1;
+constexpr uint8_t RDX = 2;
+constexpr uint8_t RSP = 4;
+
+// The trampoline's stack after its saves: rdx, rcx, rax and the flags, above the skipped red zone.
+constexpr int32_t RED_ZONE = 128;
+constexpr int32_t SAVED_RDX = 0;
+constexpr int32_t SAVED_RCX = 8;
+constexpr int32_t SAVED_RAX = 16;
+constexpr int32_t SAVED_FLAGS = 24;
+constexpr int32_t ENTRY_RSP = 32 + RED_ZONE;
+
+constexpr int32_t REGS_OFFSET = offsetof(TraceRecord, regs);
+constexpr int32_t MEMORY_OFFSET = offsetof(TraceRecord, memory);
+
+// Appends machine code for the few instruction forms the trampoline uses.
+struct Emitter {
+    std::vector<uint8_t> code;
+
+    void bytes(std::initializer_list<uint8_t> b) { code.insert(code.end(), b); }
+    void imm32(uint32_t value) {
+        bytes({uint8_t(value), uint8_t(value >> 8), uint8_t(value >> 16), uint8_t(value >> 24)});
+    }
+    void imm64(uint64_t value) {
+        imm32(value);
+        imm32(value >> 32);
+    }
+    // movabs $value, %rdx
+    void load_rdx(uint64_t value) {
+        bytes({0x48, 0xba});
+        imm64(value);
+    }
+    // mov disp32(%rsp), %rdx
+    void load_rdx_from_stack(int32_t disp) {
+        bytes({0x48, 0x8b, 0x94, 0x24});
+        imm32(disp);
+    }
+    // mov %reg, disp32(%rcx)
+    void store(uint8_t reg, int32_t disp) {
+        bytes({uint8_t(0x48 | (reg >= 8 ? 0x4 : 0)), 0x89, uint8_t(0x81 | (reg & 7) << 3)});
+        imm32(disp);
+    }
+    // Emits a jump with a rel32 field to fill in later, returning the field's offset.
+    size_t jump(std::initializer_list<uint8_t> opcode) {
+        bytes(opcode);
+        imm32(0);
+        return code.size() - 4;
+    }
+    void patch(size_t field, size_t target) {
+        int32_t rel = static_cast<int32_t>(target - (field + 4));
+        memcpy(&code[field], &rel, sizeof(rel));
+    }
+};
+}  // namespace
+
+std::optional<Trampoline> build_trampoline(uint64_t at, uint64_t ring, uint64_t id, uint64_t addr,
+                                           std::span<const uint8_t> code, std::span<const uint64_t> memory) {
+    util::throw_assert(memory.size() <= TraceRecord::MAX_MEMORY, "too many tracepoint memory slots");
+    Emitter e;
+    e.bytes({0x48, 0x8d, 0x64, 0x24, 0x80});  // lea -128(%rsp), %rsp
+    e.bytes({0x9c, 0x50, 0x51, 0x52});        // pushfq; push %rax; push %rcx; push %rdx
+    e.load_rdx(ring);
+
+    // Reserve a slot: advance the head unless the ring is full.
+    size_t retry = e.code.size();
+    e.bytes({0x48, 0x8b, 0x02});                                     // mov (%rdx), %rax
+    e.bytes({0x48, 0x89, 0xc1});                                     // mov %rax, %rcx
+    e.bytes({0x48, 0x2b, 0x4a, uint8_t(TraceBuffer::TAIL_OFFSET)});  // sub TAIL(%rdx), %rcx
+    e.bytes({0x48, 0x81, 0xf9});                                     // cmp $CAPACITY, %rcx
+    e.imm32(TraceBuffer::CAPACITY);
+    size_t to_drop = e.jump({0x0f, 0x83});    // jae drop
+    e.bytes({0x48, 0x8d, 0x48, 0x01});        // lea 1(%rax), %rcx
+    e.bytes({0xf0, 0x48, 0x0f, 0xb1, 0x0a});  // lock cmpxchg %rcx, (%rdx)
+    e.patch(e.jump({0x0f, 0x85}), retry);     // jne retry
+
+    // %rcx = the slot for ticket %rax.
+    e.bytes({0x48, 0x89, 0xc1});  // mov %rax, %rcx
+    e.bytes({0x48, 0x81, 0xe1});  // and $(CAPACITY - 1), %rcx
+    e.imm32(TraceBuffer::CAPACITY - 1);
+    e.bytes({0x48, 0xc1, 0xe1, 0x08});  // shl $8, %rcx
+    e.bytes({0x48, 0x8d, 0x8c, 0x0a});  // lea RECORDS(%rdx, %rcx), %rcx
+    e.imm32(TraceBuffer::RECORDS_OFFSET);
+
+    // The registers, with those the trampoline has used taken from where it saved them.
+    for (uint8_t reg = 0; reg < 16; ++reg) {
+        int32_t disp = REGS_OFFSET + reg * 8;
+        if (reg == RAX || reg == RCX || reg == RDX) {
+            e.load_rdx_from_stack(reg == RAX ? SAVED_RAX : reg == RCX ? SAVED_RCX : SAVED_RDX);
+            e.store(RDX, disp);
+        } else if (reg == RSP) {
+            e.bytes({0x48, 0x8d, 0x94, 0x24});  // lea ENTRY_RSP(%rsp), %rdx
+            e.imm32(ENTRY_RSP);
+            e.store(RDX, disp);
+        } else {
+            e.store(reg, disp);
+        }
+    }
+    e.load_rdx(addr);
+    e.store(RDX, REGS_OFFSET + TraceRecord::RIP * 8);
+    e.load_rdx_from_stack(SAVED_FLAGS);
+    e.store(RDX, REGS_OFFSET + TraceRecord::EFLAGS * 8);
+    e.load_rdx(id);
+    e.store(RDX, offsetof(TraceRecord, id));
+    for (size_t i = 0; i < memory.size(); ++i) {
+        e.load_rdx(memory[i]);
+        e.bytes({0x48, 0x8b, 0x12});  // mov (%rdx), %rdx
+        e.store(RDX, MEMORY_OFFSET + i * 8);
+    }
+    // Publish the record last; x86 keeps stores in order.
+    e.bytes({0x48, 0x8d, 0x50, 0x01});  // lea 1(%rax), %rdx
+    e.store(RDX, offsetof(TraceRecord, seq));
+    size_t to_done = e.jump({0xe9});
+
+    e.patch(to_drop, e.code.size());
+    e.bytes({0xf0, 0x48, 0xff, 0x42, uint8_t(TraceBuffer::DROPPED_OFFSET)});  // lock incq DROPPED(%rdx)
+
+    e.patch(to_done, e.code.size());
+    e.bytes({0x5a, 0x59, 0x58, 0x9d});                          // pop %rdx; pop %rcx; pop %rax; popfq
+    e.bytes({0x48, 0x8d, 0xa4, 0x24, 0x80, 0x00, 0x00, 0x00});  // lea 128(%rsp), %rsp
+
+    // The jump to the trampoline is 5 bytes, so at least that much has to move here.
+    auto relocated = relocate_instructions(code, addr, at + e.code.size(), 5);
+    if (!relocated) {
+        return {};
+    }
+    e.code.insert(e.code.end(), relocated->bytes.begin(), relocated->bytes.end());
+    size_t back = e.jump({0xe9});
+    int64_t rel = static_cast<int64_t>(addr + relocated->original_size) - static_cast<int64_t>(at + back + 4);
+    if (rel != static_cast<int32_t>(rel)) {
+        return {};
+    }
+    int32_t rel32 = rel;
+    memcpy(&e.code[back], &rel32, sizeof(rel32));
+    return Trampoline{.bytes = std::move(e.code), .window = relocated->original_size};
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stop_token>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// What a tracepoint's trampoline records on each hit. The layout is shared with the generated code.
+struct TraceRecord {
+    static constexpr size_t MAX_MEMORY = 4;
+    // General purpose registers in ModRM order (rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi, r8-r15), then rip and
+    // eflags. rsp is the value at the tracepoint.
+    static constexpr size_t RIP = 16;
+    static constexpr size_t EFLAGS = 17;
+    static constexpr size_t NUM_REGS = 18;
+
+    // The record's ticket plus one, stored last; until then the record is still being written.
+    uint64_t seq;
+    uint64_t id;
+    uint64_t regs[NUM_REGS];
+    // Eight bytes from each of the tracepoint's memory addresses.
+    uint64_t memory[MAX_MEMORY];
+};
+
+// A ring of TraceRecords in a memfd, mapped both here and into the tracee. Trampolines reserve slots by advancing the
+// head with a compare-and-swap and count a drop instead when the ring is full; a background thread drains it without
+// stopping the tracee.
+class TraceBuffer {
+   public:
+    static constexpr size_t RECORD_SIZE = 256;
+    static constexpr size_t CAPACITY = 1 << 14;
+    // The header: head, tail and drop count, padded to one record.
+    static constexpr size_t HEAD_OFFSET = 0;
+    static constexpr size_t TAIL_OFFSET = 8;
+    static constexpr size_t DROPPED_OFFSET = 16;
+    static constexpr size_t RECORDS_OFFSET = RECORD_SIZE;
+    static constexpr size_t SIZE = RECORDS_OFFSET + CAPACITY * RECORD_SIZE;
+    // Drained records kept for display; older ones are only counted.
+    static constexpr size_t MAX_KEPT = 1024;
+
+    TraceBuffer();
+    TraceBuffer(const TraceBuffer& other) = delete;
+    TraceBuffer& operator=(const TraceBuffer& other) = delete;
+    ~TraceBuffer();
+
+    // The memfd, for the tracee to open through /proc/<pid>/fd.
+    int fd() const { return m_fd; }
+    // Starts the drain thread, if it is not running yet.
+    void start();
+    // Drains whatever is in the ring now. Thread-safe.
+    void drain();
+    // Hits per tracepoint id, and the most recent records in order, drained so far.
+    std::unordered_map<uint64_t, uint64_t> hits();
+    std::vector<TraceRecord> recent();
+    // Records the trampolines could not store because the ring was full.
+    uint64_t dropped() const;
+
+   private:
+    uint64_t& header(size_t offset) const { return *reinterpret_cast<uint64_t*>(m_map + offset); }
+
+    int m_fd = -1;
+    uint8_t* m_map = nullptr;
+    std::mutex m_mutex;
+    std::unordered_map<uint64_t, uint64_t> m_hits;
+    std::vector<TraceRecord> m_recent;
+    size_t m_recent_next = 0;
+    std::jthread m_drainer;
+};
+
+// A tracepoint installed in the tracee. Its id is its index in Tracee::tracepoints().
+struct Tracepoint {
+    uint64_t addr;
+    // The number of bytes at `addr` the jump to the trampoline replaced.
+    size_t window;
+    std::vector<uint64_t> memory;
+    // Cleared when the process it was installed in exits.
+    bool active = true;
+};
+
+struct Trampoline {
+    std::vector<uint8_t> bytes;
+    size_t window = 0;
+};
+
+// Generates the trampoline for tracepoint `id`, to be placed at `at`. It saves the flags and the registers it uses
+// (below the red zone), appends a record to the tracee's mapping of a TraceBuffer at `ring`, restores everything,
+// runs the instructions displaced from `addr` (the original bytes `code`) and jumps back after them. Returns nothing
+// if those instructions cannot be relocated; see relocate_instructions.
+std::optional<Trampoline> build_trampoline(uint64_t at, uint64_t ring, uint64_t id, uint64_t addr,
+                                           std::span<const uint8_t> code, std::span<const uint64_t> memory);
@@ -0,0 +1,167 @@
+#include "unwind.hpp"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <exception>
+#include <optional>
+
+#include "dwarf.hpp"
+#include "elf.hpp"
+
+bool StackSnapshot::read(uint64_t addr, void* out, size_t size) const {
+    if (addr < base || addr - base > bytes.size() || size > bytes.size() - (addr - base)) {
+        return false;
+    }
+    memcpy(out, bytes.data() + (addr - base), size);
+    return true;
+}
+
+const UnwindPlan* UnwindPlanCache::find(uint64_t pc) {
+    auto it = m_index.find(pc);
+    if (it == m_index.end()) {
+        return nullptr;
+    }
+    m_plans.splice(m_plans.begin(), m_plans, it->second);
+    return &it->second->second;
+}
+
+const UnwindPlan& UnwindPlanCache::insert(uint64_t pc, const UnwindPlan& plan) {
+    if (m_plans.size() >= MAX_PLANS) {
+        m_index.erase(m_plans.back().first);
+        m_plans.pop_back();
+    }
+    m_plans.emplace_front(pc, plan);
+    m_index[pc] = m_plans.begin();
+    return m_plans.front().second;
+}
+
+void UnwindPlanCache::clear() {
+    m_plans.clear();
+    m_index.clear();
+    m_expressions.clear();
+}
+
+bool Unwinder::step(Frame& frame) const {
+    // A return address points after the call, which may already be past the end of the calling function.
+    auto pc = frame.exact_pc ? frame.pc() : frame.pc() - 1;
+    // CFI or an expression we cannot handle ends the backtrace at this frame.
+    try {
+        const auto* plan = m_plans.find(pc);
+        if (!plan) {
+            plan = &m_plans.insert(pc, make_plan(pc));
+        }
+        return plan->use_frame_pointer ? step_frame_pointer(frame) : step_cfi(*plan, frame);
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+UnwindPlan Unwinder::make_plan(uint64_t pc) const {
+    UnwindPlan plan;
+    const auto* module = m_modules.find(pc);
+    auto fde = module ? module->find_fde(pc - module->base()) : std::nullopt;
+    if (!fde) {
+        plan.use_frame_pointer = true;
+        return plan;
+    }
+    auto row = DWARF::execute_cfi(*fde, pc - module->base(), module->eh_frame_bases());
+    plan.signal_frame = fde->cie->is_signal_frame;
+    plan.ra_column = fde->cie->return_address_register;
+    plan.cfa = row.cfa;
+    for (uint8_t reg = 0; reg < DWARF::NUM_CFI_REGISTERS; ++reg) {
+        if (row.regs[reg].kind != DWARF::RegisterRule::SAME_VALUE) {
+            plan.rules[plan.num_rules++] = {reg, row.regs[reg]};
+        }
+    }
+    return plan;
+}
+
+bool Unwinder::step_cfi(const UnwindPlan& plan, Frame& frame) const {
+    using DWARF::RegisterRule;
+    DWARF::ExpressionContext ctx{
+        [&](uint16_t reg) -> std::optional<uint64_t> {
+            if (reg >= DWARF::NUM_CFI_REGISTERS || !frame.has(reg)) return {};
+            return frame.regs[reg];
+        },
+        [&](uint64_t addr, size_t size) -> std::optional<uint64_t> {
+            uint64_t value = 0;
+            if (!m_read_memory(addr, &value, size)) return {};
+            return value;
+        },
+    };
+
+    auto& expressions = m_plans.expressions();
+    std::optional<uint64_t> cfa;
+    if (plan.cfa.is_expression) {
+        cfa = expressions.get(plan.cfa.expr).evaluate(ctx);
+    } else if (auto base = ctx.read_register(plan.cfa.reg)) {
+        cfa = *base + plan.cfa.offset;
+    }
+    if (!cfa) {
+        return false;
+    }
+
+    // Registers without a rule keep their value, which is what x86-64 CFI assumes for the callee-saved ones.
+    Frame caller = frame;
+    for (size_t i = 0; i < plan.num_rules; ++i) {
+        const auto& [reg, rule] = plan.rules[i];
+        std::optional<uint64_t> value;
+        switch (rule.kind) {
+            case RegisterRule::SAME_VALUE:
+                continue;
+            case RegisterRule::UNDEFINED:
+                break;
+            case RegisterRule::OFFSET:
+                value = ctx.read_memory(*cfa + rule.value, sizeof(uint64_t));
+                break;
+            case RegisterRule::VAL_OFFSET:
+                value = *cfa + rule.value;
+                break;
+            case RegisterRule::REGISTER:
+                value = ctx.read_register(rule.value);
+                break;
+            case RegisterRule::EXPRESSION:
+                if (auto addr = expressions.get(rule.expr).evaluate(ctx, *cfa)) {
+                    value = ctx.read_memory(*addr, sizeof(uint64_t));
+                }
+                break;
+            case RegisterRule::VAL_EXPRESSION:
+                value = expressions.get(rule.expr).evaluate(ctx, *cfa);
+                break;
+        }
+        caller.regs[reg] = value.value_or(0);
+        caller.known = value ? caller.known | 1u << reg : caller.known & ~(1u << reg);
+    }
+
+    // The CFA is by definition the caller's stack pointer at the call site.
+    caller.regs[DWARF::REG_RSP] = *cfa;
+    caller.known |= 1u << DWARF::REG_RSP;
+    auto ra = plan.ra_column;
+    caller.regs[DWARF::REG_RA] = caller.regs[ra];
+    caller.known = caller.has(ra) ? caller.known | 1u << DWARF::REG_RA : caller.known & ~(1u << DWARF::REG_RA);
+    // An undefined return address marks the outermost frame.
+    if (!caller.has(DWARF::REG_RA) || caller.pc() == 0) {
+        return false;
+    }
+    caller.exact_pc = plan.signal_frame;
+    frame = caller;
+    return true;
+}
+
+bool Unwinder::step_frame_pointer(Frame& frame) const {
+    if (!frame.has(DWARF::REG_RBP)) {
+        return false;
+    }
+    uint64_t bp = frame.regs[DWARF::REG_RBP];
+    uint64_t saved[2];
+    if (bp == 0 || !m_read_memory(bp, saved, sizeof(saved)) || saved[1] == 0) {
+        return false;
+    }
+    frame.regs[DWARF::REG_RBP] = saved[0];
+    frame.regs[DWARF::REG_RA] = saved[1];
+    frame.regs[DWARF::REG_RSP] = bp + sizeof(saved);
+    frame.known |= 1u << DWARF::REG_RBP | 1u << DWARF::REG_RA | 1u << DWARF::REG_RSP;
+    frame.exact_pc = false;
+    return true;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <functional>
+#include <list>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "dwarf.hpp"
+#include "elf.hpp"
+#include "modules.hpp"
+
+// The registers of one stack frame, indexed by DWARF register number. The return address column holds the frame's pc.
+struct Frame {
+    std::array<uint64_t, DWARF::NUM_CFI_REGISTERS> regs{};
+    // Bit i is set if regs[i] is known.
+    uint32_t known = 0;
+    // Whether pc is the instruction being executed rather than a return address (the innermost and signal frames).
+    bool exact_pc = true;
+
+    uint64_t pc() const { return regs[DWARF::REG_RA]; }
+    bool has(uint16_t reg) const { return known >> reg & 1; }
+};
+
+// A copy of the live stack taken in one transfer, so unwinding does not need a syscall per saved register.
+struct StackSnapshot {
+    uint64_t base = 0;
+    std::vector<uint8_t> bytes;
+
+    // Copies [addr, addr + size) out of the snapshot, returning false if any of it lies outside.
+    bool read(uint64_t addr, void* out, size_t size) const;
+};
+
+// The unwind row in effect at one pc, reduced to the registers whose rule is not SAME_VALUE.
+struct UnwindPlan {
+    // No CFI covers the pc, so the frame pointer chain is followed instead.
+    bool use_frame_pointer = false;
+    bool signal_frame = false;
+    uint8_t ra_column = DWARF::REG_RA;
+    uint8_t num_rules = 0;
+    DWARF::CfaRule cfa;
+    std::array<std::pair<uint8_t, DWARF::RegisterRule>, DWARF::NUM_CFI_REGISTERS> rules;
+};
+
+// Bounded LRU of unwind plans keyed by pc, along with the compiled forms of their CFA and register expressions. Both
+// point into the modules' mappings, so the owner must clear the cache whenever the module list changes.
+class UnwindPlanCache {
+   public:
+    static constexpr size_t MAX_PLANS = 4096;
+
+    // Returns the plan for `pc` and marks it most recently used, or nullptr on a miss.
+    const UnwindPlan* find(uint64_t pc);
+    // Stores the plan for `pc`, evicting the least recently used one if the cache is full.
+    const UnwindPlan& insert(uint64_t pc, const UnwindPlan& plan);
+    DWARF::ExpressionCache& expressions() { return m_expressions; }
+    void clear();
+
+   private:
+    DWARF::ExpressionCache m_expressions;
+    std::list<std::pair<uint64_t, UnwindPlan>> m_plans;
+    std::unordered_map<uint64_t, std::list<std::pair<uint64_t, UnwindPlan>>::iterator> m_index;
+};
+
+// Walks the stack with .eh_frame call frame information, falling back to the RBP chain for code without any. The
+// rules for each pc are evaluated once and then reused from `plans`.
+class Unwinder {
+   public:
+    // Reads `size` bytes of tracee memory, returning false if any of them is unreadable.
+    using ReadMemory = std::function<bool(uint64_t addr, void* out, size_t size)>;
+
+    Unwinder(const ModuleMap& modules, UnwindPlanCache& plans, ReadMemory read_memory)
+        : m_modules(modules), m_plans(plans), m_read_memory(std::move(read_memory)) {}
+    // Replaces `frame` with its caller's. Returns false at the outermost frame or if the caller cannot be recovered.
+    bool step(Frame& frame) const;
+
+   private:
+    UnwindPlan make_plan(uint64_t pc) const;
+    bool step_cfi(const UnwindPlan& plan, Frame& frame) const;
+    bool step_frame_pointer(Frame& frame) const;
+
+    const ModuleMap& m_modules;
+    UnwindPlanCache& m_plans;
+    ReadMemory m_read_memory;
+};
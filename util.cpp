@@ -1,3 +1,69 @@
 #include "util.hpp"
 
-namespace util {}  // namespace util
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace {
+size_t find_nul_scalar(const char* p, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        if (p[i] == 0) {
+            return i;
+        }
+    }
+    return n;
+}
+
+#if defined(__x86_64__)
+// SSE2 is part of the x86-64 baseline, so this is always available there.
+size_t find_nul_sse2(const char* p, size_t n) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + find_nul_scalar(p + i, n - i);
+}
+
+__attribute__((target("avx2"))) size_t find_nul_avx2(const char* p, size_t n) {
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + find_nul_sse2(p + i, n - i);
+}
+#endif
+
+using find_nul_fn = size_t (*)(const char*, size_t);
+
+find_nul_fn select_find_nul() {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return find_nul_avx2;
+    }
+    return find_nul_sse2;
+#else
+    return find_nul_scalar;
+#endif
+}
+}  // namespace
+
+namespace util {
+size_t find_nul(const char* p, size_t n) {
+    static const find_nul_fn impl = select_find_nul();
+    return impl(p, n);
+}
+}  // namespace util
@@ -1,12 +1,16 @@
 #pragma once
 
 #include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
 
 #include <source_location>
 #include <system_error>
 
 namespace util {
+// Returns the index of the first NUL byte in [p, p + n), or n if there is none. Uses AVX2 or SSE2 when available.
+size_t find_nul(const char* p, size_t n);
+
 // Throws a std::system_error if errno is non-zero
 inline void throw_errno(std::source_location loc = std::source_location::current()) {
     if (errno != 0) {
@@ -0,0 +1,196 @@
+#include "xstate.hpp"
+
+#include <cpuid.h>
+#include <elf.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "util.hpp"
+
+namespace {
+// XSAVE state components used here, numbered as in XCR0 and XSTATE_BV.
+constexpr int SSE = 1;
+constexpr int AVX = 2;
+constexpr int OPMASK = 5;
+constexpr int ZMM_HI256 = 6;
+constexpr int HI16_ZMM = 7;
+
+// Offsets into the legacy (FXSAVE) region and the XSAVE header.
+constexpr size_t MXCSR_OFFSET = 24;
+constexpr size_t XMM_OFFSET = 160;
+constexpr size_t XSTATE_BV_OFFSET = 512;
+constexpr size_t LEGACY_SIZE = 512;
+
+struct Layout {
+    uint64_t xcr0 = 0;
+    size_t max_size = 0;
+    size_t offsets[8] = {};
+};
+
+// The kernel exposes the standard (non-compacted) format, whose component offsets come from CPUID leaf 0xd.
+const Layout& layout() {
+    static const Layout l = [] {
+        Layout l;
+        unsigned eax, ebx, ecx, edx;
+        __cpuid(1, eax, ebx, ecx, edx);
+        if (!(ecx & bit_OSXSAVE)) {
+            return l;
+        }
+        uint32_t lo, hi;
+        asm volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+        l.xcr0 = (static_cast<uint64_t>(hi) << 32) | lo;
+        __cpuid_count(0xd, 0, eax, ebx, ecx, edx);
+        l.max_size = ecx;
+        for (int i = AVX; i <= HI16_ZMM; ++i) {
+            __cpuid_count(0xd, i, eax, ebx, ecx, edx);
+            l.offsets[i] = ebx;
+        }
+        return l;
+    }();
+    return l;
+}
+}  // namespace
+
+std::optional<VectorRegister> XState::parse(std::string_view name) {
+    std::string lower(name);
+    for (auto& c : lower) {
+        c = tolower(c);
+    }
+    if (lower == "mxcsr") {
+        return VectorRegister{VectorKind::MXCSR};
+    }
+    struct Prefix {
+        std::string_view name;
+        VectorKind kind;
+        int count;
+    };
+    static constexpr Prefix prefixes[] = {
+        {"xmm", VectorKind::XMM, 32},
+        {"ymm", VectorKind::YMM, 32},
+        {"zmm", VectorKind::ZMM, 32},
+        {"k", VectorKind::K, 8},
+    };
+    for (const auto& prefix : prefixes) {
+        std::string_view rest(lower);
+        if (!rest.starts_with(prefix.name) || rest.size() == prefix.name.size()) {
+            continue;
+        }
+        rest.remove_prefix(prefix.name.size());
+        if (!std::all_of(rest.begin(), rest.end(), isdigit) || rest.size() > 2) {
+            return {};
+        }
+        int index = std::stoi(std::string(rest));
+        if (index >= prefix.count) {
+            return {};
+        }
+        return VectorRegister{prefix.kind, index};
+    }
+    return {};
+}
+
+size_t XState::size(VectorRegister reg) {
+    switch (reg.kind) {
+        case VectorKind::XMM:
+            return 16;
+        case VectorKind::YMM:
+            return 32;
+        case VectorKind::ZMM:
+            return 64;
+        case VectorKind::K:
+            return 8;
+        case VectorKind::MXCSR:
+            return 4;
+    }
+    __builtin_unreachable();
+}
+
+std::vector<XState::Piece> XState::pieces(VectorRegister reg) const {
+    const auto& off = layout().offsets;
+    int i = reg.index;
+    // Registers 16-31 only exist as whole zmm registers in the Hi16_ZMM component.
+    if (i >= 16 && reg.kind != VectorKind::K) {
+        return {{off[HI16_ZMM] + 64 * (i - 16), size(reg), HI16_ZMM}};
+    }
+    switch (reg.kind) {
+        case VectorKind::MXCSR:
+            return {{MXCSR_OFFSET, 4, SSE}};
+        case VectorKind::K:
+            return {{off[OPMASK] + 8 * i, 8, OPMASK}};
+        case VectorKind::XMM:
+            return {{XMM_OFFSET + 16 * i, 16, SSE}};
+        case VectorKind::YMM:
+            return {{XMM_OFFSET + 16 * i, 16, SSE}, {off[AVX] + 16 * i, 16, AVX}};
+        case VectorKind::ZMM:
+            return {{XMM_OFFSET + 16 * i, 16, SSE}, {off[AVX] + 16 * i, 16, AVX}, {off[ZMM_HI256] + 32 * i, 32, ZMM_HI256}};
+    }
+    __builtin_unreachable();
+}
+
+void XState::load(pid_t pid, size_t len) {
+    if (len <= m_loaded) {
+        return;
+    }
+    // The kernel rejects lengths that are not a multiple of 8 with EINVAL. Pieces inside the legacy area (MXCSR at
+    // 24 + 4) would end off that grid, so the whole legacy area is always fetched.
+    len = (std::max(len, LEGACY_SIZE) + 7) & ~size_t{7};
+    m_buf.resize(std::max(m_buf.size(), std::max(len, layout().max_size)));
+    iovec iov = {m_buf.data(), len};
+    util::throw_errno(ptrace(PTRACE_GETREGSET, pid, NT_X86_XSTATE, &iov));
+    m_loaded = iov.iov_len;
+    if (iov.iov_len < len) {
+        m_full_size = iov.iov_len;
+    }
+}
+
+void XState::read(pid_t pid, VectorRegister reg, void* out) {
+    auto* p = static_cast<uint8_t*>(out);
+    for (const auto& piece : pieces(reg)) {
+        util::throw_assert(piece.component == SSE || (layout().xcr0 & (1UL << piece.component)),
+                           "register not supported by this CPU");
+        load(pid, piece.offset + piece.size);
+        util::throw_assert(piece.offset + piece.size <= m_loaded, "register not provided by the kernel");
+        memcpy(p, m_buf.data() + piece.offset, piece.size);
+        p += piece.size;
+    }
+}
+
+void XState::write(pid_t pid, VectorRegister reg, const void* data) {
+    load(pid, layout().max_size);
+    m_full_size = m_loaded;
+    util::throw_assert(m_full_size > LEGACY_SIZE, "XSAVE area unavailable");
+    const auto* p = static_cast<const uint8_t*>(data);
+    uint64_t xstate_bv;
+    memcpy(&xstate_bv, m_buf.data() + XSTATE_BV_OFFSET, sizeof(xstate_bv));
+    for (const auto& piece : pieces(reg)) {
+        util::throw_assert(piece.component == SSE || (layout().xcr0 & (1UL << piece.component)),
+                           "register not supported by this CPU");
+        util::throw_assert(piece.offset + piece.size <= m_full_size, "register not provided by the kernel");
+        memcpy(m_buf.data() + piece.offset, p, piece.size);
+        // A component left in its init state is ignored on write, so mark it as live.
+        xstate_bv |= 1UL << piece.component;
+        p += piece.size;
+    }
+    memcpy(m_buf.data() + XSTATE_BV_OFFSET, &xstate_bv, sizeof(xstate_bv));
+    m_dirty = true;
+}
+
+void XState::flush(pid_t pid) {
+    if (m_dirty) {
+        iovec iov = {m_buf.data(), m_full_size};
+        util::throw_errno(ptrace(PTRACE_SETREGSET, pid, NT_X86_XSTATE, &iov));
+    }
+    reset();
+}
+
+void XState::reset() {
+    m_loaded = 0;
+    m_dirty = false;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <optional>
+#include <string_view>
+#include <vector>
+
+// Registers stored in the XSAVE area rather than user_regs_struct.
+enum class VectorKind { XMM, YMM, ZMM, K, MXCSR };
+
+struct VectorRegister {
+    VectorKind kind;
+    int index = 0;
+};
+
+// Per-stop cache of the tracee's XSAVE area, fetched with PTRACE_GETREGSET(NT_X86_XSTATE). Only the prefix of the
+// area up to the highest state component a request touches is transferred, so reading xmm registers never pulls in
+// the AVX-512 state. Writes fetch the whole area, since the kernel only accepts complete buffers, and are written
+// back by flush().
+class XState {
+   public:
+    // Parses names such as "xmm3", "ymm17", "zmm31", "k2" and "mxcsr".
+    static std::optional<VectorRegister> parse(std::string_view name);
+    // Size of a register in bytes.
+    static size_t size(VectorRegister reg);
+
+    // Reads size(reg) bytes of `reg` into `out`.
+    void read(pid_t pid, VectorRegister reg, void* out);
+    // Replaces the value of `reg` with size(reg) bytes from `data`.
+    void write(pid_t pid, VectorRegister reg, const void* data);
+    // Writes the area back if it was modified. Must be called before the child resumes.
+    void flush(pid_t pid);
+    // Forgets the cached state.
+    void reset();
+
+   private:
+    // A contiguous piece of a register within the XSAVE area, belonging to state component `component`.
+    struct Piece {
+        size_t offset;
+        size_t size;
+        int component;
+    };
+
+    std::vector<Piece> pieces(VectorRegister reg) const;
+    // Makes sure at least the first `len` bytes of the area have been fetched.
+    void load(pid_t pid, size_t len);
+
+    std::vector<uint8_t> m_buf;
+    size_t m_loaded = 0;
+    // Size of the full area as reported by the kernel, known after the first full fetch.
+    size_t m_full_size = 0;
+    bool m_dirty = false;
+};